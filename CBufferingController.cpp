@@ -0,0 +1,263 @@
+/*
+ * Implementation of the CBufferingController class.
+ */
+
+#include "CBufferingController.h"
+#include "CVMUSBReadoutList.h"
+#include <algorithm>
+#include <cmath>
+
+/*!
+   \param vmusb     : CVMUSB&
+      The controller to manage.
+   \param latencyMs : double
+      How long an event may take from its trigger to the host.
+
+   The starting settings are the ones vme::vmUSBInit and vme::mvmeInit
+   write: one event per buffer, 5 s bulk timeout, IRQ on every event.
+*/
+CBufferingController::CBufferingController(CVMUSB& vmusb, double latencyMs) :
+  m_vmusb(vmusb),
+  m_latencyMs(latencyMs),
+  m_minDwell(5.0),
+  m_smoothing(0.3),
+  m_amod(CVMUSBReadoutList::a32PrivProgram),
+  m_pSink(0),
+  m_pauseLatencyMs(200),
+  m_action(0),
+  m_rate(0.0),
+  m_bytesPerTrigger(0.0),
+  m_lastBytes(0),
+  m_lastUpdate(0.0),
+  m_lastSwitch(0.0),
+  m_switches(0)
+{
+  m_current.bufferLength    = CVMUSB::GlobalModeRegister::bufferLenSingle;
+  m_current.eventsPerBuffer = 1;
+  m_current.bulkTimeout     = 5;
+  m_current.irqThreshold    = 1;
+}
+
+/*!
+   The Mesytec modules whose IRQ threshold is managed.
+*/
+void
+CBufferingController::setModules(const std::vector<uint32_t>& modules, uint8_t amod)
+{
+  m_modules = modules;
+  m_amod    = amod;
+}
+
+/*!
+   Where the buffers that are drained while pausing go; normally the run's
+   CVMUSBBufferParser so nothing is lost across a switch.
+*/
+void
+CBufferingController::setPauseSink(CVMUSB::BufferSink* pSink, int maxLatencyMs)
+{
+  m_pSink          = pSink;
+  m_pauseLatencyMs = maxLatencyMs;
+}
+
+/*!
+   Feed the controller the latest statistics, typically once per scaler
+   event.  If the settings for the current rate differ enough from the
+   ones in force, and the last switch is at least the minimum dwell time
+   ago, data taking is paused, the new settings are written and data
+   taking resumes.  Nothing is switched without a pause sink (see
+   setPauseSink), the drained buffers would be lost.
+
+   \param scalers : accepted trigger rate.
+   \param stream  : parser statistics, for the bytes per trigger.
+   \param now     : time in seconds (CDeadTimeMonitor::wallClock()).
+
+   \return bool - true if the settings were switched, false if not needed
+                  or not possible (see apply).
+*/
+bool
+CBufferingController::update(const CDeadTimeMonitor::Sample& scalers,
+			     const CVMUSBBufferParser::Statistics& stream, double now)
+{
+  if (stream.bytes < m_lastBytes) clearStatistics();   // The parser's were cleared.
+
+  double dt = now - m_lastUpdate;
+  if ((m_lastUpdate > 0.0) && (dt > 0.0) && (scalers.acceptedRate > 0.0)) {
+    double bytes = stream.bytes - m_lastBytes;
+    double perTrigger = bytes / (scalers.acceptedRate * dt);
+    m_bytesPerTrigger = (m_bytesPerTrigger > 0.0) ?
+      (1.0 - m_smoothing) * m_bytesPerTrigger + m_smoothing * perTrigger : perTrigger;
+  }
+  // Rises are smoothed, drops are followed at once: a stale high rate
+  // would leave events waiting in the modules for a threshold that is
+  // no longer reached in time.
+
+  m_rate       = (m_lastUpdate > 0.0) ?
+    (1.0 - m_smoothing) * m_rate + m_smoothing * scalers.acceptedRate : scalers.acceptedRate;
+  m_rate       = std::min(m_rate, scalers.acceptedRate);
+  m_lastBytes  = stream.bytes;
+  m_lastUpdate = now;
+
+  Settings next = choose(m_rate, m_bytesPerTrigger);
+  if (!m_pSink || !worthSwitching(next, now)) return false;
+
+  if (!apply(next)) return false;
+  m_lastSwitch = now;
+  return true;
+}
+
+/*!
+   Start over from the next update, as if it were the first.  Call it
+   along with the parser's clearStatistics; the byte count going back
+   is also taken to mean that.
+*/
+void
+CBufferingController::clearStatistics()
+{
+  m_lastBytes  = 0;
+  m_lastUpdate = 0.0;
+}
+
+/*!
+   The settings for a trigger rate.  Half the latency budget goes to the
+   modules: they raise their IRQ after as many events as arrive in that
+   time.  The other half goes to the VM-USB: a buffer holds as many stack
+   events as arrive in that time, or is a full 13K buffer if those would
+   not fit in one.
+
+   \param rate            : double - accepted triggers per second.
+   \param bytesPerTrigger : double - data per trigger, 0 if not known yet.
+*/
+CBufferingController::Settings
+CBufferingController::choose(double rate, double bytesPerTrigger) const
+{
+  double   half   = m_latencyMs / 2000.0;                  // Seconds.
+  Settings result;
+
+  double triggers = std::floor(rate * half);
+  result.irqThreshold = static_cast<uint16_t>(std::max(1.0, std::min(triggers, double(maxIrqThreshold))));
+
+  double stackEvents = std::floor(rate / result.irqThreshold * half);
+  stackEvents        = std::max(1.0, std::min(stackEvents, double(maxEventsPerBuffer)));
+  double bufferBytes = stackEvents * bytesPerTrigger * result.irqThreshold;
+  if (bufferBytes >= bufferBytes13K) {
+    result.bufferLength    = CVMUSB::GlobalModeRegister::bufferLen13K;
+    result.eventsPerBuffer = maxEventsPerBuffer;
+  }
+  else {
+    result.bufferLength    = CVMUSB::GlobalModeRegister::bufferLenSingle;
+    result.eventsPerBuffer = static_cast<uint16_t>(stackEvents);
+  }
+
+  // The bulk timeout only matters when the rate drops; it has 1 s units.
+
+  double timeout     = std::ceil(m_latencyMs / 1000.0);
+  result.bulkTimeout = static_cast<uint8_t>(std::max(1.0, std::min(timeout, 15.0)));
+  return result;
+}
+
+/*!
+   Write a set of settings.
+
+   \param settings : Settings - what to write.
+   \param running  : bool     - data taking is on: stop it (draining the
+                                VM-USB into the pause sink) before the
+                                writes and restart it after.
+
+   \return bool - false if nothing was switched: running without a pause
+                  sink, the drain did not reach the last buffer, or the
+                  IRQ threshold list failed (the modules may then hold a
+                  mix, the VM-USB keeps its settings).  Data taking is
+                  resumed either way.
+
+   \throw whatever the CVMUSB register access throws.
+*/
+bool
+CBufferingController::apply(const Settings& settings, bool running)
+{
+  if (running) {
+    if (!m_pSink) return false;
+    if (m_vmusb.stopAndDrain(m_pSink, 0, m_pauseLatencyMs, m_action) != 0) {
+      m_vmusb.writeActionRegister(m_action | CVMUSB::ActionRegister::startDAQ);
+      return false;
+    }
+  }
+
+  if (!m_modules.empty()) {
+    CVMUSBReadoutList list;
+    for (size_t i = 0; i < m_modules.size(); i++) {
+      list.addWrite16(m_modules[i] | irqThresholdReg, m_amod, settings.irqThreshold);
+    }
+    uint16_t reply;
+    size_t   replyBytes;
+    if (m_vmusb.executeList(list, &reply, sizeof(reply), &replyBytes) < 0) {
+      if (running) m_vmusb.writeActionRegister(m_action | CVMUSB::ActionRegister::startDAQ);
+      return false;
+    }
+  }
+
+  uint16_t mode = m_vmusb.readGlobalMode();
+  mode = (mode & ~CVMUSB::GlobalModeRegister::bufferLenMask) |
+    (settings.bufferLength << CVMUSB::GlobalModeRegister::bufferLenShift);
+  m_vmusb.writeGlobalMode(mode);
+  m_vmusb.writeEventsPerBuffer(settings.eventsPerBuffer);
+
+  uint32_t setup = m_vmusb.readBulkXferSetup();
+  setup = (setup & ~CVMUSB::TransferSetupRegister::timeoutMask) |
+    (static_cast<uint32_t>(settings.bulkTimeout) << CVMUSB::TransferSetupRegister::timeoutShift);
+  m_vmusb.writeBulkXferSetup(setup);
+
+  if (running) {
+    m_vmusb.writeActionRegister(m_action | CVMUSB::ActionRegister::startDAQ);
+  }
+  m_current = settings;
+  m_switches++;
+  return true;
+}
+
+/*!
+   Print the settings in force and the rate they were chosen for.
+*/
+void
+CBufferingController::dump(std::ostream& str) const
+{
+  str << (m_current.throughputMode() ? "Throughput" : "Latency") << " mode at "
+      << m_rate << "Hz (" << m_bytesPerTrigger << " bytes/trigger): ";
+  if (m_current.bufferLength == CVMUSB::GlobalModeRegister::bufferLen13K) {
+    str << "13K buffers";
+  }
+  else {
+    str << m_current.eventsPerBuffer << " events/buffer";
+  }
+  str << ", bulk timeout " << static_cast<unsigned>(m_current.bulkTimeout) << "s"
+      << ", IRQ threshold " << m_current.irqThreshold
+      << ", " << m_switches << " switches\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Utilities:
+
+// Switching costs a pause, so only switch when something changed category
+// or by at least a factor of two, and towards more buffering only once the
+// dwell time is over.  Switching towards less buffering is never delayed,
+// that is what keeps the latency bounded when the rate falls.
+
+static bool
+farApart(unsigned a, unsigned b)
+{
+  return (a >= 2*b) || (b >= 2*a);
+}
+
+bool
+CBufferingController::worthSwitching(const Settings& next, double now) const
+{
+  bool lessBuffering = (next.irqThreshold < m_current.irqThreshold) ||
+                       (next.eventsPerBuffer < m_current.eventsPerBuffer) ||
+                       (next.bulkTimeout < m_current.bulkTimeout);
+  if (!lessBuffering && (m_switches > 0) && ((now - m_lastSwitch) < m_minDwell)) return false;
+
+  return (next.bufferLength != m_current.bufferLength)              ||
+         (next.bulkTimeout  != m_current.bulkTimeout)               ||
+         (next.throughputMode() != m_current.throughputMode())      ||
+         farApart(next.eventsPerBuffer, m_current.eventsPerBuffer)  ||
+         farApart(next.irqThreshold, m_current.irqThreshold);
+}
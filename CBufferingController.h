@@ -0,0 +1,99 @@
+/*
+ * This file defines the CBufferingController class which trades delivery latency against throughput
+ * while a run is going. At low trigger rates every event should reach the host right away; at high rates
+ * the VM-USB should ship big buffers and the Mesytec modules should collect several events per IRQ.
+ * The controller watches the accepted trigger rate (CDeadTimeMonitor) and the event size seen in the
+ * data stream (CVMUSBBufferParser) and, when the right settings have moved far enough, briefly pauses
+ * data taking to rewrite:
+ *
+ *   - the global mode buffer length and the events per buffer register,
+ *   - the bulk transfer timeout (the host side bound on a partly filled buffer),
+ *   - the irq_event_threshold of every Mesytec module it was given.
+ *
+ * The latency budget is split evenly between the modules (events waiting for their IRQ) and the VM-USB
+ * (events waiting for their buffer to fill).
+ *
+ * The buffers drained during a pause go to the pause sink (setPauseSink), normally the run's parser; until
+ * one is set update() never switches. A switch whose drain or module writes fail is given up, data taking
+ * resumes with the settings in force.
+ */
+
+#ifndef CBufferingController_H
+#define CBufferingController_H
+
+#include "CVMUSB.h"
+#include "CDeadTimeMonitor.h"
+#include "CVMUSBBufferParser.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <iostream>
+
+class CBufferingController
+{
+public:
+  /*!
+     One set of buffering parameters.
+  */
+  struct Settings {
+    uint16_t bufferLength;       // Global mode buffer length code.
+    uint16_t eventsPerBuffer;    // Used with GlobalModeRegister::bufferLenSingle.
+    uint8_t  bulkTimeout;        // Seconds, TransferSetupRegister timeout field.
+    uint16_t irqThreshold;       // Mesytec irq_event_threshold.
+
+    bool throughputMode() const { return (bufferLength != CVMUSB::GlobalModeRegister::bufferLenSingle) ||
+	                                 (eventsPerBuffer > 1) || (irqThreshold > 1); }
+  };
+
+  static const uint16_t maxEventsPerBuffer = 0xfff;
+  static const uint16_t maxIrqThreshold    = 512;
+  static const uint32_t irqThresholdReg    = 0x601e;   // Mesytec irq_event_threshold.
+  static const size_t   bufferBytes13K     = 13*1024*sizeof(uint16_t);
+
+private:
+  CVMUSB&               m_vmusb;
+  double                m_latencyMs;      // Bound on delivery latency.
+  double                m_minDwell;       // Seconds between switches.
+  double                m_smoothing;      // Rate EWMA weight of the newest sample.
+  std::vector<uint32_t> m_modules;
+  uint8_t               m_amod;
+  CVMUSB::BufferSink*   m_pSink;          // Gets the buffers drained during a pause.
+  int                   m_pauseLatencyMs;
+  uint16_t              m_action;         // Action register bits to keep on resume.
+
+  double                m_rate;           // Smoothed accepted trigger rate.
+  double                m_bytesPerTrigger;
+  size_t                m_lastBytes;
+  double                m_lastUpdate;
+  double                m_lastSwitch;
+  Settings              m_current;
+  unsigned              m_switches;
+
+public:
+  CBufferingController(CVMUSB& vmusb, double latencyMs = 100.0);
+
+  void setModules(const std::vector<uint32_t>& modules,
+		  uint8_t amod = CVMUSBReadoutList::a32PrivProgram);
+  void setPauseSink(CVMUSB::BufferSink* pSink, int maxLatencyMs = 200);
+  void setResumeAction(uint16_t action) { m_action = action; }
+  void setMinDwell(double seconds)      { m_minDwell = seconds; }
+  void setLatency(double ms)            { m_latencyMs = ms; }
+
+  bool update(const CDeadTimeMonitor::Sample& scalers,
+	      const CVMUSBBufferParser::Statistics& stream, double now);
+  void clearStatistics();
+  Settings choose(double rate, double bytesPerTrigger) const;
+  bool     apply(const Settings& settings, bool running = true);
+
+  const Settings& current() const  { return m_current; }
+  double          rate() const     { return m_rate; }
+  unsigned        switches() const { return m_switches; }
+
+  void dump(std::ostream& str) const;
+
+  // Utilities:
+private:
+  bool worthSwitching(const Settings& next, double now) const;
+};
+
+#endif
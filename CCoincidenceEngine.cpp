@@ -0,0 +1,285 @@
+/*
+ * Implementation of the CCoincidenceEngine class.
+ */
+
+#include "CCoincidenceEngine.h"
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*!
+   \param moduleId : uint8_t
+      Id of the MTDC in the data; events of other modules are skipped.
+*/
+CCoincidenceEngine::CCoincidenceEngine(uint8_t moduleId) :
+  m_moduleId(moduleId)
+{
+  memset(m_start, 0, sizeof(m_start));
+  clearStatistics();
+}
+
+/*!
+   Add a coincidence between two groups of channels.
+
+   \param maskA, maskB : uint64_t
+      Channels of each group, see channelMask and bankMask.  The same mask
+      for both correlates the group's hits among themselves; lo should be
+      0 or more then.
+   \param lo, hi       : int32_t
+      Window on t(B) - t(A) in TDC units, both ends included, at most
+      maxWindow either way.
+   \param binShift     : unsigned
+      Histogram bins are 2^binShift TDC units wide.
+
+   \return size_t - index of the pair.
+
+   \throw std::invalid_argument if a mask is empty, lo > hi or the window
+          goes past maxWindow.
+*/
+size_t
+CCoincidenceEngine::addPair(uint64_t maskA, uint64_t maskB, int32_t lo, int32_t hi, unsigned binShift)
+{
+  uint64_t all = (uint64_t(1) << maxChannels) - 1;
+  if (!(maskA & all) || !(maskB & all) || (lo > hi) || (binShift > 30) ||
+      (lo < -maxWindow) || (hi > maxWindow)) {
+    throw std::invalid_argument("CCoincidenceEngine::addPair - empty group or bad window");
+  }
+  Pair pair;
+  pair.maskA            = maskA & all;
+  pair.maskB            = maskB & all;
+  pair.lo               = lo;
+  pair.hi               = hi;
+  pair.binShift         = binShift;
+  pair.events           = 0;
+  pair.coincidentEvents = 0;
+  pair.coincidences     = 0;
+  pair.histogram.assign((uint32_t(hi - lo) >> binShift) + 1, 0);
+  m_pairs.push_back(pair);
+  m_pairGroups.push_back(groupIndex(pair.maskA));
+  m_pairGroups.push_back(groupIndex(pair.maskB));
+  return m_pairs.size() - 1;
+}
+
+/*!
+   Analyze the events of this engine's module in a decoded batch.
+
+   \return size_t - module events analyzed.
+*/
+size_t
+CCoincidenceEngine::process(const CModuleDriver::Batch& batch)
+{
+  size_t nEvents = batch.events();
+  size_t done    = 0;
+  for (size_t e = 0; e < nEvents; e++) {
+    if (batch.eventModule[e] != m_moduleId) continue;
+    size_t first = batch.firstHit[e];
+    size_t last  = (e + 1 < nEvents) ? batch.firstHit[e + 1] : batch.hits();
+    processEvent(&batch.channel[first], &batch.value[first], last - first);
+    done++;
+  }
+  return done;
+}
+
+/*!
+   Analyze one module event given as parallel channel and value arrays.
+*/
+void
+CCoincidenceEngine::processEvent(const uint8_t* pChannels, const uint16_t* pValues, size_t nHits)
+{
+  m_stats.events++;
+  m_stats.hits += nHits;
+
+  // Counting sort by channel into the flat array:
+
+  uint32_t count[maxChannels] = {0};
+  for (size_t i = 0; i < nHits; i++) {
+    if (pChannels[i] < maxChannels) count[pChannels[i]]++;
+  }
+  m_start[0] = 0;
+  for (unsigned c = 0; c < maxChannels; c++) m_start[c + 1] = m_start[c] + count[c];
+  m_stats.ignoredHits += nHits - m_start[maxChannels];
+
+  m_times.resize(m_start[maxChannels]);
+  uint32_t next[maxChannels];
+  memcpy(next, m_start, sizeof(next));
+  for (size_t i = 0; i < nHits; i++) {
+    unsigned c = pChannels[i];
+    if (c < maxChannels) m_times[next[c]++] = pValues[i];
+  }
+  for (unsigned c = 0; c < maxChannels; c++) {                  // Hits mostly come in order already.
+    for (uint32_t i = m_start[c] + 1; i < m_start[c + 1]; i++) {
+      int32_t  t = m_times[i];
+      uint32_t j = i;
+      for (; (j > m_start[c]) && (m_times[j - 1] > t); j--) m_times[j] = m_times[j - 1];
+      m_times[j] = t;
+    }
+  }
+
+  m_groupTimes.clear();
+  for (size_t g = 0; g < m_groups.size(); g++) buildGroup(m_groups[g]);
+  for (size_t p = 0; p < m_pairs.size(); p++) {
+    sweep(m_pairs[p], m_groups[m_pairGroups[2*p]], m_groups[m_pairGroups[2*p + 1]]);
+  }
+}
+
+/*!
+   The hits of a channel in the last event, in time order.
+
+   \param channel : unsigned
+   \param nHits   : size_t&
+      Set to the number of hits.
+
+   \return const int32_t* - the times, valid until the next event.
+*/
+const int32_t*
+CCoincidenceEngine::hits(unsigned channel, size_t& nHits) const
+{
+  if ((channel >= maxChannels) || m_times.empty()) {
+    nHits = 0;
+    return 0;
+  }
+  nHits = m_start[channel + 1] - m_start[channel];
+  return m_times.data() + m_start[channel];
+}
+
+/*!
+   Zero the statistics, pair counts and histograms.
+*/
+void
+CCoincidenceEngine::clearStatistics()
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  for (size_t p = 0; p < m_pairs.size(); p++) {
+    m_pairs[p].events           = 0;
+    m_pairs[p].coincidentEvents = 0;
+    m_pairs[p].coincidences     = 0;
+    std::fill(m_pairs[p].histogram.begin(), m_pairs[p].histogram.end(), 0);
+  }
+}
+
+/*!
+   Print the counts and rates of every pair.
+
+   \param seconds : double
+      Time the counts were taken over, e.g. from CDeadTimeMonitor.
+*/
+void
+CCoincidenceEngine::dump(std::ostream& str, double seconds) const
+{
+  double scale = (seconds > 0.0) ? 1.0/seconds : 0.0;
+  str << "Module 0x" << std::hex << unsigned(m_moduleId) << std::dec << ": "
+      << m_stats.events << " events, " << m_stats.hits << " hits\n";
+  for (size_t p = 0; p < m_pairs.size(); p++) {
+    const Pair& pair(m_pairs[p]);
+    str << "  0x" << std::hex << pair.maskA << " - 0x" << pair.maskB << std::dec
+	<< " [" << pair.lo << ", " << pair.hi << "]: "
+	<< pair.coincidentEvents * scale << "Hz coincident, "
+	<< pair.coincidences * scale << "Hz pairs, "
+	<< pair.events * scale << "Hz both fired\n";
+  }
+}
+
+/*!
+   Histogram bins of a run of times: (time - origin) >> shift.  The times
+   must not be below origin.
+*/
+void
+CCoincidenceEngine::bin(const int32_t* pTimes, size_t n, int32_t origin, unsigned shift, uint32_t* pBins)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i o     = _mm_set1_epi32(origin);
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  for (; i + 4 <= n; i += 4) {
+    __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pTimes + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pBins + i), _mm_srl_epi32(_mm_sub_epi32(t, o), count));
+  }
+#endif
+  for (; i < n; i++) pBins[i] = uint32_t(pTimes[i] - origin) >> shift;
+}
+
+/*
+ * The group of a mask, made if it's new.
+ */
+size_t
+CCoincidenceEngine::groupIndex(uint64_t mask)
+{
+  for (size_t g = 0; g < m_groups.size(); g++) {
+    if (m_groups[g].mask == mask) return g;
+  }
+  Group group = {mask, __builtin_popcountll(mask) == 1, 0, 0};
+  m_groups.push_back(group);
+  return m_groups.size() - 1;
+}
+
+/*
+ * Collect a group's hits of the current event into m_groupTimes, in time
+ * order.  A single channel's hits are used where they are.
+ */
+void
+CCoincidenceEngine::buildGroup(Group& group)
+{
+  if (group.single) {
+    unsigned c  = __builtin_ctzll(group.mask);
+    group.start = m_start[c];
+    group.count = m_start[c + 1] - m_start[c];
+    return;
+  }
+  group.start       = m_groupTimes.size();
+  unsigned channels = 0;
+  for (uint64_t bits = group.mask; bits; bits &= bits - 1) {
+    unsigned c = __builtin_ctzll(bits);
+    if (m_start[c] == m_start[c + 1]) continue;
+    m_groupTimes.insert(m_groupTimes.end(), m_times.begin() + m_start[c], m_times.begin() + m_start[c + 1]);
+    channels++;
+  }
+  group.count = m_groupTimes.size() - group.start;
+  if (channels > 1) std::sort(m_groupTimes.begin() + group.start, m_groupTimes.end());
+}
+
+const int32_t*
+CCoincidenceEngine::groupTimes(const Group& group) const
+{
+  return (group.single ? m_times.data() : m_groupTimes.data()) + group.start;
+}
+
+/*
+ * Sliding window over the two time ordered groups: for each hit of A the
+ * hits of B in [t + lo, t + hi] are B[lower..upper), and both bounds only
+ * move forward.
+ */
+void
+CCoincidenceEngine::sweep(Pair& pair, const Group& a, const Group& b)
+{
+  if (!a.count || !b.count) return;
+  pair.events++;
+
+  const int32_t* pA    = groupTimes(a);
+  const int32_t* pB    = groupTimes(b);
+  bool           self  = (pair.maskA == pair.maskB);
+  size_t         lower = 0;
+  size_t         upper = 0;
+  size_t         found = 0;
+  if (m_bins.size() < b.count) m_bins.resize(b.count);
+
+  for (size_t i = 0; i < a.count; i++) {
+    int32_t from = pA[i] + pair.lo;
+    int32_t to   = pA[i] + pair.hi;
+    if (self && (lower <= i)) lower = i + 1;                     // Each pair once, not a hit with itself.
+    while ((lower < b.count) && (pB[lower] < from)) lower++;
+    if (upper < lower) upper = lower;
+    while ((upper < b.count) && (pB[upper] <= to)) upper++;
+    if (upper == lower) continue;
+
+    size_t n = upper - lower;
+    bin(pB + lower, n, from, pair.binShift, m_bins.data());
+    for (size_t k = 0; k < n; k++) pair.histogram[m_bins[k]]++;
+    found += n;
+  }
+  if (found) pair.coincidentEvents++;
+  pair.coincidences += found;
+}
@@ -0,0 +1,106 @@
+/*
+ * This file defines the CCoincidenceEngine class, the online coincidence analysis of one MTDC-32. The
+ * MTDC runs with split banks: channels 0-15 are bank 0, triggered by trigger input 0 (channel 32 in the
+ * data), channels 16-31 bank 1, triggered by trigger input 1 (channel 33). With multi-hit on, a channel can
+ * report several hits per window.
+ *
+ * Each module event taken from the decoded batch (CModuleReadout::batch()) is laid out flat, all hits in
+ * one array grouped by channel and sorted by time within each channel, with an offset per channel - no
+ * per event or per channel containers. A pair compares two groups of channels, given as channel masks
+ * (one channel, a bank, any set): the hits of each group are merged in time order and swept with a sliding
+ * window, so finding every hit pair with
+ *
+ *   lo <= t(B) - t(A) <= hi
+ *
+ * is linear in the hits. Every such pair is counted and its time difference histogrammed. Pairing a group
+ * with itself gives the intervals between its hits (multi-hit correlation), each pair counted once.
+ *
+ * The histogram binning of a window is done four differences at a time with SSE2. Counts over the run
+ * divided by the scaler time (CDeadTimeMonitor) are the coincidence rates.
+ */
+
+#ifndef CCoincidenceEngine_H
+#define CCoincidenceEngine_H
+
+#include "CModuleDriver.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <iostream>
+
+class CCoincidenceEngine
+{
+public:
+  static const unsigned maxChannels    = 34;    // 32 channels and the two trigger inputs.
+  static const unsigned bankChannels   = 16;
+  static const unsigned triggerChannel = 32;    // Bank 0's, bank 1's is the next.
+  static const int32_t  maxWindow      = 0xffff; // Largest |lo|, |hi|: TDC times are 16 bits.
+
+  static uint64_t channelMask(unsigned channel) { return uint64_t(1) << channel; }
+  static uint64_t bankMask(unsigned bank)       { return uint64_t(0xffff) << (bank*bankChannels); }
+
+  struct Pair {
+    uint64_t              maskA;
+    uint64_t              maskB;
+    int32_t               lo;             // Window on t(B) - t(A), TDC units.
+    int32_t               hi;
+    unsigned              binShift;       // Histogram bin is 2^binShift TDC units.
+    size_t                events;         // Events with hits in both groups.
+    size_t                coincidentEvents; // Events with at least one pair in the window.
+    size_t                coincidences;   // Hit pairs in the window.
+    std::vector<uint32_t> histogram;      // t(B) - t(A) - lo, binned.
+  };
+
+  struct Statistics {
+    size_t events;
+    size_t hits;
+    size_t ignoredHits;          // Channel out of range.
+  };
+
+private:
+  struct Group {                 // Hits of a channel mask in the current event.
+    uint64_t mask;
+    bool     single;             // One channel: start is in m_times, not copied.
+    size_t   start;              // In m_groupTimes (m_times if single).
+    size_t   count;
+  };
+
+  uint8_t               m_moduleId;
+  std::vector<Pair>     m_pairs;
+  std::vector<size_t>   m_pairGroups;     // Group of A and of B for each pair.
+  std::vector<Group>    m_groups;         // One per distinct mask.
+  uint32_t              m_start[maxChannels + 1];   // Channel c's hits are m_times[m_start[c]..m_start[c+1]).
+  std::vector<int32_t>  m_times;
+  std::vector<int32_t>  m_groupTimes;
+  std::vector<uint32_t> m_bins;           // Scratch for the binning kernel.
+  Statistics            m_stats;
+
+public:
+  CCoincidenceEngine(uint8_t moduleId);
+
+  size_t addPair(uint64_t maskA, uint64_t maskB, int32_t lo, int32_t hi, unsigned binShift = 0);
+  size_t pairs() const             { return m_pairs.size(); }
+  const Pair& pair(size_t i) const { return m_pairs[i]; }
+
+  size_t process(const CModuleDriver::Batch& batch);
+  void   processEvent(const uint8_t* pChannels, const uint16_t* pValues, size_t nHits);
+
+  const int32_t* hits(unsigned channel, size_t& nHits) const;
+
+  const Statistics& statistics() const { return m_stats; }
+  void              clearStatistics();
+  void              dump(std::ostream& str, double seconds) const;
+
+  // Kernel, public so it can be timed and checked on its own:
+
+  static void bin(const int32_t* pTimes, size_t n, int32_t origin, unsigned shift, uint32_t* pBins);
+
+  // Utilities:
+private:
+  size_t groupIndex(uint64_t mask);
+  void   buildGroup(Group& group);
+  const int32_t* groupTimes(const Group& group) const;
+  void   sweep(Pair& pair, const Group& a, const Group& b);
+};
+
+#endif
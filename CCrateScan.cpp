@@ -0,0 +1,144 @@
+/*
+ * Implementation of the CCrateScan class.
+ */
+
+#include "CCrateScan.h"
+#include "CVMUSB.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <errno.h>
+#include <string.h>
+
+/*!
+   Scan the crate.
+
+   \param vmusb        : CVMUSB&
+      The controller.
+   \param sub          : uint8_t
+      Address bits 23-16 shared by all the slots.
+   \param amod         : uint8_t
+      Address modifier for the probes.
+   \param slotsPerList : unsigned
+      Slots probed per executeList.  The default does the whole crate in
+      one transaction; lower it only if the controller refuses a list
+      that long.
+
+   \return std::vector<Module> - the slots that answered, by base address.
+
+   \throw std::runtime_error if a list could not be executed.
+*/
+std::vector<CCrateScan::Module>
+CCrateScan::scan(CVMUSB& vmusb, uint8_t sub, uint8_t amod, unsigned slotsPerList)
+{
+  std::vector<Module> modules;
+  if (slotsPerList == 0) slotsPerList = nSlots;
+
+  for (unsigned first = 0; first < nSlots; first += slotsPerList) {
+    unsigned slots = std::min(slotsPerList, nSlots - first);
+    CVMUSBReadoutList list;
+    buildList(list, first, slots, sub, amod);
+
+    std::vector<uint32_t> reply(2*slots, 0);          // Room for longword replies.
+    size_t nRead = 0;
+    if (vmusb.executeList(list, &reply[0], reply.size()*sizeof(uint32_t), &nRead) < 0) {
+      std::string msg("CCrateScan::scan - executeList failed: ");
+      msg += strerror(errno);
+      throw std::runtime_error(msg);
+    }
+    decode(&reply[0], nRead, first, slots, sub, modules);
+  }
+  return modules;
+}
+
+/*!
+   Add the probes of a range of slots to a list: module_id then
+   firmware_revision of each slot.
+*/
+void
+CCrateScan::buildList(CVMUSBReadoutList& list, unsigned firstSlot, unsigned slots, uint8_t sub,
+		      uint8_t amod)
+{
+  for (unsigned slot = firstSlot; slot < firstSlot + slots; slot++) {
+    uint32_t base = baseOf(slot, sub);
+    list.addRead16(base | moduleIdReg, amod);
+    list.addRead16(base | firmwareReg, amod);
+  }
+}
+
+/*!
+   Decode the reply to a list from buildList.  Each read comes back as a
+   16 bit word, or as a longword when the controller pads them; the
+   reply size tells which.  A slot whose firmware reads 0 or all ones
+   (bus error) is empty, as is one the reply stops short of.
+
+   \return size_t - number of modules appended to modules.
+*/
+size_t
+CCrateScan::decode(const void* pReply, size_t nBytes, unsigned firstSlot, unsigned slots,
+		   uint8_t sub, std::vector<Module>& modules)
+{
+  const uint16_t* p      = static_cast<const uint16_t*>(pReply);
+  size_t          stride = (nBytes >= 2*slots*sizeof(uint32_t)) ? 2 : 1;
+  size_t          nWords = nBytes / sizeof(uint16_t);
+  size_t          found  = 0;
+
+  for (unsigned i = 0; i < slots; i++) {
+    size_t idIndex = (2*i)*stride;
+    size_t fwIndex = (2*i + 1)*stride;
+    if (fwIndex >= nWords) break;
+
+    uint16_t firmware = p[fwIndex];
+    if ((firmware == 0) || (firmware == 0xffff)) continue;
+
+    Module m = {baseOf(firstSlot + i, sub), p[idIndex], firmware, typeOf(firmware)};
+    modules.push_back(m);
+    found++;
+  }
+  return found;
+}
+
+/*!
+   Module type from its firmware revision.
+*/
+CCrateScan::ModuleType
+CCrateScan::typeOf(uint16_t firmware)
+{
+  switch (firmware) {
+  case firmwareMQDC:
+    return MQDC32;
+  case firmwareMTDC:
+    return MTDC32;
+  default:
+    return Unknown;
+  }
+}
+
+const char*
+CCrateScan::typeName(ModuleType type)
+{
+  switch (type) {
+  case MQDC32:
+    return "MQDC-32";
+  case MTDC32:
+    return "MTDC-32";
+  default:
+    return "unknown";
+  }
+}
+
+/*!
+   The which'th module of a type in an inventory (in base address order),
+   null if there are not that many.
+*/
+const CCrateScan::Module*
+CCrateScan::find(const std::vector<Module>& modules, ModuleType type, size_t which)
+{
+  for (size_t i = 0; i < modules.size(); i++) {
+    if (modules[i].type == type) {
+      if (which == 0) return &modules[i];
+      which--;
+    }
+  }
+  return 0;
+}
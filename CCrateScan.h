@@ -0,0 +1,66 @@
+/*
+ * This file defines the CCrateScan class which finds the Mesytec modules in a VME crate. The 256 A32
+ * slots 0x00XX0000, 0x01XX0000 ... 0xffXX0000 are probed by reading their module_id and firmware_revision
+ * registers, where XX (address bits 23-16, the second pair of rotary switches) is the same for the whole
+ * crate; ours are all set to 06 (MTDC 0x06060000, MQDC 0x01060000). All the probes go into one list
+ * that is run with a single executeList, so the whole crate is discovered in one USB round trip. Empty
+ * slots answer with a bus error; the VM-USB carries on with the next read and the slot reads back as 0
+ * or all ones.
+ */
+
+#ifndef CCrateScan_H
+#define CCrateScan_H
+
+#include "CVMUSBReadoutList.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CVMUSB;
+
+class CCrateScan
+{
+public:
+  typedef enum _ModuleType {
+    Unknown,                    // Something answered but the firmware is not one we know.
+    MQDC32,
+    MTDC32
+  } ModuleType;
+
+  struct Module {
+    uint32_t   base;
+    uint16_t   moduleId;
+    uint16_t   firmware;
+    ModuleType type;
+  };
+
+  static const unsigned nSlots        = 256;
+  static const uint32_t slotShift     = 24;
+  static const uint32_t subShift      = 16;
+  static const uint8_t  defaultSub    = 0x06;  // Address bits 23-16 of our modules.
+  static const uint32_t moduleIdReg   = 0x6004;
+  static const uint32_t firmwareReg   = 0x600e;
+  static const uint16_t firmwareMQDC  = 0x204;
+  static const uint16_t firmwareMTDC  = 0x206;
+
+public:
+  static std::vector<Module> scan(CVMUSB& vmusb, uint8_t sub = defaultSub,
+				  uint8_t amod = CVMUSBReadoutList::a32PrivData,
+				  unsigned slotsPerList = nSlots);
+
+  static uint32_t baseOf(unsigned slot, uint8_t sub = defaultSub) {
+    return (slot << slotShift) | (static_cast<uint32_t>(sub) << subShift);
+  }
+  static void   buildList(CVMUSBReadoutList& list, unsigned firstSlot, unsigned slots,
+			  uint8_t sub = defaultSub,
+			  uint8_t amod = CVMUSBReadoutList::a32PrivData);
+  static size_t decode(const void* pReply, size_t nBytes, unsigned firstSlot, unsigned slots,
+		       uint8_t sub, std::vector<Module>& modules);
+
+  static ModuleType    typeOf(uint16_t firmware);
+  static const char*   typeName(ModuleType type);
+  static const Module* find(const std::vector<Module>& modules, ModuleType type,
+			    size_t which = 0);
+};
+
+#endif
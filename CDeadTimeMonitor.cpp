@@ -0,0 +1,110 @@
+/*
+ * Implementation of the CDeadTimeMonitor class.
+ */
+
+#include "CDeadTimeMonitor.h"
+#include <string.h>
+#include <sys/time.h>
+
+/*!
+   \param period : double
+      The scaler readout period the VM-USB was set up with, in seconds.
+      Intervals are measured with it, which is exact; pass 0 to time the
+      intervals with the host clock when the events are parsed instead.
+*/
+CDeadTimeMonitor::CDeadTimeMonitor(double period) :
+  m_period(period),
+  m_badEvents(0)
+{
+  reset();
+}
+
+/*!
+   Parser callback.  The scaler stack reads scaler A then scaler B, each
+   a 32 bit register read that arrives as two 16 bit words, low first.
+*/
+void
+CDeadTimeMonitor::event(uint8_t /* stackId */, const uint16_t* pBody, size_t nWords)
+{
+  if (nWords < 4) {
+    m_badEvents++;
+    return;
+  }
+  uint32_t a = pBody[0] | (static_cast<uint32_t>(pBody[1]) << 16);
+  uint32_t b = pBody[2] | (static_cast<uint32_t>(pBody[3]) << 16);
+  update(a, b, wallClock());
+}
+
+/*!
+   Account for one scaler readout.  The counters are free running, the
+   unsigned differences are correct across a wrap.
+
+   \param scalerA : uint32_t - accepted trigger count.
+   \param scalerB : uint32_t - raw trigger count.
+   \param now     : double   - time of the readout in seconds, only used
+                               if no period was set.
+*/
+void
+CDeadTimeMonitor::update(uint32_t scalerA, uint32_t scalerB, double now)
+{
+  if (!m_primed) {
+    m_primed   = true;
+    m_lastA    = scalerA;
+    m_lastB    = scalerB;
+    m_lastTime = now;
+    return;
+  }
+  uint32_t accepted = scalerA - m_lastA;
+  uint32_t raw      = scalerB - m_lastB;
+  double   dt       = (m_period > 0.0) ? m_period : (now - m_lastTime);
+
+  m_sample.seconds        = dt;
+  m_sample.acceptedRate   = (dt > 0.0) ? accepted / dt : 0.0;
+  m_sample.rawRate        = (dt > 0.0) ? raw / dt : 0.0;
+  m_sample.liveFraction   = raw ? static_cast<double>(accepted) / raw : 1.0;
+  if (m_sample.liveFraction > 1.0) m_sample.liveFraction = 1.0;   // Gate skew between A and B.
+  m_sample.acceptedTotal += accepted;
+  m_sample.rawTotal      += raw;
+  m_sample.runSeconds    += dt;
+
+  m_lastA    = scalerA;
+  m_lastB    = scalerB;
+  m_lastTime = now;
+}
+
+/*!
+   Start over, e.g. at the beginning of a run.
+*/
+void
+CDeadTimeMonitor::reset()
+{
+  m_primed   = false;
+  m_lastA    = 0;
+  m_lastB    = 0;
+  m_lastTime = 0.0;
+  memset(&m_sample, 0, sizeof(m_sample));
+  m_sample.liveFraction = 1.0;
+}
+
+/*!
+   Print the current rates.
+*/
+void
+CDeadTimeMonitor::dump(std::ostream& str) const
+{
+  str << "Triggers: " << m_sample.acceptedRate << "Hz accepted, "
+      << m_sample.rawRate << "Hz raw, live " << m_sample.liveFraction * 100.0 << "%"
+      << " (totals " << m_sample.acceptedTotal << "/" << m_sample.rawTotal
+      << " in " << m_sample.runSeconds << "s)\n";
+}
+
+/*!
+   Seconds since the epoch, microsecond resolution.
+*/
+double
+CDeadTimeMonitor::wallClock()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
@@ -0,0 +1,64 @@
+/*
+ * This file defines the CDeadTimeMonitor class which turns the periodic scaler events of the
+ * VM-USB scaler stack (see vme::scalerInit / vme::buildScalerStack) into trigger rates and the
+ * live/dead fraction of the acquisition. Scaler A counts accepted (readout) triggers, scaler B
+ * counts every trigger pulse on NIM I1, busy or not. Register it with a CVMUSBBufferParser as
+ * the handler for the scaler stack (stack 1).
+ *
+ * The scalers are never reset during the run, rates come from the difference between two
+ * readouts so no counts are lost between a read and a reset.
+ */
+
+#ifndef CDeadTimeMonitor_H
+#define CDeadTimeMonitor_H
+
+#include "CVMUSBBufferParser.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <iostream>
+
+class CDeadTimeMonitor : public CVMUSBBufferParser::Handler
+{
+public:
+  /*!
+     Rates over one scaler period and totals since the run started.
+  */
+  struct Sample {
+    double   seconds;            // Length of the interval.
+    double   acceptedRate;       // Hz.
+    double   rawRate;            // Hz.
+    double   liveFraction;       // accepted / raw, 1 with no triggers.
+    uint64_t acceptedTotal;
+    uint64_t rawTotal;
+    double   runSeconds;
+  };
+
+private:
+  double   m_period;             // Seconds between scaler events, 0 - use the wall clock.
+  bool     m_primed;             // Have the first readout to difference against.
+  uint32_t m_lastA;
+  uint32_t m_lastB;
+  double   m_lastTime;
+  Sample   m_sample;
+  size_t   m_badEvents;
+
+public:
+  CDeadTimeMonitor(double period = 0.0);
+
+  virtual void event(uint8_t stackId, const uint16_t* pBody, size_t nWords);
+
+  void          update(uint32_t scalerA, uint32_t scalerB, double now);
+  void          reset();
+  void          setPeriod(double seconds) { m_period = seconds; }
+
+  const Sample& sample() const       { return m_sample; }
+  double        liveFraction() const { return m_sample.liveFraction; }
+  double        deadFraction() const { return 1.0 - m_sample.liveFraction; }
+  size_t        badEvents() const    { return m_badEvents; }
+
+  void dump(std::ostream& str) const;
+
+  static double wallClock();
+};
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * Implementation of the CMesytecCodec class.
+ * Little endian host assumed, like the rest of the library.
+ */
+
+#include "CMesytecCodec.h"
+#include "CMesytecDecoder.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+CMesytecCodec::CMesytecCodec()
+{
+  reset();
+}
+
+/*!
+   Compress a block of stack events.
+
+   \param pEvents : const Event*
+      The events.
+   \param nEvents : size_t
+      How many.
+   \param out     : std::vector<uint8_t>&
+      The compressed block is appended here.
+*/
+void
+CMesytecCodec::encode(const Event* pEvents, size_t nEvents, std::vector<uint8_t>& out)
+{
+  reset();
+  m_events.clear();
+  m_headers.clear();
+  m_chanDeltas.clear();
+  m_deltas.clear();
+  m_stamps.clear();
+  m_others.clear();
+  m_longs.clear();
+
+  // Event framing, and the Mesytec data of all events gathered 32 bit aligned:
+
+  for (size_t e = 0; e < nEvents; e++) {
+    const Event& event(pEvents[e]);
+    unsigned     prefix = prefixLength(event.pBody, event.nWords);
+    size_t       nLongs = (event.nWords - prefix)/2;
+
+    m_events.push_back(event.stackId);
+    putVarint(m_events, event.nWords);
+    m_events.push_back(prefix);
+    const uint8_t* pBytes = reinterpret_cast<const uint8_t*>(event.pBody);
+    m_events.insert(m_events.end(), pBytes, pBytes + prefix*sizeof(uint16_t));
+    if ((event.nWords - prefix) % 2) {
+      const uint8_t* pLast = reinterpret_cast<const uint8_t*>(event.pBody + event.nWords - 1);
+      m_events.insert(m_events.end(), pLast, pLast + sizeof(uint16_t));
+    }
+
+    size_t at = m_longs.size();
+    m_longs.resize(at + nLongs);
+    if (nLongs) memcpy(&m_longs[at], event.pBody + prefix, nLongs*sizeof(uint32_t));
+  }
+
+  size_t nLongs = m_longs.size();
+  m_kinds.resize((nLongs + 3)/4);
+  if (nLongs) classify(&m_longs[0], nLongs, &m_kinds[0]);
+
+  // One pass over the words, each kind to its section:
+
+  uint8_t  module   = 0;
+  unsigned lastChan = 0x7f;                      // Channels count up from 0 in an event.
+  for (size_t i = 0; i < nLongs; i++) {
+    uint32_t word = m_longs[i];
+    switch ((m_kinds[i/4] >> (2*(i%4))) & 3) {
+    case kindData:
+      {
+	unsigned  chan  = (word >> 16) & 0x7f;    // Channel and flags.
+	uint16_t  value = word & CMesytecDecoder::dataValueMask;
+	uint16_t& last  = m_lastValue[module][chan & 0x1f];
+	int16_t   delta = static_cast<int16_t>(value - last);
+	m_chanDeltas.push_back((chan - lastChan - 1) & 0x7f);
+	m_deltas.push_back(static_cast<uint16_t>((uint16_t(delta) << 1) ^ (delta < 0 ? 0xffff : 0)));
+	lastChan = chan;
+	last     = value;
+      }
+      break;
+    case kindHeader:
+      module   = CMesytecDecoder::moduleId(word);
+      lastChan = 0x7f;
+      m_headers.push_back(module);
+      putVarint(m_headers, (word ^ m_lastHeader[module]) & ~CMesytecDecoder::headerIdMask);
+      m_lastHeader[module] = word;
+      break;
+    case kindEndOfEvent:
+      putVarint(m_stamps, (word - m_lastStamp[module]) & CMesytecDecoder::eoeStampMask);
+      m_lastStamp[module] = word;
+      break;
+    default:
+      {
+	const uint8_t* pBytes = reinterpret_cast<const uint8_t*>(&word);
+	m_others.insert(m_others.end(), pBytes, pBytes + sizeof(word));
+      }
+    }
+  }
+  size_t nData = m_deltas.size();
+  m_channels.resize(nData*sizeof(uint32_t) + nData/chunkSize + 1);
+  m_channels.resize(nData ? pack(&m_chanDeltas[0], nData, &m_channels[0]) : 0);
+  m_values.resize(nData*sizeof(uint32_t) + nData/chunkSize + 1);
+  m_values.resize(nData ? pack(&m_deltas[0], nData, &m_values[0]) : 0);
+
+  // The block:
+
+  uint32_t       magic  = blockMagic;
+  const uint8_t* pMagic = reinterpret_cast<const uint8_t*>(&magic);
+  out.insert(out.end(), pMagic, pMagic + sizeof(magic));
+  putVarint(out, nEvents);
+  putVarint(out, nLongs);
+  putVarint(out, nData);
+  putSection(out, m_events);
+  putSection(out, m_kinds);
+  putSection(out, m_headers);
+  putSection(out, m_channels);
+  putSection(out, m_values);
+  putSection(out, m_stamps);
+  putSection(out, m_others);
+}
+
+/*!
+   Decompress a block made by encode.
+
+   \param pBlock : const uint8_t*
+      The block.
+   \param nBytes : size_t
+      Its size.
+   \param words  : std::vector<uint16_t>&
+      Receives the event bodies, back to back.
+   \param events : std::vector<Extent>&
+      Receives where each event is in words.
+
+   \return bool - false if the block is damaged or not a block.
+*/
+bool
+CMesytecCodec::decode(const uint8_t* pBlock, size_t nBytes,
+		      std::vector<uint16_t>& words, std::vector<Extent>& events)
+{
+  Reader   in = {pBlock, pBlock + nBytes};
+  Reader   eventSec, kindSec, headerSec, chanSec, valueSec, stampSec, otherSec;
+  uint32_t magic, nEvents, nLongs, nData;
+
+  words.clear();
+  events.clear();
+  reset();
+
+  if (nBytes < sizeof(magic)) return false;
+  memcpy(&magic, pBlock, sizeof(magic));
+  in.p += sizeof(magic);
+  if ((magic != blockMagic) ||
+      !getVarint(in, nEvents) || !getVarint(in, nLongs) || !getVarint(in, nData) ||
+      !getSection(in, eventSec) || !getSection(in, kindSec) || !getSection(in, headerSec) ||
+      !getSection(in, chanSec)  || !getSection(in, valueSec) || !getSection(in, stampSec) ||
+      !getSection(in, otherSec)) {
+    return false;
+  }
+  if ((size_t(kindSec.end - kindSec.p) != (size_t(nLongs) + 3)/4) || (nData > nLongs)) {
+    return false;
+  }
+  m_chanDeltas.resize(nData);
+  m_deltas.resize(nData);
+  if (nData && (!unpack(chanSec.p, chanSec.end - chanSec.p, nData, &m_chanDeltas[0]) ||
+		!unpack(valueSec.p, valueSec.end - valueSec.p, nData, &m_deltas[0]))) {
+    return false;
+  }
+
+  const uint8_t* pKinds = kindSec.p;
+  size_t         iLong  = 0;
+  size_t         iData    = 0;
+  uint8_t        module   = 0;
+  unsigned       lastChan = 0x7f;
+  for (uint32_t e = 0; e < nEvents; e++) {
+    uint32_t nWords;
+    Extent   extent;
+    if (eventSec.p >= eventSec.end) return false;
+    extent.stackId = *eventSec.p++;
+    if (!getVarint(eventSec, nWords) || (eventSec.p >= eventSec.end)) return false;
+    unsigned prefix = *eventSec.p++;
+    bool     odd    = (nWords >= prefix) && ((nWords - prefix) % 2);
+    size_t   raw    = (prefix + (odd ? 1 : 0))*sizeof(uint16_t);
+    if ((prefix > maxPrefix) || (prefix > nWords) || (size_t(eventSec.end - eventSec.p) < raw)) {
+      return false;
+    }
+    size_t nEventLongs = (nWords - prefix)/2;
+    if (iLong + nEventLongs > nLongs) return false;
+
+    extent.offset = words.size();
+    extent.nWords = nWords;
+    words.resize(words.size() + nWords);
+    uint16_t* pOut = words.data() + extent.offset;
+    memcpy(pOut, eventSec.p, prefix*sizeof(uint16_t));
+    pOut += prefix;
+
+    for (size_t i = 0; i < nEventLongs; i++, iLong++) {
+      uint32_t word;
+      uint32_t x;
+      switch ((pKinds[iLong/4] >> (2*(iLong%4))) & 3) {
+      case kindData:
+	{
+	  if (iData >= nData) return false;
+	  unsigned  chan  = (lastChan + 1 + m_chanDeltas[iData]) & 0x7f;
+	  uint16_t& last  = m_lastValue[module][chan & 0x1f];
+	  uint32_t  zig   = m_deltas[iData++];
+	  uint16_t  value = last + static_cast<uint16_t>((zig >> 1) ^ -(zig & 1));
+	  word     = CMesytecDecoder::dataEvent | (chan << 16) | value;
+	  lastChan = chan;
+	  last     = value;
+	}
+	break;
+      case kindHeader:
+	if ((headerSec.p >= headerSec.end)) return false;
+	module   = *headerSec.p++;
+	lastChan = 0x7f;
+	if (!getVarint(headerSec, x) || (x & CMesytecDecoder::headerIdMask)) return false;
+	word = (x ^ (m_lastHeader[module] & ~CMesytecDecoder::headerIdMask)) |
+	       (uint32_t(module) << CMesytecDecoder::headerIdShift);
+	m_lastHeader[module] = word;
+	break;
+      case kindEndOfEvent:
+	if (!getVarint(stampSec, x) || (x & ~CMesytecDecoder::eoeStampMask)) return false;
+	word = CMesytecDecoder::typeEndOfEvent |
+	       ((m_lastStamp[module] + x) & CMesytecDecoder::eoeStampMask);
+	m_lastStamp[module] = word;
+	break;
+      default:
+	if (size_t(otherSec.end - otherSec.p) < sizeof(word)) return false;
+	memcpy(&word, otherSec.p, sizeof(word));
+	otherSec.p += sizeof(word);
+      }
+      memcpy(pOut, &word, sizeof(word));
+      pOut += 2;
+    }
+    if (odd) memcpy(pOut, eventSec.p + prefix*sizeof(uint16_t), sizeof(uint16_t));
+    eventSec.p += raw;
+    events.push_back(extent);
+  }
+  return (iLong == nLongs) && (iData == nData);
+}
+
+/*!
+   Sort 32 bit words into the four kinds, 2 bits per word, four words to
+   the byte, first word in the low bits.  pKinds must hold (nWords+3)/4
+   bytes.  SSE2 does four words at a time where it is available.
+*/
+void
+CMesytecCodec::classify(const uint32_t* pWords, size_t nWords, uint8_t* pKinds)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i typeMask  = _mm_set1_epi32(CMesytecDecoder::typeMask);
+  const __m128i header    = _mm_set1_epi32(CMesytecDecoder::typeHeader);
+  const __m128i eoe       = _mm_set1_epi32(CMesytecDecoder::typeEndOfEvent);
+  const __m128i dataMask  = _mm_set1_epi32(0xff800000);
+  const __m128i data      = _mm_set1_epi32(CMesytecDecoder::dataEvent);
+  const __m128i berr      = _mm_set1_epi32(CMesytecDecoder::berrWord);
+  const __m128i one       = _mm_set1_epi32(kindHeader);
+  const __m128i two       = _mm_set1_epi32(kindEndOfEvent);
+  const __m128i three     = _mm_set1_epi32(kindOther);
+  for (; i + 4 <= nWords; i += 4) {
+    __m128i w    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pWords + i));
+    __m128i type = _mm_and_si128(w, typeMask);
+    __m128i isH  = _mm_cmpeq_epi32(type, header);
+    __m128i isE  = _mm_andnot_si128(_mm_cmpeq_epi32(w, berr), _mm_cmpeq_epi32(type, eoe));
+    __m128i isD  = _mm_cmpeq_epi32(_mm_and_si128(w, dataMask), data);
+    __m128i kind = _mm_or_si128(_mm_or_si128(_mm_and_si128(isH, one), _mm_and_si128(isE, two)),
+				_mm_andnot_si128(_mm_or_si128(_mm_or_si128(isD, isH), isE), three));
+    unsigned low  = _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(kind, 31)));
+    unsigned high = _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(kind, 30)));
+    unsigned byte = 0;
+    for (unsigned b = 0; b < 4; b++) {                // Interleave the bit planes.
+      byte |= (((low >> b) & 1) | (((high >> b) & 1) << 1)) << (2*b);
+    }
+    pKinds[i/4] = byte;
+  }
+#endif
+  for (; i < nWords; i++) {
+    uint32_t w    = pWords[i];
+    unsigned kind = kindOther;
+    if      (CMesytecDecoder::isHeader(w))                       kind = kindHeader;
+    else if (CMesytecDecoder::isEndOfEvent(w))                   kind = kindEndOfEvent;
+    else if ((w & 0xff800000) == CMesytecDecoder::dataEvent)     kind = kindData;
+    if (i % 4 == 0) pKinds[i/4] = 0;
+    pKinds[i/4] |= kind << (2*(i%4));
+  }
+}
+
+/*!
+   Bit-pack values in chunks of chunkSize: a width byte, then the chunk's
+   values at that width, least significant bit first.  pOut must hold
+   4*n + n/chunkSize + 1 bytes.
+
+   \return size_t - bytes written.
+*/
+size_t
+CMesytecCodec::pack(const uint32_t* pValues, size_t n, uint8_t* pOut)
+{
+  uint8_t* p = pOut;
+  for (size_t start = 0; start < n; start += chunkSize) {
+    size_t   count = (n - start < chunkSize) ? n - start : chunkSize;
+    uint32_t bits  = 0;
+    size_t   i     = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+      acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pValues + start + i)));
+    }
+    acc   = _mm_or_si128(acc, _mm_srli_si128(acc, 8));
+    acc   = _mm_or_si128(acc, _mm_srli_si128(acc, 4));
+    bits  = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < count; i++) bits |= pValues[start + i];
+    unsigned width = bits ? 32 - __builtin_clz(bits) : 0;
+
+    *p++ = width;
+    uint64_t acc64  = 0;
+    unsigned filled = 0;
+    for (i = 0; i < count; i++) {
+      acc64  |= uint64_t(pValues[start + i]) << filled;
+      filled += width;
+      while (filled >= 8) {
+	*p++     = acc64;
+	acc64  >>= 8;
+	filled  -= 8;
+      }
+    }
+    if (filled) *p++ = acc64;
+  }
+  return p - pOut;
+}
+
+/*!
+   Undo pack.
+
+   \return size_t - bytes used, 0 if nBytes ran out first or a width is
+                    bad.
+*/
+size_t
+CMesytecCodec::unpack(const uint8_t* pIn, size_t nBytes, size_t n, uint32_t* pValues)
+{
+  const uint8_t* p   = pIn;
+  const uint8_t* end = pIn + nBytes;
+  for (size_t start = 0; start < n; start += chunkSize) {
+    size_t count = (n - start < chunkSize) ? n - start : chunkSize;
+    if (p >= end) return 0;
+    unsigned width = *p++;
+    size_t   bytes = (count*width + 7)/8;
+    if ((width > 32) || (size_t(end - p) < bytes)) return 0;
+
+    uint32_t mask   = width ? (0xffffffffu >> (32 - width)) : 0;
+    uint64_t acc64  = 0;
+    unsigned filled = 0;
+    for (size_t i = 0; i < count; i++) {
+      while (filled < width) {
+	acc64  |= uint64_t(*p++) << filled;
+	filled += 8;
+      }
+      pValues[start + i] = acc64 & mask;
+      acc64  >>= width;
+      filled  -= width;
+    }
+  }
+  return p - pIn;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Utilities:
+
+void
+CMesytecCodec::reset()
+{
+  memset(m_lastHeader, 0, sizeof(m_lastHeader));
+  memset(m_lastStamp,  0, sizeof(m_lastStamp));
+  memset(m_lastValue,  0, sizeof(m_lastValue));
+}
+
+/*
+ * Number of 16 bit words in front of the first Mesytec header (the stack
+ * marker and a pad word), 0 if there is no header within maxPrefix words.
+ */
+unsigned
+CMesytecCodec::prefixLength(const uint16_t* pBody, size_t nWords)
+{
+  for (unsigned k = 0; (k <= maxPrefix) && (k + 1 < nWords); k++) {
+    if (CMesytecDecoder::isHeader(pBody[k] | (uint32_t(pBody[k + 1]) << 16))) return k;
+  }
+  return 0;
+}
+
+void
+CMesytecCodec::putVarint(std::vector<uint8_t>& out, uint32_t value)
+{
+  while (value >= 0x80) {
+    out.push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+bool
+CMesytecCodec::getVarint(Reader& in, uint32_t& value)
+{
+  value = 0;
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (in.p >= in.end) return false;
+    uint8_t byte = *in.p++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+void
+CMesytecCodec::putSection(std::vector<uint8_t>& out, const std::vector<uint8_t>& section)
+{
+  putVarint(out, section.size());
+  out.insert(out.end(), section.begin(), section.end());
+}
+
+bool
+CMesytecCodec::getSection(Reader& in, Reader& section)
+{
+  uint32_t size;
+  if (!getVarint(in, size) || (size_t(in.end - in.p) < size)) return false;
+  section.p   = in.p;
+  section.end = in.p + size;
+  in.p       += size;
+  return true;
+}
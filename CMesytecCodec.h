@@ -0,0 +1,104 @@
+/*
+ * This file defines the CMesytecCodec class, a lossless compressor for blocks of VM-USB stack events
+ * carrying Mesytec MQDC/MTDC data (see CMesytecDecoder for the word formats). Generic compressors see
+ * 32 bit words; this one uses what the words are:
+ *
+ *   kinds    : 2 bits per 32 bit word - data, header, end of event, other.
+ *   headers  : module id, then the other header bits XORed with the module's previous header (varint).
+ *   channels : channel and the two flag bits, minus one more than the previous data word's in the
+ *              module event - 0 for channels read in order - bit-packed like the values.
+ *   values   : value minus the previous value of the same module and channel, zigzag coded and
+ *              bit-packed in chunks of 128 at the width of the chunk's biggest delta.
+ *   stamps   : end of event timestamp minus the module's previous one, modulo 2^30 (varint).
+ *   others   : extended timestamps, fill and BERR words and anything else, verbatim.
+ *
+ * The 16 bit words in front of the Mesytec data (the stack marker and its pad word) and an odd last
+ * word are kept as they are, so any event comes back bit for bit, Mesytec data or not. All state is
+ * reset at the start of each block, so blocks can be compressed and decompressed independently (and
+ * in parallel, see CRunFileWriter).
+ */
+
+#ifndef CMesytecCodec_H
+#define CMesytecCodec_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CMesytecCodec
+{
+public:
+  /*!
+     A stack event to encode, as handed out by CVMUSBBufferParser.
+  */
+  struct Event {
+    uint8_t         stackId;
+    const uint16_t* pBody;
+    size_t          nWords;
+  };
+
+  /*!
+     Where a decoded event is in the decoded words.
+  */
+  struct Extent {
+    uint8_t stackId;
+    size_t  offset;              // 16 bit words.
+    size_t  nWords;
+  };
+
+  static const uint32_t blockMagic = 0x31434d4d;   // "MMC1" little endian.
+  static const size_t   chunkSize  = 128;          // Values per bit-packed chunk.
+  static const unsigned maxPrefix  = 3;            // 16 bit words before the Mesytec data.
+
+  enum Kind { kindData = 0, kindHeader = 1, kindEndOfEvent = 2, kindOther = 3 };
+
+private:
+  uint32_t m_lastHeader[256];
+  uint32_t m_lastStamp[256];
+  uint16_t m_lastValue[256][32];
+
+  // Section buffers, kept to save allocations between blocks.
+
+  std::vector<uint8_t>  m_events;
+  std::vector<uint8_t>  m_kinds;
+  std::vector<uint8_t>  m_headers;
+  std::vector<uint8_t>  m_channels;
+  std::vector<uint32_t> m_chanDeltas;
+  std::vector<uint32_t> m_deltas;
+  std::vector<uint8_t>  m_values;
+  std::vector<uint8_t>  m_stamps;
+  std::vector<uint8_t>  m_others;
+  std::vector<uint32_t> m_longs;
+
+  struct Reader {                // A section being decoded.
+    const uint8_t* p;
+    const uint8_t* end;
+  };
+
+public:
+  CMesytecCodec();
+
+  void encode(const Event* pEvents, size_t nEvents, std::vector<uint8_t>& out);
+  bool decode(const uint8_t* pBlock, size_t nBytes,
+              std::vector<uint16_t>& words, std::vector<Extent>& events);
+
+  // Kernels, public so they can be timed and checked on their own:
+
+  static void   classify(const uint32_t* pWords, size_t nWords, uint8_t* pKinds);
+  static size_t pack(const uint32_t* pValues, size_t n, uint8_t* pOut);
+  static size_t unpack(const uint8_t* pIn, size_t nBytes, size_t n, uint32_t* pValues);
+
+  // 16 bit words in front of the first Mesytec header (0 if there is none):
+
+  static unsigned prefixLength(const uint16_t* pBody, size_t nWords);
+
+  // Utilities:
+private:
+  void     reset();
+  static void     putVarint(std::vector<uint8_t>& out, uint32_t value);
+  static bool     getVarint(Reader& in, uint32_t& value);
+  static void     putSection(std::vector<uint8_t>& out, const std::vector<uint8_t>& section);
+  static bool     getSection(Reader& in, Reader& section);
+};
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Implementation of the CMesytecDecoder class, see CMesytecDecoder.h for the data format.
+ */
+
+#include "CMesytecDecoder.h"
+
+/*!
+   Split a block of raw Mesytec data into the events of the modules that
+   produced it.  This is what a chained block transfer (CBLT) readout
+   returns: the module events are packed back to back in chain order,
+   possibly separated by fill words, and terminated by the BERR of the
+   last module.
+
+   Words that are not inside a header's declared length are skipped, so
+   a corrupt header only costs the words it claimed.  A header whose
+   length runs past the end of the block is returned truncated.
+
+   \param pData  : const uint32_t*
+      Pointer to the first raw word.
+   \param nWords : size_t
+      Number of 32 bit words available at pData.
+   \param events : std::vector<ModuleEvent>&
+      Module events are appended to this vector.  The entries point
+      into pData and are only valid as long as it is.
+
+   \return size_t
+   \retval Number of module events that were appended.
+*/
+size_t
+CMesytecDecoder::split(const uint32_t* pData, size_t nWords,
+                       std::vector<ModuleEvent>& events)
+{
+  size_t found = 0;
+  size_t i     = 0;
+  while (i < nWords) {
+    uint32_t word = pData[i];
+    if (!isHeader(word)) {
+      i++;                      // fill, BERR marker or stray data.
+      continue;
+    }
+    size_t length = eventLength(word) + 1;   // Count the header too.
+    if (i + length > nWords) {
+      length = nWords - i;
+    }
+    ModuleEvent event = {moduleId(word), pData + i, length};
+    events.push_back(event);
+    found++;
+    i += length;
+  }
+  return found;
+}
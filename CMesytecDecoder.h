@@ -0,0 +1,69 @@
+/*
+ * This file defines the decoder for raw Mesytec (MQDC-32 / MTDC-32) data words.
+ * The modules all share the same 32 bit data format:
+ *
+ *   header      : 01 ...... mmmmmmmm ....llllllllllll   m = module id, l = words that follow
+ *   data        : 00 000100 ...ccccc vvvvvvvvvvvvvvvv   c = channel, v = value
+ *   ext. stamp  : 00 000100 10...... tttttttttttttttt   high 16 bits of the timestamp
+ *   end of event: 11 tttttttttttttttttttttttttttttt     t = timestamp / event counter
+ *
+ * Fill words (0x00000000) and the VM-USB BERR marker (0xFFFFFFFF) can show up between events
+ * when the modules are read out with chained block transfers.
+ */
+
+#ifndef CMesytecDecoder_H
+#define CMesytecDecoder_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CMesytecDecoder
+{
+public:
+  /*!
+     One module's event inside a raw buffer.  pData points at the header
+     and nWords counts the header, the data words and the end of event.
+  */
+  struct ModuleEvent {
+    uint8_t         moduleId;
+    const uint32_t* pData;
+    size_t          nWords;
+  };
+
+  static const uint32_t typeMask        = 0xc0000000;
+  static const uint32_t typeHeader      = 0x40000000;
+  static const uint32_t typeData        = 0x00000000;
+  static const uint32_t typeEndOfEvent  = 0xc0000000;
+
+  static const uint32_t headerIdMask    = 0x00ff0000;
+  static const uint32_t headerIdShift   = 16;
+  static const uint32_t headerLenMask   = 0x00000fff;
+
+  static const uint32_t dataEvent       = 0x04000000;
+  static const uint32_t dataExtStamp    = 0x04800000;
+  static const uint32_t dataChanMask    = 0x001f0000;
+  static const uint32_t dataChanShift   = 16;
+  static const uint32_t dataValueMask   = 0x0000ffff;
+
+  static const uint32_t eoeStampMask    = 0x3fffffff;
+
+  static const uint32_t fillWord        = 0x00000000;
+  static const uint32_t berrWord        = 0xffffffff;
+
+public:
+  static bool     isHeader(uint32_t word)     { return (word & typeMask) == typeHeader; }
+  static bool     isEndOfEvent(uint32_t word) { return ((word & typeMask) == typeEndOfEvent) && (word != berrWord); }
+  static bool     isData(uint32_t word)       { return (word & (typeMask | 0x3f800000)) == dataEvent; }
+  static bool     isExtStamp(uint32_t word)   { return (word & (typeMask | 0x3fe00000)) == dataExtStamp; }
+  static uint8_t  moduleId(uint32_t header)   { return (header & headerIdMask) >> headerIdShift; }
+  static size_t   eventLength(uint32_t header){ return header & headerLenMask; }
+  static unsigned channel(uint32_t data)      { return (data & dataChanMask) >> dataChanShift; }
+  static uint16_t value(uint32_t data)        { return data & dataValueMask; }
+  static uint32_t timestamp(uint32_t eoe)     { return eoe & eoeStampMask; }
+
+  static size_t split(const uint32_t* pData, size_t nWords,
+                      std::vector<ModuleEvent>& events);
+};
+
+#endif
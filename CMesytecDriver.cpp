@@ -0,0 +1,184 @@
+/*
+ * Implementation of the CMesytecDriver class.
+ */
+
+#include "CMesytecDriver.h"
+#include "CMesytecDecoder.h"
+#include "CVMUSBReadoutList.h"
+
+/*!
+   \param name        : const char*     - for listings, e.g. "MQDC-32".
+   \param hardwareId  : uint16_t        - firmware_revision of the module.
+   \param reg, data   : const uint16_t* - register table written by addInit,
+                                          not copied, must stay around.
+   \param nSettings   : size_t          - entries in the table.
+   \param channelBits : unsigned        - width of the channel field.
+*/
+CMesytecDriver::CMesytecDriver(const char* name, uint16_t hardwareId, const uint16_t* reg,
+			       const uint16_t* data, size_t nSettings, unsigned channelBits) :
+  m_name(name),
+  m_hardwareId(hardwareId),
+  m_reg(reg),
+  m_data(data),
+  m_nSettings(nSettings),
+  m_channelMask((1 << channelBits) - 1),
+  m_mode(singleEvent),
+  m_transfers(defaultTransfers),
+  m_readAmod(CVMUSBReadoutList::a32PrivData),
+  m_writeAmod(CVMUSBReadoutList::a32PrivProgram),
+  m_blockAmod(CVMUSBReadoutList::a32PrivBlock),
+  m_thresholdChannels(0),
+  m_hasPulser(false),
+  m_hasPulserDac(false),
+  m_pulserOn(1)
+{
+  for (size_t i = 0; i < nSettings; i++) {
+    switch (reg[i]) {
+    case thresholdReg:
+      m_thresholdChannels = maxThresholds;
+      break;
+    case pulserStatusReg:
+      m_hasPulser = true;
+      if (data[i]) m_pulserOn = data[i];
+      break;
+    case pulserDacReg:
+      m_hasPulserDac = true;
+      break;
+    }
+  }
+}
+
+/*!
+   Select the readout fragment.  transfers is the length of the single
+   event FIFO read and is ignored by the multi event modes.
+*/
+void
+CMesytecDriver::setReadoutMode(ReadoutMode mode, size_t transfers)
+{
+  m_mode      = mode;
+  m_transfers = transfers;
+}
+
+void
+CMesytecDriver::setAddressModifiers(uint8_t read, uint8_t write, uint8_t block)
+{
+  m_readAmod  = read;
+  m_writeAmod = write;
+  m_blockAmod = block;
+}
+
+/*!
+   The register table, then what the readout mode needs.  Address 0 is
+   the data FIFO, not a register, and is skipped.
+*/
+void
+CMesytecDriver::addInit(uint32_t base, CVMUSBReadoutList& list) const
+{
+  for (size_t i = 0; i < m_nSettings; i++) {
+    if (m_reg[i] == 0) continue;
+    list.addWrite16(base | m_reg[i], m_writeAmod, m_data[i]);
+  }
+  if (m_mode != singleEvent) {
+    list.addWrite16(base | dataLenFormatReg, m_writeAmod,
+		    (m_mode == multiEventMblt) ? dataLen64 : dataLen32);
+    list.addWrite16(base | multiEventReg, m_writeAmod, multiEventOn);
+  }
+}
+
+void
+CMesytecDriver::addReadout(uint32_t base, CVMUSBReadoutList& list) const
+{
+  switch (m_mode) {
+  case singleEvent:
+    list.addFifoRead32(base, m_blockAmod, m_transfers);
+    break;
+  case multiEvent:
+    list.addBlockCountRead16(base | dataReg, countMask, m_readAmod);
+    list.addMaskedCountFifoRead32(base, m_blockAmod);
+    break;
+  case multiEventMblt:
+    list.addBlockCountRead16(base | dataReg, countMask, m_readAmod);
+    list.addMaskedCountFifoRead64(base, CVMUSBReadoutList::a32PrivMBLT);
+    break;
+  }
+}
+
+/*!
+   Lets the module take the next trigger.
+*/
+void
+CMesytecDriver::addReset(uint32_t base, CVMUSBReadoutList& list) const
+{
+  list.addWrite16(base | readoutResetReg, m_writeAmod, 1);
+}
+
+/*!
+   Decode a module event: header, data words, end of event.  The extended
+   timestamp, if present, is bits 30-45 of the event stamp above the 30
+   bits of the end of event word.
+*/
+size_t
+CMesytecDriver::decode(uint8_t moduleId, const uint32_t* pData, size_t nWords,
+		       Batch& batch) const
+{
+  uint32_t e     = batch.events();
+  size_t   first = batch.hits();
+  uint64_t high  = 0;
+  uint32_t stamp = 0;
+
+  batch.eventModule.push_back(moduleId);
+  batch.firstHit.push_back(first);
+
+  for (size_t i = 0; i < nWords; i++) {
+    uint32_t word = pData[i];
+    if (CMesytecDecoder::isData(word)) {
+      batch.module.push_back(moduleId);
+      batch.channel.push_back((word >> CMesytecDecoder::dataChanShift) & m_channelMask);
+      batch.value.push_back(CMesytecDecoder::value(word));
+      batch.event.push_back(e);
+    }
+    else if (CMesytecDecoder::isExtStamp(word)) {
+      high = CMesytecDecoder::value(word);
+    }
+    else if (CMesytecDecoder::isEndOfEvent(word)) {
+      stamp = CMesytecDecoder::timestamp(word);
+    }
+  }
+  batch.eventStamp.push_back((high << 30) | stamp);
+  return batch.hits() - first;
+}
+
+size_t
+CMesytecDriver::settings(const uint16_t*& reg, const uint16_t*& data) const
+{
+  reg  = m_reg;
+  data = m_data;
+  return m_nSettings;
+}
+
+/*!
+   All the channel thresholds in one go, thresholdMax and above switch a
+   channel off.
+*/
+void
+CMesytecDriver::addThresholds(uint32_t base, const uint16_t* pThresholds,
+			      CVMUSBReadoutList& list) const
+{
+  for (unsigned i = 0; i < m_thresholdChannels; i++) {
+    uint16_t threshold = (pThresholds[i] < thresholdMax) ? pThresholds[i] : thresholdMax;
+    list.addWrite16(base | (thresholdReg + 2*i), m_writeAmod, threshold);
+  }
+}
+
+/*!
+   Turn the test pulser on with the given amplitude (if the module has an
+   amplitude register) or off.
+*/
+void
+CMesytecDriver::addPulser(uint32_t base, bool on, uint16_t amplitude,
+			  CVMUSBReadoutList& list) const
+{
+  if (!m_hasPulser) return;
+  if (on && m_hasPulserDac) list.addWrite16(base | pulserDacReg, m_writeAmod, amplitude);
+  list.addWrite16(base | pulserStatusReg, m_writeAmod, on ? m_pulserOn : 0);
+}
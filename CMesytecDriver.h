@@ -0,0 +1,95 @@
+/*
+ * This file defines the CMesytecDriver class, the module driver for the Mesytec MQDC-32 and MTDC-32.
+ * Both share the VME interface registers and the data format (see CMesytecDecoder.h), so one class
+ * covers them; an instance is told its hardware id, its register table and how many channel bits its
+ * data words carry (5 for the MQDC, 6 for the MTDC whose trigger inputs show up as channels 32 and 33).
+ *
+ * The readout fragment comes in three flavours:
+ *
+ *   singleEvent - a FIFO read of a fixed number of longwords, one event per trigger.
+ *   multiEvent  - data_reg (words in the FIFO) is read as a masked count and the FIFO read transfers
+ *                 exactly that many longwords, so one trigger drains every buffered event.
+ *   multiEventMblt - as multiEvent with 64 bit block transfers, the count is then in 64 bit units.
+ *
+ * The multi event flavours add the data_len_format and multi_event writes they need to the init fragment.
+ *
+ * Thresholds and pulser are only offered for what the register table shows the module has: the channel
+ * thresholds if the table writes thresholdReg (the MQDC), the pulser amplitude if it writes pulserDacReg.
+ * The pulser is turned on with the status the table gives it (1 if the table leaves it off).
+ */
+
+#ifndef CMesytecDriver_H
+#define CMesytecDriver_H
+
+#include "CModuleDriver.h"
+
+class CMesytecDriver : public CModuleDriver
+{
+public:
+  typedef enum _ReadoutMode {
+    singleEvent,
+    multiEvent,
+    multiEventMblt
+  } ReadoutMode;
+
+  static const uint32_t dataReg          = 0x6030;   // Buffer data length.
+  static const uint32_t dataLenFormatReg = 0x6032;
+  static const uint32_t multiEventReg    = 0x6036;
+  static const uint32_t readoutResetReg  = 0x6034;
+  static const uint16_t dataLen32        = 2;
+  static const uint16_t dataLen64        = 3;
+  static const uint16_t multiEventOn     = 3;        // Transmit everything in the FIFO.
+  static const uint32_t countMask        = 0x3fff;   // The FIFO holds at most 16k words.
+  static const size_t   defaultTransfers = 64;       // Longwords of a single event read.
+  static const uint32_t thresholdReg     = 0x4000;   // Channel 0, the others follow (MQDC).
+  static const uint16_t thresholdMax     = 0x1fff;   // Switches the channel off.
+  static const uint32_t pulserStatusReg  = 0x6070;
+  static const uint32_t pulserDacReg     = 0x6072;   // Pulser amplitude (MQDC).
+  static const unsigned maxThresholds    = 32;
+
+private:
+  const char*     m_name;
+  uint16_t        m_hardwareId;
+  const uint16_t* m_reg;
+  const uint16_t* m_data;
+  size_t          m_nSettings;
+  uint32_t        m_channelMask;
+  ReadoutMode     m_mode;
+  size_t          m_transfers;
+  uint8_t         m_readAmod;
+  uint8_t         m_writeAmod;
+  uint8_t         m_blockAmod;
+  unsigned        m_thresholdChannels;   // 0 unless the table sets the thresholds.
+  bool            m_hasPulser;
+  bool            m_hasPulserDac;
+  uint16_t        m_pulserOn;            // Pulser status that turns it on.
+
+public:
+  CMesytecDriver(const char* name, uint16_t hardwareId, const uint16_t* reg,
+		 const uint16_t* data, size_t nSettings, unsigned channelBits = 5);
+
+  void        setReadoutMode(ReadoutMode mode, size_t transfers = defaultTransfers);
+  ReadoutMode readoutMode() const { return m_mode; }
+  void        setAddressModifiers(uint8_t read, uint8_t write, uint8_t block);
+
+  virtual const char* name() const       { return m_name; }
+  virtual unsigned    channelBits() const { return __builtin_popcount(m_channelMask); }
+  virtual uint16_t    hardwareId() const { return m_hardwareId; }
+
+  virtual void addInit(uint32_t base, CVMUSBReadoutList& list) const;
+  virtual void addReadout(uint32_t base, CVMUSBReadoutList& list) const;
+  virtual void addReset(uint32_t base, CVMUSBReadoutList& list) const;
+
+  virtual size_t decode(uint8_t moduleId, const uint32_t* pData, size_t nWords,
+			Batch& batch) const;
+
+  virtual size_t settings(const uint16_t*& reg, const uint16_t*& data) const;
+
+  virtual unsigned thresholdChannels() const { return m_thresholdChannels; }
+  virtual void     addThresholds(uint32_t base, const uint16_t* pThresholds,
+				 CVMUSBReadoutList& list) const;
+  virtual void     addPulser(uint32_t base, bool on, uint16_t amplitude,
+			     CVMUSBReadoutList& list) const;
+};
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * This file defines the CModuleDriver interface. A module driver knows one kind of VME module, identified
+ * by its hardware id (the Mesytec firmware_revision register, the one CCrateScan reads). It supplies the
+ * stack fragments to initialize a module, read it out and reset it after the readout, and decodes what its
+ * readout fragment returns. CModuleRegistry maps hardware ids to drivers and CModuleReadout composes the
+ * readout stack and the decoding of a whole crate from them, so supporting a new module means writing a
+ * driver, not touching the readout code.
+ *
+ * Decoded data goes into a Batch, kept as parallel arrays (one per field) so the analysis can run over
+ * one field of all the hits without dragging the others through the cache.
+ */
+
+#ifndef CModuleDriver_H
+#define CModuleDriver_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CVMUSBReadoutList;
+
+class CModuleDriver
+{
+public:
+  /*!
+     Decoded module events.  Hit i belongs to module event event[i]; module
+     event e came from module eventModule[e], carries timestamp eventStamp[e]
+     and its hits start at firstHit[e].
+  */
+  struct Batch {
+    std::vector<uint8_t>  module;        // Per hit.
+    std::vector<uint8_t>  channel;
+    std::vector<uint16_t> value;
+    std::vector<uint32_t> event;
+
+    std::vector<uint8_t>  eventModule;   // Per module event.
+    std::vector<uint64_t> eventStamp;    // 30 bits, 46 with the extended stamp.
+    std::vector<uint32_t> firstHit;
+
+    size_t hits() const   { return value.size(); }
+    size_t events() const { return eventStamp.size(); }
+    void   clear() {
+      module.clear(); channel.clear(); value.clear(); event.clear();
+      eventModule.clear(); eventStamp.clear(); firstHit.clear();
+    }
+  };
+
+public:
+  virtual ~CModuleDriver() {}
+
+  virtual const char* name() const = 0;
+  virtual uint16_t    hardwareId() const = 0;
+
+  virtual void addInit(uint32_t base, CVMUSBReadoutList& list) const = 0;
+  virtual void addReadout(uint32_t base, CVMUSBReadoutList& list) const = 0;
+  virtual void addReset(uint32_t base, CVMUSBReadoutList& list) const = 0;
+
+  /*!
+     Decode one module event as returned by the readout fragment.
+
+     \param moduleId : uint8_t         - the module's id in the data.
+     \param pData    : const uint32_t* - the event.
+     \param nWords   : size_t          - its length in 32 bit words.
+     \param batch    : Batch&          - where the event is appended.
+
+     \return size_t - number of hits appended.
+  */
+  virtual size_t decode(uint8_t moduleId, const uint32_t* pData, size_t nWords,
+			Batch& batch) const = 0;
+
+  /*!
+     The register settings addInit writes, for a differential configuration
+     that reads them back first.  Drivers without a plain register table
+     return 0.
+  */
+  virtual size_t settings(const uint16_t*& /* reg */, const uint16_t*& /* data */) const { return 0; }
+
+  /*!
+     Channel thresholds and test pulser, for pedestal runs (see
+     CPedestalCalibrator).  thresholdChannels is 0 for modules without
+     per channel thresholds and the add functions then add nothing.
+     pThresholds holds thresholdChannels values, channel 0 first.
+  */
+  virtual unsigned thresholdChannels() const { return 0; }
+  virtual unsigned channelBits() const       { return 5; }   // Width of the data words' channel field.
+  virtual void     addThresholds(uint32_t /* base */, const uint16_t* /* pThresholds */,
+				 CVMUSBReadoutList& /* list */) const {}
+  virtual void     addPulser(uint32_t /* base */, bool /* on */, uint16_t /* amplitude */,
+			     CVMUSBReadoutList& /* list */) const {}
+};
+
+#endif
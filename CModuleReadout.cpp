@@ -0,0 +1,157 @@
+/*
+ * Implementation of the CModuleReadout class.
+ */
+
+#include "CModuleReadout.h"
+#include "CModuleRegistry.h"
+#include "CVMUSBReadoutList.h"
+#include <string.h>
+
+/*!
+   \param registry : const CModuleRegistry&
+      Where the drivers are looked up, must outlive the readout.
+*/
+CModuleReadout::CModuleReadout(const CModuleRegistry& registry) :
+  m_registry(registry),
+  m_marker(0),
+  m_useMarker(false)
+{
+  for (unsigned i = 0; i < 256; i++) m_byId[i] = 0;
+  clearStatistics();
+}
+
+/*!
+   Take the modules of a crate inventory that have a driver.  Replaces
+   the previous inventory.
+
+   \return size_t - number of modules that will be read out.
+*/
+size_t
+CModuleReadout::setInventory(const std::vector<CCrateScan::Module>& crate)
+{
+  m_modules.clear();
+  for (unsigned i = 0; i < 256; i++) m_byId[i] = 0;
+
+  for (size_t i = 0; i < crate.size(); i++) {
+    CModuleDriver* pDriver = m_registry.find(crate[i].firmware);
+    if (!pDriver) continue;
+    Entry e = {crate[i].base, dataId(crate[i]), pDriver};
+    m_modules.push_back(e);
+    m_byId[e.dataId] = pDriver;
+  }
+  return m_modules.size();
+}
+
+/*!
+   The id a module puts in its data headers: its module_id register, or
+   address bits 31-24 when that is left at 0xff.
+*/
+uint8_t
+CModuleReadout::dataId(const CCrateScan::Module& module)
+{
+  return ((module.moduleId & 0xff) == 0xff) ? (module.base >> 24) : (module.moduleId & 0xff);
+}
+
+/*!
+   The init fragments of all the modules, for one executeList.
+*/
+void
+CModuleReadout::addInit(CVMUSBReadoutList& list) const
+{
+  for (size_t i = 0; i < m_modules.size(); i++) {
+    m_modules[i].pDriver->addInit(m_modules[i].base, list);
+  }
+}
+
+/*!
+   The readout stack: the marker if one is set, every module's readout
+   fragment, then every module's reset fragment.
+*/
+void
+CModuleReadout::addReadout(CVMUSBReadoutList& list) const
+{
+  if (m_useMarker) list.addMarker(m_marker);
+  for (size_t i = 0; i < m_modules.size(); i++) {
+    m_modules[i].pDriver->addReadout(m_modules[i].base, list);
+  }
+  addReset(list);
+}
+
+void
+CModuleReadout::addReset(CVMUSBReadoutList& list) const
+{
+  for (size_t i = 0; i < m_modules.size(); i++) {
+    m_modules[i].pDriver->addReset(m_modules[i].base, list);
+  }
+}
+
+/*!
+   Decode one stack event.
+
+   \param pBody  : const uint16_t* - event body as the parser hands it over.
+   \param nWords : size_t          - its length in 16 bit words.
+   \param batch  : Batch&          - where the module events are appended.
+
+   \return size_t - number of module events decoded.
+
+   The marker is a single 16 bit word; when the VM-USB pads it to 32 bits
+   the data starts one word later, whichever offset starts with a module
+   header is taken.  The longwords are used in place when they are 32 bit
+   aligned and copied to a scratch buffer otherwise.
+*/
+size_t
+CModuleReadout::decode(const uint16_t* pBody, size_t nWords, CModuleDriver::Batch& batch)
+{
+  m_stats.stackEvents++;
+  if (m_useMarker && (nWords > 0) && (pBody[0] == m_marker)) {
+    pBody++;
+    nWords--;
+    if ((nWords >= 3) && !CMesytecDecoder::isHeader(pBody[0] | (uint32_t(pBody[1]) << 16)) &&
+	CMesytecDecoder::isHeader(pBody[1] | (uint32_t(pBody[2]) << 16))) {
+      pBody++;
+      nWords--;
+    }
+  }
+
+  size_t          nLongs = nWords / 2;
+  const uint32_t* pData  = reinterpret_cast<const uint32_t*>(pBody);
+  if (reinterpret_cast<uintptr_t>(pBody) % sizeof(uint32_t)) {
+    m_scratch.resize(nLongs);
+    if (nLongs) memcpy(&m_scratch[0], pBody, nLongs*sizeof(uint32_t));
+    pData = nLongs ? &m_scratch[0] : 0;
+  }
+
+  m_events.clear();
+  CMesytecDecoder::split(pData, nLongs, m_events);
+
+  size_t decoded = 0;
+  for (size_t i = 0; i < m_events.size(); i++) {
+    const CMesytecDecoder::ModuleEvent& e = m_events[i];
+    CModuleDriver* pDriver = m_byId[e.moduleId];
+    if (pDriver) {
+      pDriver->decode(e.moduleId, e.pData, e.nWords, batch);
+      decoded++;
+    }
+    else {
+      m_stats.unknownEvents++;
+    }
+  }
+  m_stats.moduleEvents += decoded;
+  return decoded;
+}
+
+/*!
+   CVMUSBBufferParser::Handler: decode into the readout's own batch.  The
+   consumer empties it (batch().clear()) when it has used the data.
+*/
+void
+CModuleReadout::event(uint8_t /* stackId */, const uint16_t* pBody, size_t nWords)
+{
+  decode(pBody, nWords, m_batch);
+}
+
+void
+CModuleReadout::clearStatistics()
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
@@ -0,0 +1,76 @@
+/*
+ * This file defines the CModuleReadout class which builds the readout of a crate from its inventory
+ * (CCrateScan) and the module drivers (CModuleRegistry). Every module whose hardware id has a driver gets
+ * the driver's init, readout and reset fragments; the readout stack is
+ *
+ *   marker, readout of module 1 ... readout of module n, reset of module 1 ... reset of module n
+ *
+ * so the modules are all read before any of them is let go. On the way back the stack events are split
+ * at the Mesytec module headers and each module event is handed to the driver of the module whose id it
+ * carries, found with a table lookup. Installed as the CVMUSBBufferParser handler of the readout stack it
+ * decodes every event into its batch as it comes in.
+ */
+
+#ifndef CModuleReadout_H
+#define CModuleReadout_H
+
+#include "CModuleDriver.h"
+#include "CCrateScan.h"
+#include "CMesytecDecoder.h"
+#include "CVMUSBBufferParser.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CModuleRegistry;
+class CVMUSBReadoutList;
+
+class CModuleReadout : public CVMUSBBufferParser::Handler
+{
+public:
+  struct Entry {
+    uint32_t       base;
+    uint8_t        dataId;       // Module id in the data headers.
+    CModuleDriver* pDriver;
+  };
+
+  struct Statistics {
+    size_t stackEvents;
+    size_t moduleEvents;
+    size_t unknownEvents;        // Module id without a driver.
+  };
+
+private:
+  const CModuleRegistry&                    m_registry;
+  std::vector<Entry>                        m_modules;
+  CModuleDriver*                            m_byId[256];  // Data module id -> driver.
+  uint16_t                                  m_marker;
+  bool                                      m_useMarker;
+  CModuleDriver::Batch                      m_batch;
+  Statistics                                m_stats;
+  std::vector<uint32_t>                     m_scratch;    // Realigned event body.
+  std::vector<CMesytecDecoder::ModuleEvent> m_events;
+
+public:
+  CModuleReadout(const CModuleRegistry& registry);
+
+  size_t setInventory(const std::vector<CCrateScan::Module>& crate);
+  void   setMarker(uint16_t marker) { m_marker = marker; m_useMarker = true; }
+  void   clearMarker()              { m_useMarker = false; }
+
+  const std::vector<Entry>& modules() const { return m_modules; }
+  static uint8_t dataId(const CCrateScan::Module& module);
+
+  void addInit(CVMUSBReadoutList& list) const;
+  void addReadout(CVMUSBReadoutList& list) const;
+  void addReset(CVMUSBReadoutList& list) const;
+
+  size_t decode(const uint16_t* pBody, size_t nWords, CModuleDriver::Batch& batch);
+  virtual void event(uint8_t stackId, const uint16_t* pBody, size_t nWords);
+
+  CModuleDriver::Batch& batch()            { return m_batch; }
+  const Statistics&     statistics() const { return m_stats; }
+  void                  clearStatistics();
+};
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * Implementation of the CModuleRegistry class.
+ */
+
+#include "CModuleRegistry.h"
+#include "CModuleDriver.h"
+
+/*!
+   Register a driver under its hardware id, replacing the one registered
+   for that id before, if any.
+*/
+void
+CModuleRegistry::add(CModuleDriver* pDriver)
+{
+  m_drivers[pDriver->hardwareId()] = pDriver;
+}
+
+void
+CModuleRegistry::remove(uint16_t hardwareId)
+{
+  m_drivers.erase(hardwareId);
+}
+
+/*!
+   \return CModuleDriver* - the driver for a hardware id, null if there is none.
+*/
+CModuleDriver*
+CModuleRegistry::find(uint16_t hardwareId) const
+{
+  std::map<uint16_t, CModuleDriver*>::const_iterator p = m_drivers.find(hardwareId);
+  return (p == m_drivers.end()) ? 0 : p->second;
+}
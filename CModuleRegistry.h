@@ -0,0 +1,27 @@
+/*
+ * This file defines the CModuleRegistry class which maps hardware ids (firmware_revision) to module
+ * drivers. The registry does not own the drivers; they normally are statics of whoever registers them.
+ */
+
+#ifndef CModuleRegistry_H
+#define CModuleRegistry_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+
+class CModuleDriver;
+
+class CModuleRegistry
+{
+private:
+  std::map<uint16_t, CModuleDriver*> m_drivers;
+
+public:
+  void           add(CModuleDriver* pDriver);
+  void           remove(uint16_t hardwareId);
+  CModuleDriver* find(uint16_t hardwareId) const;
+  size_t         size() const { return m_drivers.size(); }
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Implementation of the CPedestalCalibrator class.
+ */
+
+#include "CPedestalCalibrator.h"
+#include "CZeroSuppressor.h"
+#include "CVMUSB.h"
+#include "CVMUSBReadoutList.h"
+#include <math.h>
+#include <algorithm>
+
+static const unsigned startHalfWidth(32);   // Bins either side of the peak to start with.
+static const unsigned minHalfWidth(2);
+static const unsigned maxIterations(5);
+
+/*!
+   \param bins : unsigned
+      Histogram length, values from 0 to bins-1.  4096 covers the MQDC's
+      12 bit range.
+*/
+CPedestalCalibrator::CPedestalCalibrator(unsigned bins) :
+  m_bins(bins ? bins : 1),
+  m_hits(0),
+  m_overflows(0)
+{
+}
+
+/*!
+   Histogram the hits of a batch.  Hits of modules without thresholds and
+   channels past maxChannels are ignored.
+
+   \param batch   : const CModuleDriver::Batch&
+      Typically CModuleReadout::batch(), cleared after each add.
+   \param modules : const std::vector<CModuleReadout::Entry>&
+      The crate, e.g. CModuleReadout::modules().
+*/
+void
+CPedestalCalibrator::add(const CModuleDriver::Batch& batch,
+			 const std::vector<CModuleReadout::Entry>& modules)
+{
+  bool calibrated[256];
+  withThresholds(modules, calibrated);
+
+  size_t nHits = batch.hits();
+  for (size_t i = 0; i < nHits; i++) {
+    uint8_t  channel = batch.channel[i];
+    uint16_t value   = batch.value[i];
+    if ((channel >= maxChannels) || !calibrated[batch.module[i]]) continue;
+    if (value >= m_bins) {
+      m_overflows++;
+      continue;
+    }
+    std::vector<uint32_t>& histogram(m_histograms[batch.module[i]]);
+    if (histogram.empty()) histogram.resize(maxChannels*m_bins);
+    histogram[channel*m_bins + value]++;
+    m_hits++;
+  }
+}
+
+/*!
+   Forget the histograms and results, for another run.
+*/
+void
+CPedestalCalibrator::clear()
+{
+  for (unsigned i = 0; i < 256; i++) {
+    m_histograms[i].clear();
+    m_results[i].clear();
+  }
+  m_hits      = 0;
+  m_overflows = 0;
+}
+
+/*!
+   Find the pedestal and noise of every histogrammed channel and derive
+   its threshold.
+
+   \param nSigma     : double
+      Noise widths above the pedestal.
+   \param margin     : uint16_t
+      Added on top, so a channel whose pedestal sits in one bin (no noise
+      to measure) still gets a cut above it.
+   \param minEntries : uint32_t
+      Fewer hits than this leave a channel invalid with a threshold of 0.
+
+   \return size_t - number of valid channels.
+*/
+size_t
+CPedestalCalibrator::compute(double nSigma, uint16_t margin, uint32_t minEntries)
+{
+  size_t nValid = 0;
+  for (unsigned module = 0; module < 256; module++) {
+    m_results[module].clear();
+    if (m_histograms[module].empty()) continue;
+    m_results[module].resize(maxChannels);
+
+    for (unsigned channel = 0; channel < maxChannels; channel++) {
+      const uint32_t* pHistogram = &m_histograms[module][channel*m_bins];
+      Channel&        result(m_results[module][channel]);
+      result = Channel{0, 0.0, 0.0, 0, false};
+
+      unsigned peak = 0;
+      for (unsigned bin = 0; bin < m_bins; bin++) {
+	result.entries += pHistogram[bin];
+	if (pHistogram[bin] > pHistogram[peak]) peak = bin;
+      }
+      if (result.entries < minEntries) continue;
+
+      unsigned lo = (peak > startHalfWidth) ? peak - startHalfWidth : 0;
+      unsigned hi = std::min(peak + startHalfWidth, m_bins - 1);
+      double   entries, mean, sigma;
+      for (unsigned i = 0; i < maxIterations; i++) {
+	window(pHistogram, lo, hi, entries, mean, sigma);
+	double   half  = std::max(3.0*sigma, double(minHalfWidth));
+	unsigned newLo = (mean > half) ? unsigned(floor(mean - half)) : 0;
+	unsigned newHi = std::min(unsigned(ceil(mean + half)), m_bins - 1);
+	if ((newLo == lo) && (newHi == hi)) break;
+	lo = newLo;
+	hi = newHi;
+      }
+
+      double threshold = ceil(mean + nSigma*sigma) + margin;
+      result.pedestal  = mean;
+      result.noise     = sigma;
+      result.threshold = uint16_t(std::min(threshold, 65535.0));
+      result.valid     = true;
+      nValid++;
+    }
+  }
+  return nValid;
+}
+
+/*!
+   \return const Channel* - maxChannels results of a module, 0 if it had
+                            no hits or compute() wasn't called.
+*/
+const CPedestalCalibrator::Channel*
+CPedestalCalibrator::channels(uint8_t moduleId) const
+{
+  return m_results[moduleId].empty() ? 0 : m_results[moduleId].data();
+}
+
+/*!
+   \param moduleId    : uint8_t
+   \param pThresholds : uint16_t*
+      Receives maxChannels thresholds.
+
+   \return bool - false if there are no results for the module.
+*/
+bool
+CPedestalCalibrator::thresholds(uint8_t moduleId, uint16_t* pThresholds) const
+{
+  const Channel* pChannels = channels(moduleId);
+  if (!pChannels) return false;
+  for (unsigned i = 0; i < maxChannels; i++) pThresholds[i] = pChannels[i].threshold;
+  return true;
+}
+
+/*!
+   Write the thresholds into the modules.  Each module gets one list with
+   all its channels; the lists go out pipelined in one executeLists call.
+   Modules without results or without thresholds are left alone.  Note
+   that vme::moduleInit and vme::moduleConfigure write the register
+   table's thresholds (0) again.
+
+   \param vmusb   : CVMUSB&
+   \param modules : const std::vector<CModuleReadout::Entry>&
+      The crate, e.g. CModuleReadout::modules().
+
+   \return size_t - modules loaded successfully.
+*/
+size_t
+CPedestalCalibrator::load(CVMUSB& vmusb, const std::vector<CModuleReadout::Entry>& modules) const
+{
+  std::vector<CVMUSBReadoutList>   lists;
+  std::vector<uint32_t>            replies;
+  uint16_t                         values[maxChannels];
+
+  lists.reserve(modules.size());
+  for (size_t i = 0; i < modules.size(); i++) {
+    const CModuleReadout::Entry& module(modules[i]);
+    unsigned nChannels = module.pDriver->thresholdChannels();
+    if (!nChannels || (nChannels > maxChannels) || !thresholds(module.dataId, values)) continue;
+    lists.push_back(CVMUSBReadoutList());
+    module.pDriver->addThresholds(module.base, values, lists.back());
+  }
+  if (lists.empty()) return 0;
+
+  replies.resize(lists.size());
+  std::vector<CVMUSB::ListRequest> requests(lists.size());
+  for (size_t i = 0; i < lists.size(); i++) {
+    requests[i].pList          = &lists[i];
+    requests[i].pReadBuffer    = &replies[i];
+    requests[i].readBufferSize = sizeof(uint32_t);
+  }
+  size_t failed = vmusb.executeLists(requests.data(), requests.size());
+  return lists.size() - failed;
+}
+
+/*!
+   Give the thresholds to a software zero suppressor, for the modules of
+   the crate that have thresholds.
+*/
+void
+CPedestalCalibrator::apply(CZeroSuppressor& suppressor,
+			   const std::vector<CModuleReadout::Entry>& modules) const
+{
+  bool     calibrated[256];
+  uint16_t values[maxChannels];
+  withThresholds(modules, calibrated);
+  for (unsigned module = 0; module < 256; module++) {
+    if (calibrated[module] && thresholds(module, values)) {
+      suppressor.setThresholds(module, values, maxChannels);
+    }
+  }
+}
+
+/*
+ * Which module ids (in the data) have a driver with channel thresholds.
+ */
+void
+CPedestalCalibrator::withThresholds(const std::vector<CModuleReadout::Entry>& modules, bool* pCalibrated)
+{
+  std::fill(pCalibrated, pCalibrated + 256, false);
+  for (size_t i = 0; i < modules.size(); i++) {
+    if (modules[i].pDriver->thresholdChannels()) pCalibrated[modules[i].dataId] = true;
+  }
+}
+
+/*
+ * Entries, mean and standard deviation of the bins lo to hi.
+ */
+void
+CPedestalCalibrator::window(const uint32_t* pHistogram, unsigned lo, unsigned hi,
+			    double& entries, double& mean, double& sigma)
+{
+  double sum  = 0.0;
+  double sum2 = 0.0;
+  entries     = 0.0;
+  for (unsigned bin = lo; bin <= hi; bin++) {
+    double n = pHistogram[bin];
+    entries += n;
+    sum     += n*bin;
+    sum2    += n*double(bin)*bin;
+  }
+  mean  = entries ? sum/entries : lo;
+  sigma = entries ? sqrt(std::max(sum2/entries - mean*mean, 0.0)) : 0.0;
+}
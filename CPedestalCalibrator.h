@@ -0,0 +1,74 @@
+/*
+ * This file defines the CPedestalCalibrator class which derives channel thresholds from a pedestal run.
+ * During a short run with the test pulser at zero amplitude, or random triggers, every decoded hit (see
+ * CModuleReadout) of a module with thresholds is histogrammed per module and channel; modules whose driver has
+ * none (thresholdChannels() is 0, e.g. the MTDC, whose values are times) are left out throughout. compute() then finds each channel's pedestal
+ * and noise and sets its threshold to
+ *
+ *   pedestal + nSigma * noise + margin
+ *
+ * The pedestal and noise are the mean and standard deviation of the histogram in a window around its
+ * highest bin, narrowed to +-3 standard deviations a few times, so real signals in a random trigger run
+ * don't pull them. Channels with fewer than minEntries hits keep a threshold of 0.
+ *
+ * load() writes the thresholds of every module whose driver has them, all of a module's channels in one
+ * list and the lists of all modules pipelined through CVMUSB::executeLists. apply() gives the same
+ * thresholds to a CZeroSuppressor for modules that can't take them in hardware.
+ */
+
+#ifndef CPedestalCalibrator_H
+#define CPedestalCalibrator_H
+
+#include "CModuleDriver.h"
+#include "CModuleReadout.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CVMUSB;
+class CZeroSuppressor;
+
+class CPedestalCalibrator
+{
+public:
+  static const unsigned maxChannels = 32;
+
+  struct Channel {
+    uint32_t entries;            // Hits in the histogram range.
+    double   pedestal;
+    double   noise;
+    uint16_t threshold;
+    bool     valid;              // Enough entries to go by.
+  };
+
+private:
+  unsigned                m_bins;            // Values from 0 to m_bins-1 are histogrammed.
+  std::vector<uint32_t>   m_histograms[256]; // By module id: maxChannels*m_bins, empty if unseen.
+  std::vector<Channel>    m_results[256];    // By module id, after compute().
+  size_t                  m_hits;
+  size_t                  m_overflows;       // Values past the last bin.
+
+public:
+  CPedestalCalibrator(unsigned bins = 4096);
+
+  void   add(const CModuleDriver::Batch& batch, const std::vector<CModuleReadout::Entry>& modules);
+  void   clear();
+
+  size_t compute(double nSigma = 4.0, uint16_t margin = 2, uint32_t minEntries = 100);
+  const Channel* channels(uint8_t moduleId) const;
+  bool   thresholds(uint8_t moduleId, uint16_t* pThresholds) const;
+
+  size_t load(CVMUSB& vmusb, const std::vector<CModuleReadout::Entry>& modules) const;
+  void   apply(CZeroSuppressor& suppressor, const std::vector<CModuleReadout::Entry>& modules) const;
+
+  size_t hits() const      { return m_hits; }
+  size_t overflows() const { return m_overflows; }
+
+  // Utilities:
+private:
+  static void withThresholds(const std::vector<CModuleReadout::Entry>& modules, bool* pCalibrated);
+  static void window(const uint32_t* pHistogram, unsigned lo, unsigned hi,
+		     double& entries, double& mean, double& sigma);
+};
+
+#endif
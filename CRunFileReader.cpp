@@ -0,0 +1,115 @@
+/*
+ * Implementation of the CRunFileReader class.
+ */
+
+#include "CRunFileReader.h"
+#include "CRunFileWriter.h"
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+static const uint32_t maxBlockBytes(256*1024*1024);   // Bigger sizes are damage, not data.
+
+/*!
+   \param path : const std::string&
+      A file written by CRunFileWriter.
+
+   \throw std::runtime_error if it can't be opened or isn't a run file
+          this version can read.
+*/
+CRunFileReader::CRunFileReader(const std::string& path) :
+  m_pFile(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_pFile = fopen(path.c_str(), "rb");
+  if (!m_pFile) {
+    std::string msg("CRunFileReader - can't open ");
+    msg += path;
+    msg += ": ";
+    msg += strerror(errno);
+    throw std::runtime_error(msg);
+  }
+  uint32_t header[2];
+  if ((fread(header, sizeof(header), 1, m_pFile) != 1) ||
+      (header[0] != CRunFileWriter::fileMagic) || (header[1] != CRunFileWriter::fileVersion)) {
+    fclose(m_pFile);
+    std::string msg("CRunFileReader - ");
+    msg += path;
+    msg += " is not a version 1 run file";
+    throw std::runtime_error(msg);
+  }
+}
+
+CRunFileReader::~CRunFileReader()
+{
+  fclose(m_pFile);
+}
+
+/*!
+   Read and decode the next block.
+
+   \param words  : std::vector<uint16_t>&
+      Replaced by the block's event bodies.
+   \param events : std::vector<CMesytecCodec::Extent>&
+      Replaced by where each event is in words.
+
+   \return int
+   \retval 1  - A block was read.
+   \retval 0  - End of file, or a block cut short by the end of the file
+                (the writer died mid block).
+   \retval -1 - The block was damaged and has been skipped, words and
+                events are empty.  Call again for the next block.  If the
+                block's size itself is damaged there is no next block and
+                the following call returns 0.
+*/
+int
+CRunFileReader::next(std::vector<uint16_t>& words, std::vector<CMesytecCodec::Extent>& events)
+{
+  words.clear();
+  events.clear();
+
+  uint32_t frame[2];
+  if (fread(frame, sizeof(frame), 1, m_pFile) != 1) return 0;
+  if (frame[0] > maxBlockBytes) {
+    m_stats.badBlocks++;
+    fseek(m_pFile, 0, SEEK_END);
+    return -1;
+  }
+  m_block.resize(frame[0]);
+  if (frame[0] && (fread(m_block.data(), frame[0], 1, m_pFile) != 1)) return 0;
+
+  if ((CRunFileWriter::checksum(m_block.data(), m_block.size()) != frame[1]) ||
+      !m_codec.decode(m_block.data(), m_block.size(), words, events)) {
+    words.clear();
+    events.clear();
+    m_stats.badBlocks++;
+    return -1;
+  }
+  m_stats.blocks++;
+  m_stats.events   += events.size();
+  m_stats.rawBytes += words.size()*sizeof(uint16_t);
+  return 1;
+}
+
+/*!
+   Hand every event left in the file to a handler, in the order written.
+   Damaged blocks are skipped.
+
+   \param handler : CVMUSBBufferParser::Handler&
+
+   \return size_t - events handed out.
+*/
+size_t
+CRunFileReader::replay(CVMUSBBufferParser::Handler& handler)
+{
+  size_t nEvents = 0;
+  int    status;
+  while ((status = next(m_words, m_events)) != 0) {
+    for (size_t i = 0; i < m_events.size(); i++) {
+      const CMesytecCodec::Extent& event(m_events[i]);
+      handler.event(event.stackId, m_words.data() + event.offset, event.nWords);
+    }
+    nEvents += m_events.size();
+  }
+  return nEvents;
+}
@@ -0,0 +1,47 @@
+/*
+ * This file defines the CRunFileReader class which reads back the files CRunFileWriter writes. Blocks are
+ * read and decompressed one at a time; replay() hands every event to a CVMUSBBufferParser::Handler as if
+ * it had come from the VM-USB, so the analysis that ran online can run on the file unchanged. A block
+ * whose checksum or decoding fails is skipped and counted; the blocks after it read normally.
+ */
+
+#ifndef CRunFileReader_H
+#define CRunFileReader_H
+
+#include "CVMUSBBufferParser.h"
+#include "CMesytecCodec.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class CRunFileReader
+{
+public:
+  struct Statistics {
+    size_t   blocks;             // Read and decoded.
+    size_t   badBlocks;          // Skipped, damaged.
+    size_t   events;
+    uint64_t rawBytes;           // Event bodies decoded.
+  };
+
+private:
+  FILE*                              m_pFile;
+  CMesytecCodec                      m_codec;
+  std::vector<uint8_t>               m_block;
+  std::vector<uint16_t>              m_words;
+  std::vector<CMesytecCodec::Extent> m_events;
+  Statistics                         m_stats;
+
+public:
+  CRunFileReader(const std::string& path);
+  ~CRunFileReader();
+
+  int    next(std::vector<uint16_t>& words, std::vector<CMesytecCodec::Extent>& events);
+  size_t replay(CVMUSBBufferParser::Handler& handler);
+
+  Statistics statistics() const { return m_stats; }
+};
+
+#endif
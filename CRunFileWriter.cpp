@@ -0,0 +1,234 @@
+/*
+ * Implementation of the CRunFileWriter class.
+ */
+
+#include "CRunFileWriter.h"
+#include <errno.h>
+#include <string.h>
+#include <stdexcept>
+
+/*!
+   \param path       : const std::string&
+      The file, created or truncated.
+   \param threads    : unsigned
+      Compression threads, at least one.
+   \param blockBytes : size_t
+      Event data per block.  Bigger blocks compress a little better and
+      take longer to come back if the run dies.
+   \param maxQueued  : size_t
+      Most blocks being compressed or waiting to be written.
+
+   \throw std::runtime_error if the file can't be opened or written.
+*/
+CRunFileWriter::CRunFileWriter(const std::string& path, unsigned threads,
+                               size_t blockBytes, size_t maxQueued) :
+  m_pFile(0),
+  m_path(path),
+  m_blockBytes(blockBytes),
+  m_maxQueued(maxQueued ? maxQueued : 1),
+  m_pCurrent(0),
+  m_nextSequence(0),
+  m_nextWrite(0),
+  m_inPool(0),
+  m_writing(false),
+  m_exit(false),
+  m_error(0)
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_pFile = fopen(path.c_str(), "wb");
+  uint32_t header[2] = {fileMagic, fileVersion};
+  if (!m_pFile || (fwrite(header, sizeof(header), 1, m_pFile) != 1)) {
+    std::string msg("CRunFileWriter - can't write ");
+    msg += path;
+    msg += ": ";
+    msg += strerror(errno);
+    if (m_pFile) fclose(m_pFile);
+    throw std::runtime_error(msg);
+  }
+  m_stats.fileBytes = sizeof(header);
+
+  if (!threads) threads = 1;
+  for (unsigned i = 0; i < threads; i++) {
+    m_threads.push_back(std::thread(&CRunFileWriter::compressor, this));
+  }
+}
+
+/*!
+   Closes the file if close wasn't called; a write error is lost then.
+*/
+CRunFileWriter::~CRunFileWriter()
+{
+  try {
+    close();
+  }
+  catch (...) {}
+}
+
+/*!
+   Add one stack event to the current block, handing the block to the
+   compression threads once it is full.  May wait for room in the pool.
+*/
+void
+CRunFileWriter::event(uint8_t stackId, const uint16_t* pBody, size_t nWords)
+{
+  if (!m_pCurrent) m_pCurrent = new Block;
+
+  CMesytecCodec::Extent extent = {stackId, m_pCurrent->words.size(), nWords};
+  m_pCurrent->extents.push_back(extent);
+  m_pCurrent->words.insert(m_pCurrent->words.end(), pBody, pBody + nWords);
+  if (m_pCurrent->words.size()*sizeof(uint16_t) >= m_blockBytes) flush();
+}
+
+/*!
+   Hand the current block to the compression threads even if it isn't
+   full, e.g. at the end of a run or on a timer so little is lost if the
+   host goes down.
+*/
+void
+CRunFileWriter::flush()
+{
+  if (!m_pCurrent || m_pCurrent->extents.empty()) return;
+
+  std::unique_lock<std::mutex> lock(m_lock);
+  m_room.wait(lock, [this] { return m_inPool < m_maxQueued; });
+  m_pCurrent->sequence = m_nextSequence++;
+  m_queue.push_back(m_pCurrent);
+  m_inPool++;
+  m_pCurrent = 0;
+  m_work.notify_one();
+}
+
+/*!
+   Flush, wait for every block to be written and close the file.  Safe to
+   call more than once.
+
+   \throw std::runtime_error if a write failed; the blocks from that one
+          on are missing from the file.
+*/
+void
+CRunFileWriter::close()
+{
+  if (!m_pFile) return;
+  flush();
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_exit = true;
+  }
+  m_work.notify_all();
+  for (size_t i = 0; i < m_threads.size(); i++) m_threads[i].join();
+  m_threads.clear();
+
+  if ((fclose(m_pFile) != 0) && !m_error) m_error = errno;
+  m_pFile = 0;
+  delete m_pCurrent;
+  m_pCurrent = 0;
+  if (m_error) {
+    std::string msg("CRunFileWriter - writing ");
+    msg += m_path;
+    msg += " failed: ";
+    msg += strerror(m_error);
+    throw std::runtime_error(msg);
+  }
+}
+
+/*!
+   \return Statistics - a snapshot of the counters.
+*/
+CRunFileWriter::Statistics
+CRunFileWriter::statistics()
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  return m_stats;
+}
+
+/*!
+   FNV-1a over the bytes, to catch damaged blocks on reading.
+*/
+uint32_t
+CRunFileWriter::checksum(const uint8_t* pData, size_t nBytes)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < nBytes; i++) {
+    hash ^= pData[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * A compression thread.  Runs until close() and nothing is left to do.
+ */
+void
+CRunFileWriter::compressor()
+{
+  CMesytecCodec                      codec;
+  std::vector<CMesytecCodec::Event>  events;
+  std::unique_lock<std::mutex>       lock(m_lock);
+
+  while (true) {
+    m_work.wait(lock, [this] { return m_exit || !m_queue.empty(); });
+    if (m_queue.empty()) return;
+    Block* pBlock = m_queue.front();
+    m_queue.pop_front();
+    lock.unlock();
+
+    events.resize(pBlock->extents.size());
+    for (size_t i = 0; i < events.size(); i++) {
+      const CMesytecCodec::Extent& extent(pBlock->extents[i]);
+      events[i].stackId = extent.stackId;
+      events[i].pBody   = pBlock->words.data() + extent.offset;
+      events[i].nWords  = extent.nWords;
+    }
+    pBlock->compressed.assign(2*sizeof(uint32_t), 0);              // Frame, filled in below.
+    codec.encode(events.data(), events.size(), pBlock->compressed);
+    uint32_t frame[2] = {
+      static_cast<uint32_t>(pBlock->compressed.size() - sizeof(frame)),
+      checksum(pBlock->compressed.data() + sizeof(frame), pBlock->compressed.size() - sizeof(frame))
+    };
+    memcpy(pBlock->compressed.data(), frame, sizeof(frame));
+
+    lock.lock();
+    m_done[pBlock->sequence] = pBlock;
+    if (!m_writing) writeReady(lock);
+  }
+}
+
+/*
+ * Write the compressed blocks that are next in sequence.  Called with
+ * the lock held; drops it around each write.  Only one thread at a time
+ * is in here (m_writing) so the file sees the blocks in order.
+ */
+void
+CRunFileWriter::writeReady(std::unique_lock<std::mutex>& lock)
+{
+  m_writing = true;
+  std::map<uint64_t, Block*>::iterator p;
+  while ((p = m_done.find(m_nextWrite)) != m_done.end()) {
+    Block* pBlock = p->second;
+    m_done.erase(p);
+    bool   write  = (m_error == 0);
+    lock.unlock();
+
+    int error = 0;
+    if (write && (fwrite(pBlock->compressed.data(), pBlock->compressed.size(), 1, m_pFile) != 1)) {
+      error = errno ? errno : EIO;
+    }
+
+    lock.lock();
+    if (!write || error) {
+      if (error && !m_error) m_error = error;
+      m_stats.lostBlocks++;
+    }
+    else {
+      m_stats.blocks++;
+      m_stats.events    += pBlock->extents.size();
+      m_stats.rawBytes  += pBlock->words.size()*sizeof(uint16_t);
+      m_stats.fileBytes += pBlock->compressed.size();
+    }
+    delete pBlock;
+    m_nextWrite++;
+    m_inPool--;
+    m_room.notify_one();
+  }
+  m_writing = false;
+}
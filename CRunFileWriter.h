@@ -0,0 +1,94 @@
+/*
+ * This file defines the CRunFileWriter class which writes the stack events of a run to disk compressed
+ * with CMesytecCodec. Register it with a CVMUSBBufferParser as the handler of the stacks to keep. Events
+ * are gathered into blocks; full blocks are compressed by a pool of threads, each with its own codec,
+ * and written in order by whichever thread finishes the next one, so compression keeps up with readout
+ * on as many cores as it needs. At most maxQueued blocks are in the pool; beyond that event() waits,
+ * pushing back on readout rather than growing without bound.
+ *
+ * File layout (little endian):
+ *
+ *   file header : magic "VMRF", version
+ *   block       : compressed size, checksum of the compressed bytes, CMesytecCodec block
+ *
+ * CRunFileReader reads it back.
+ */
+
+#ifndef CRunFileWriter_H
+#define CRunFileWriter_H
+
+#include "CVMUSBBufferParser.h"
+#include "CMesytecCodec.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class CRunFileWriter : public CVMUSBBufferParser::Handler
+{
+public:
+  static const uint32_t fileMagic   = 0x46524d56;   // "VMRF" little endian.
+  static const uint32_t fileVersion = 1;
+
+  struct Statistics {
+    size_t   events;
+    size_t   blocks;             // Written.
+    uint64_t rawBytes;           // Event bodies written.
+    uint64_t fileBytes;
+    size_t   lostBlocks;         // Not written because a write failed.
+  };
+
+private:
+  struct Block {
+    uint64_t                              sequence;
+    std::vector<uint16_t>                 words;
+    std::vector<CMesytecCodec::Extent>    extents;
+    std::vector<uint8_t>                  compressed;
+  };
+
+  FILE*                         m_pFile;
+  std::string                   m_path;
+  size_t                        m_blockBytes;
+  size_t                        m_maxQueued;
+  Block*                        m_pCurrent;    // Being filled by event(), producer side only.
+
+  std::mutex                    m_lock;        // Guards everything below.
+  std::condition_variable       m_work;        // Blocks to compress, or exiting.
+  std::condition_variable       m_room;        // A block left the pool.
+  std::deque<Block*>            m_queue;
+  std::map<uint64_t, Block*>    m_done;        // Compressed, waiting for their turn.
+  uint64_t                      m_nextSequence;
+  uint64_t                      m_nextWrite;
+  size_t                        m_inPool;
+  bool                          m_writing;     // A thread is writing blocks out.
+  bool                          m_exit;
+  int                           m_error;       // errno of the first failed write.
+  Statistics                    m_stats;
+  std::vector<std::thread>      m_threads;
+
+public:
+  CRunFileWriter(const std::string& path, unsigned threads = 2,
+                 size_t blockBytes = 1024*1024, size_t maxQueued = 8);
+  virtual ~CRunFileWriter();
+
+  virtual void event(uint8_t stackId, const uint16_t* pBody, size_t nWords);
+  void flush();
+  void close();
+
+  Statistics statistics();
+
+  static uint32_t checksum(const uint8_t* pData, size_t nBytes);
+
+  // Utilities:
+private:
+  void compressor();
+  void writeReady(std::unique_lock<std::mutex>& lock);
+};
+
+#endif
@@ -26,6 +26,9 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 using namespace std;
 
@@ -68,6 +71,10 @@ static const unsigned int USBSetup(0x3c);       // USB Bulk transfer setup.
 static const unsigned int USBVHIGH1(0x40);       // additional bits of some of the interrupt vectors.
 static const unsigned int USBVHIGH2(0x44);       // additional bits of the other interrupt vectors.
 
+// Class constants:
+
+const unsigned CVMUSB::maxPipelineDepth;
+
 
 // Bits in the list target address word:
 
@@ -208,7 +215,8 @@ CVMUSB::CVMUSB(struct usb_device* device) :
     m_handle(0),
     m_device(device),
     m_timeout(DEFAULT_TIMEOUT),
-    m_regShadow()
+    m_regShadow(),
+    m_recoveryStats()
 {
     m_handle  = usb_open(m_device);
     if (!m_handle) {
@@ -884,23 +892,236 @@ CVMUSB::vmeFifoRead(uint32_t address, uint8_t aModifier,
 /////////////////////////////////////////////////////////////////////////
   
 
+/*!
+   Execute a list and return what it read.  maxBytes is only an upper
+   bound and usually far more than the list reads, so the reply goes to an
+   uninitialized buffer and only the bytes actually read are copied into
+   the result.  Tcl scripts that want the data as one object should use
+   the CVMUSB_executeListBytes command instead (see CVMUSB.i).
+*/
 std::vector<uint8_t> 
 CVMUSB::executeList(CVMUSBReadoutList& list, int maxBytes)
 {
-  size_t               nRead;
-  std::vector<uint8_t> result(maxBytes, 0);
+  size_t                     nRead = 0;
+  std::unique_ptr<uint8_t[]> reply(new uint8_t[maxBytes > 0 ? maxBytes : 1]);
 
-  int status = this->executeList(list, result.data(), result.size(), &nRead);
+  int status = this->executeList(list, reply.get(), maxBytes > 0 ? maxBytes : 0, &nRead);
 
-  if (status >= 0) {
-    result.resize(nRead);
-  } else {
+  if (status < 0) {
     // failure ... get 
-    result.resize(0); 
+    nRead = 0;
+  }
+  return std::vector<uint8_t>(reply.get(), reply.get() + nRead);
+}
+
+
+/*!
+   Read a stack back from the VM-USB stack memory.  Interfaces that cannot
+   do that (e.g. mocks) inherit this, which reports the operation as
+   unsupported.
+
+   \return int
+   \retval -1  errno is ENOTSUP.
+*/
+int
+CVMUSB::readList(uint8_t /* listNumber */, size_t /* longwords */, off_t /* listOffset */,
+                 std::vector<uint32_t>& list)
+{
+  list.clear();
+  errno = ENOTSUP;
+  return -1;
+}
+
+/*!
+   End a run without losing its tail and without hanging.  Data taking is
+   turned off and buffers are read until the VM-USB sends the one flagged
+   as the last buffer, or until maxLatencyMs has passed, whichever comes
+   first.  Reads start with a short timeout which is doubled each time a
+   read comes back empty and dropped back after each buffer, so a busy
+   interface is emptied quickly and a quiet one is not hammered.
+
+   \param pSink        : BufferSink*
+      Gets every buffer read, in order, including the last one.  May be
+      null to just discard the data.
+   \param pStats       : DrainStatistics*
+      If not null, receives what was flushed.
+   \param maxLatencyMs : int
+      Hard bound on the time spent in here.
+   \param action       : uint16_t
+      Action register value to write; the startDAQ bit is always cleared.
+      Use this to preserve other action bits.
+
+   \return int
+   \retval 0  - The last buffer was seen, the VM-USB is drained.
+   \retval 1  - The latency bound ran out first; data may remain.
+   \retval -1 - A USB read failed, reason in errno.
+
+   \note If the USB FIFO is full the action register write can only
+          get through once some data has been read, so a failed write is
+          retried after each read, the same as the open time flush does.
+*/
+int
+CVMUSB::stopAndDrain(BufferSink* pSink, DrainStatistics* pStats, int maxLatencyMs,
+                     uint16_t action)
+{
+  static const int      firstTimeout = 5;      // ms
+  static const int      maxTimeout   = 100;    // ms
+  static const uint16_t lastBufferBit = 0x8000;
+
+  using namespace std::chrono;
+  steady_clock::time_point start = steady_clock::now();
+  DrainStatistics          stats = {0, 0, 0, 0, 0, false, false};
+  std::vector<uint8_t>     buffer(13*1024*sizeof(uint16_t) + 2*sizeof(uint32_t)); // Biggest buffer.
+  bool                     stopped = false;
+  int                      timeout = firstTimeout;
+  int                      status  = 1;
+
+  while (true) {
+    int remaining = maxLatencyMs -
+      static_cast<int>(duration_cast<milliseconds>(steady_clock::now() - start).count());
+    if (remaining <= 0) break;
+
+    if (!stopped) {
+      try {
+        writeActionRegister(action & ~ActionRegister::startDAQ, remaining);
+        stopped = true;
+      }
+      catch (...) {}                           // FIFO full, read and retry.
+
+      remaining = maxLatencyMs -
+        static_cast<int>(duration_cast<milliseconds>(steady_clock::now() - start).count());
+      if (remaining <= 0) break;
+    }
+
+    size_t nRead = 0;
+    stats.reads++;
+    int readStatus = usbRead(&buffer[0], buffer.size(), &nRead, std::min(timeout, remaining));
+    if ((readStatus == 0) && (nRead > 0)) {
+      stats.buffers++;
+      stats.bytes += nRead;
+      if (pSink) pSink->buffer(&buffer[0], nRead);
+      timeout = firstTimeout;
+      uint16_t header = buffer[0] | (buffer[1] << 8);
+      if (stopped && (nRead >= sizeof(uint16_t)) && (header & lastBufferBit)) {
+        stats.endSeen = true;
+        status        = 0;
+        break;
+      }
+    }
+    else if ((readStatus < 0) && (errno != ETIMEDOUT) && (errno != EAGAIN)) {
+      status = -1;
+      break;
+    }
+    else {
+      stats.timeouts++;
+      timeout = std::min(timeout*2, maxTimeout);
+    }
   }
-  return result;
+  int savedErrno  = errno;
+  stats.stopped   = stopped;
+  stats.elapsedMs = duration_cast<milliseconds>(steady_clock::now() - start).count();
+  if (pStats) *pStats = stats;
+  errno = savedErrno;
+  return status;
+}
+
+/*!
+   Execute several immediate lists, returning each list's reply in its own
+   request.  The lists are executed in order; a failure in one request does
+   not stop the others.  On return, for each request:
+   - bytesRead is the number of bytes copied into pReadBuffer.
+   - status is 0 on success, -1 if the list could not be written, -2 if its
+     reply could not be read, or -3 if it was cancelled because the reply of
+     an earlier list in flight with it was lost.
+   - error is the errno of a failure, 0 on success.
+
+   This implementation just calls executeList for each request.  Interfaces
+   that can keep several lists in flight override it (see CVMUSBusb).
+
+   \param pRequests : ListRequest*
+      The lists to execute and where their replies go.
+   \param nRequests : size_t
+      Number of requests.
+   \param depth     : unsigned
+      Most lists in flight at once, clamped to 1..maxPipelineDepth.
+      Ignored here.
+
+   \return size_t
+   \retval Number of requests that failed; 0 if all went well.
+*/
+size_t
+CVMUSB::executeLists(ListRequest* pRequests, size_t nRequests, unsigned /* depth */)
+{
+  size_t failures = 0;
+  for (size_t i = 0; i < nRequests; i++) {
+    ListRequest& request(pRequests[i]);
+    request.bytesRead = 0;
+    int status = executeList(*request.pList, request.pReadBuffer,
+                             request.readBufferSize, &request.bytesRead);
+    request.status = (status < 0) ? status : 0;
+    request.error  = (status < 0) ? errno  : 0;
+    if (status < 0) failures++;
+  }
+  return failures;
+}
+
+/*!
+   Read a data buffer like usbRead, recovering from USB errors where the
+   interface can.  This implementation can't recover from anything and is
+   just usbRead; see CVMUSBusb for the real thing.
+*/
+int
+CVMUSB::recoveringRead(void* data, size_t bufferSize, size_t* transferCount, int timeout)
+{
+  return usbRead(data, bufferSize, transferCount, timeout);
+}
+
+/*!
+   Zero the counters recoveringRead keeps.
+*/
+void
+CVMUSB::clearRecoveryStatistics()
+{
+  m_recoveryStats = RecoveryStatistics();
 }
 
+/*!
+   Check that a buffer is a whole VM-USB data buffer: the event headers
+   chain from the buffer header to the end of the data, leaving nothing
+   but optional 0xffff terminator words.  Used to find the first intact
+   buffer after the data stream was disturbed.
+
+   \param pData        : const void*
+      The buffer.
+   \param nBytes       : size_t
+      Its size in bytes.
+   \param doubleHeader : bool
+      The buffer has a second header word (word count), see the
+      GlobalModeRegister::doubleHeader bit.
+
+   \return bool
+*/
+bool
+CVMUSB::validBuffer(const void* pData, size_t nBytes, bool doubleHeader)
+{
+  const uint16_t* p      = static_cast<const uint16_t*>(pData);
+  size_t          nWords = nBytes/sizeof(uint16_t);
+  size_t          pos    = doubleHeader ? 2 : 1;
+
+  if ((nBytes % sizeof(uint16_t)) || (nWords < pos)) return false;
+  if (doubleHeader && (p[1] > nWords)) return false;
+
+  unsigned nEvents = p[0] & 0xfff;
+  for (unsigned i = 0; i < nEvents; i++) {
+    if (pos >= nWords) return false;
+    pos += 1 + (p[pos] & 0xfff);
+    if (pos > nWords) return false;
+  }
+  for (; pos < nWords; pos++) {
+    if (p[pos] != 0xffff) return false;
+  }
+  return true;
+}
 
 /*! 
    Set a new transaction timeout.  The transaction timeout is used for
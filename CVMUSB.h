@@ -141,7 +141,7 @@ public:
     // equality comparison has no useful meaning either:
 
   CVMUSB() :
-    m_handle(0), m_device(0)
+    m_handle(0), m_device(0), m_recoveryStats()
   {}
   CVMUSB(struct usb_device* vmUsbDevice);
   virtual ~CVMUSB();
@@ -165,7 +165,7 @@ public:
     /**! Acquire the shadow registers  */
     const ShadowRegisters& getShadowRegisters() const;
 
-    virtual void     writeActionRegister(uint16_t value) = 0;
+    virtual void     writeActionRegister(uint16_t value, int timeout = 2000) = 0;
 
     virtual void  writeRegister(unsigned int address, uint32_t data) = 0;
     virtual uint32_t readRegister(unsigned int address) = 0;
@@ -280,29 +280,27 @@ public:
          	    void* data, size_t transferCount, size_t* countTransferred);
     std::vector<uint32_t> 
     vmeBlockRead(int base, int amod,  int xfercount) { // SWIG
-      uint32_t data[xfercount];
+      std::vector<uint32_t> result(xfercount > 0 ? xfercount : 0);
       size_t   xferred = 0;
-      std::vector<uint32_t> result;
 
-      vmeBlockRead((uint32_t)base, (uint8_t)amod, (void*)data,
-			  (size_t)xfercount, &xferred);
-        for (int i =0; i < xferred; i++) {
-      	result.push_back(data[i]);
+      if (!result.empty()) {
+        vmeBlockRead((uint32_t)base, (uint8_t)amod, result.data(),
+		     result.size(), &xferred);
       }
+      result.resize(xferred);
       return result;
 
     }
     std::vector<uint32_t>
       vmeFifoRead(int base, int amod, int xfercount) { // SWIG
-      uint32_t data[xfercount];
+      std::vector<uint32_t> result(xfercount > 0 ? xfercount : 0);
       size_t xferred = 0;
-      std::vector<uint32_t> result;
 
-      vmeFifoRead((uint32_t)base, (uint8_t)amod, data,
-		  (size_t)xfercount, &xferred);
-      for (int i = 0; i < xferred; i++) {
-      	result.push_back(data[i]);
+      if (!result.empty()) {
+        vmeFifoRead((uint32_t)base, (uint8_t)amod, result.data(),
+		    result.size(), &xferred);
       }
+      result.resize(xferred);
       return result;
     }
 
@@ -324,6 +322,9 @@ public:
     int loadList(int listNumber, CVMUSBReadoutList& list, int offset) { // SWIG
       return loadList((uint8_t)listNumber, list, (off_t)offset);
     }
+
+    virtual int readList(uint8_t listNumber, size_t longwords, off_t listOffset,
+                         std::vector<uint32_t>& list);
       
 
     // Once the interface is in DAQ auntonomous mode, the application
@@ -332,6 +333,59 @@ public:
     virtual int usbRead(void* data, size_t bufferSize, size_t* transferCount,
 		                    int timeout) = 0;
 
+    // Run control: stop data taking and read out what the VM-USB still holds.
+
+    class BufferSink {          // Receives the buffers drained at the end of a run.
+    public:
+      virtual ~BufferSink() {}
+      virtual void buffer(const void* pData, size_t nBytes) = 0;
+    };
+    struct DrainStatistics {
+      size_t   buffers;
+      size_t   bytes;
+      unsigned reads;
+      unsigned timeouts;        // Reads that came back empty.
+      unsigned elapsedMs;
+      bool     stopped;         // The action register write got through.
+      bool     endSeen;         // Got the buffer with the last buffer bit.
+    };
+
+    virtual int stopAndDrain(BufferSink* pSink, DrainStatistics* pStats = 0,
+                             int maxLatencyMs = 1000, uint16_t action = 0);
+
+    // Pipelined immediate lists: several lists in flight at once.
+
+    struct ListRequest {        // One list of an executeLists call.
+      CVMUSBReadoutList* pList;
+      void*              pReadBuffer;
+      size_t             readBufferSize;
+      size_t             bytesRead;     // Set by executeLists.
+      int                status;        // Set by executeLists, see there.
+      int                error;         // Set by executeLists, errno of a failure.
+    };
+    static const unsigned maxPipelineDepth = 8;
+
+    virtual size_t executeLists(ListRequest* pRequests, size_t nRequests,
+                                unsigned depth = 4);
+
+    // Readout reads that ride out USB errors during a run.
+
+    struct RecoveryStatistics {
+      size_t errors;            // Failed reads that started a recovery.
+      size_t haltsCleared;      // Tier 1: endpoint halt cleared, read retried.
+      size_t resyncs;           // Tier 2: stream picked up again at a valid buffer.
+      size_t buffersSkipped;    // Reads thrown away while resynchronizing.
+      size_t bytesSkipped;
+      size_t reopens;           // Tier 3: interface closed and opened again.
+      size_t unrecovered;       // Every tier failed.
+    };
+
+    virtual int recoveringRead(void* data, size_t bufferSize, size_t* transferCount,
+                               int timeout = 2000);
+    const RecoveryStatistics& recoveryStatistics() const { return m_recoveryStats; }
+    void clearRecoveryStatistics();
+    static bool validBuffer(const void* pData, size_t nBytes, bool doubleHeader = false);
+
     // Other administrative functions:
 
     void setDefaultTimeout(int ms); // Can alter internally used timeouts.
@@ -620,6 +674,8 @@ protected:
     uint16_t* listToOutPacket(uint16_t ta, CVMUSBReadoutList& list, size_t* outSize,
 			      off_t offset = 0);
 
+    RecoveryStatistics m_recoveryStats;   // Updated by recoveringRead.
+
 private:
 
 
@@ -25,11 +25,245 @@
   #include <CVMUSB.h> 
   #include <CVMUSBusb.h> 
   #include <CMockVMUSB.h> 
+  #include <limits.h>
 
   class CTCLApplication;
   CTCLApplication *gpTCLApplication = 0;
 %}
 
+%{
+  /*
+     Bulk data entry points that move data as Tcl ByteArrays instead of
+     lists of integers.  Reads are done straight into the storage of the
+     result object, block writes are done from the storage of the
+     argument.  Use [binary scan] to take the result apart.
+
+       CVMUSB_executeListBytes  vmusb list maxBytes        -> ByteArray
+       CVMUSB_vmeBlockReadBytes vmusb base amod transfers  -> ByteArray
+       CVMUSB_vmeFifoReadBytes  vmusb base amod transfers  -> ByteArray
+       CVMUSB_vmeBlockWriteBytes vmusb base amod bytes     -> status
+       CVMUSB_executeScript     vmusb script maxBytes      -> ByteArray
+
+     A script is a Tcl list of operations that are all put in one list
+     and executed in a single transaction:
+
+       {write32|write16|write8 address amod data}
+       {read32|read16|read8 address amod}
+       {blockread32|fiforead32 address amod transfers}
+       {blockwrite32 address amod bytes}
+       {readreg register} {writereg register data}
+       {delay clocks} {marker value}
+  */
+
+  static int
+  cvmusbBytesError(Tcl_Interp* interp, const char* cmd, const char* what)
+  {
+    Tcl_AppendResult(interp, cmd, ": ", what, (char*)NULL);
+    return TCL_ERROR;
+  }
+
+  static int
+  cvmusbGetU32(Tcl_Interp* interp, Tcl_Obj* obj, uint32_t* value)
+  {
+    Tcl_WideInt wide;
+    if (Tcl_GetWideIntFromObj(interp, obj, &wide) != TCL_OK) return TCL_ERROR;
+    *value = static_cast<uint32_t>(wide);
+    return TCL_OK;
+  }
+
+  static CVMUSB*
+  cvmusbGetController(Tcl_Interp* interp, Tcl_Obj* obj)
+  {
+    void* p = 0;
+    if (!SWIG_IsOK(SWIG_ConvertPtr(obj, &p, SWIGTYPE_p_CVMUSB, 0))) return 0;
+    return reinterpret_cast<CVMUSB*>(p);
+  }
+
+  // Run a list with its reply going straight into a new ByteArray.
+
+  static int
+  cvmusbExecuteToBytes(Tcl_Interp* interp, const char* cmd, CVMUSB* pVmusb,
+                       CVMUSBReadoutList& list, int maxBytes)
+  {
+    if (maxBytes < 0) return cvmusbBytesError(interp, cmd, "negative byte count");
+    Tcl_Obj*       pResult = Tcl_NewByteArrayObj(NULL, 0);
+    unsigned char* pData   = Tcl_SetByteArrayLength(pResult, maxBytes);
+    size_t         nRead   = 0;
+    Tcl_IncrRefCount(pResult);
+    int status = pVmusb->executeList(list, pData, maxBytes, &nRead);
+    if (status < 0) {
+      Tcl_DecrRefCount(pResult);
+      return cvmusbBytesError(interp, cmd, Tcl_ErrnoMsg(errno));
+    }
+    Tcl_SetByteArrayLength(pResult, nRead);
+    Tcl_SetObjResult(interp, pResult);
+    Tcl_DecrRefCount(pResult);
+    return TCL_OK;
+  }
+
+  int
+  CVMUSB_executeListBytes(ClientData clientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[])
+  {
+    const char* cmd = "CVMUSB_executeListBytes";
+    if (objc != 4) {
+      Tcl_WrongNumArgs(interp, 1, objv, "vmusb list maxBytes");
+      return TCL_ERROR;
+    }
+    CVMUSB* pVmusb = cvmusbGetController(interp, objv[1]);
+    void*   pList  = 0;
+    int     maxBytes;
+    if (!pVmusb) return cvmusbBytesError(interp, cmd, "not a CVMUSB");
+    if (!SWIG_IsOK(SWIG_ConvertPtr(objv[2], &pList, SWIGTYPE_p_CVMUSBReadoutList, 0)) || !pList) {
+      return cvmusbBytesError(interp, cmd, "not a CVMUSBReadoutList");
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &maxBytes) != TCL_OK) return TCL_ERROR;
+    return cvmusbExecuteToBytes(interp, cmd, pVmusb,
+                                *reinterpret_cast<CVMUSBReadoutList*>(pList), maxBytes);
+  }
+
+  static int
+  cvmusbBlockReadBytes(Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[],
+                       const char* cmd, bool fifo)
+  {
+    if (objc != 5) {
+      Tcl_WrongNumArgs(interp, 1, objv, "vmusb base amod transfers");
+      return TCL_ERROR;
+    }
+    CVMUSB*  pVmusb = cvmusbGetController(interp, objv[1]);
+    uint32_t base;
+    int      amod, transfers;
+    if (!pVmusb) return cvmusbBytesError(interp, cmd, "not a CVMUSB");
+    if ((cvmusbGetU32(interp, objv[2], &base) != TCL_OK)      ||
+        (Tcl_GetIntFromObj(interp, objv[3], &amod) != TCL_OK) ||
+        (Tcl_GetIntFromObj(interp, objv[4], &transfers) != TCL_OK)) return TCL_ERROR;
+    if (transfers < 0) return cvmusbBytesError(interp, cmd, "negative transfer count");
+    if (transfers > INT_MAX/static_cast<int>(sizeof(uint32_t))) {
+      return cvmusbBytesError(interp, cmd, "transfer count too large");
+    }
+
+    CVMUSBReadoutList list;
+    if (fifo) {
+      list.addFifoRead32(base, amod, transfers);
+    } else {
+      list.addBlockRead32(base, amod, transfers);
+    }
+    return cvmusbExecuteToBytes(interp, cmd, pVmusb, list, transfers*sizeof(uint32_t));
+  }
+
+  int
+  CVMUSB_vmeBlockReadBytes(ClientData clientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[])
+  {
+    return cvmusbBlockReadBytes(interp, objc, objv, "CVMUSB_vmeBlockReadBytes", false);
+  }
+
+  int
+  CVMUSB_vmeFifoReadBytes(ClientData clientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[])
+  {
+    return cvmusbBlockReadBytes(interp, objc, objv, "CVMUSB_vmeFifoReadBytes", true);
+  }
+
+  int
+  CVMUSB_vmeBlockWriteBytes(ClientData clientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[])
+  {
+    const char* cmd = "CVMUSB_vmeBlockWriteBytes";
+    if (objc != 5) {
+      Tcl_WrongNumArgs(interp, 1, objv, "vmusb base amod bytes");
+      return TCL_ERROR;
+    }
+    CVMUSB*  pVmusb = cvmusbGetController(interp, objv[1]);
+    uint32_t base;
+    int      amod, nBytes;
+    if (!pVmusb) return cvmusbBytesError(interp, cmd, "not a CVMUSB");
+    if ((cvmusbGetU32(interp, objv[2], &base) != TCL_OK) ||
+        (Tcl_GetIntFromObj(interp, objv[3], &amod) != TCL_OK)) return TCL_ERROR;
+    unsigned char* pData = Tcl_GetByteArrayFromObj(objv[4], &nBytes);
+    if (nBytes % sizeof(uint32_t)) return cvmusbBytesError(interp, cmd, "not a whole number of longwords");
+
+    CVMUSBReadoutList list;
+    list.addBlockWrite32(base, amod, pData, nBytes/sizeof(uint32_t));
+    uint32_t reply;
+    size_t   nRead;
+    int status = pVmusb->executeList(list, &reply, sizeof(reply), &nRead);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(status < 0 ? status : 0));
+    return TCL_OK;
+  }
+
+  // Add one script operation to a list.
+
+  static int
+  cvmusbScriptOp(Tcl_Interp* interp, Tcl_Obj* pOp, CVMUSBReadoutList& list)
+  {
+    int       n;
+    Tcl_Obj** w;
+    if (Tcl_ListObjGetElements(interp, pOp, &n, &w) != TCL_OK) return TCL_ERROR;
+    if (n == 0) return TCL_OK;
+
+    std::string op(Tcl_GetString(w[0]));
+    uint32_t    a[3] = {0, 0, 0};
+    int         nNumeric = (op == "blockwrite32") ? 2 : n - 1;
+    if (nNumeric > 3) nNumeric = 3;
+    for (int i = 0; i < nNumeric; i++) {
+      if (cvmusbGetU32(interp, w[i+1], &a[i]) != TCL_OK) return TCL_ERROR;
+    }
+
+    if      ((op == "write32") && (n == 4)) list.addWrite32(a[0], a[1], a[2]);
+    else if ((op == "write16") && (n == 4)) list.addWrite16(a[0], a[1], a[2]);
+    else if ((op == "write8")  && (n == 4)) list.addWrite8(a[0], a[1], a[2]);
+    else if ((op == "read32")  && (n == 3)) list.addRead32(a[0], a[1]);
+    else if ((op == "read16")  && (n == 3)) list.addRead16(a[0], a[1]);
+    else if ((op == "read8")   && (n == 3)) list.addRead8(a[0], a[1]);
+    else if ((op == "blockread32") && (n == 4)) list.addBlockRead32(a[0], a[1], a[2]);
+    else if ((op == "fiforead32")  && (n == 4)) list.addFifoRead32(a[0], a[1], a[2]);
+    else if ((op == "blockwrite32") && (n == 4)) {
+      int            nBytes;
+      unsigned char* pData = Tcl_GetByteArrayFromObj(w[3], &nBytes);
+      if (nBytes % sizeof(uint32_t)) {
+        Tcl_AppendResult(interp, "CVMUSB_executeScript: not a whole number of longwords: ",
+                         Tcl_GetString(pOp), (char*)NULL);
+        return TCL_ERROR;
+      }
+      list.addBlockWrite32(a[0], a[1], pData, nBytes/sizeof(uint32_t));
+    }
+    else if ((op == "readreg")  && (n == 2)) list.addRegisterRead(a[0]);
+    else if ((op == "writereg") && (n == 3)) list.addRegisterWrite(a[0], a[1]);
+    else if ((op == "delay")    && (n == 2)) list.addDelay(a[0]);
+    else if ((op == "marker")   && (n == 2)) list.addMarker(a[0]);
+    else {
+      Tcl_AppendResult(interp, "CVMUSB_executeScript: bad operation: ", Tcl_GetString(pOp), (char*)NULL);
+      return TCL_ERROR;
+    }
+    return TCL_OK;
+  }
+
+  int
+  CVMUSB_executeScript(ClientData clientData, Tcl_Interp* interp, int objc, Tcl_Obj* CONST objv[])
+  {
+    const char* cmd = "CVMUSB_executeScript";
+    if (objc != 4) {
+      Tcl_WrongNumArgs(interp, 1, objv, "vmusb script maxBytes");
+      return TCL_ERROR;
+    }
+    CVMUSB*   pVmusb = cvmusbGetController(interp, objv[1]);
+    int       nOps, maxBytes;
+    Tcl_Obj** ops;
+    if (!pVmusb) return cvmusbBytesError(interp, cmd, "not a CVMUSB");
+    if ((Tcl_ListObjGetElements(interp, objv[2], &nOps, &ops) != TCL_OK) ||
+        (Tcl_GetIntFromObj(interp, objv[3], &maxBytes) != TCL_OK)) return TCL_ERROR;
+
+    CVMUSBReadoutList list;
+    for (int i = 0; i < nOps; i++) {
+      if (cvmusbScriptOp(interp, ops[i], list) != TCL_OK) return TCL_ERROR;
+    }
+    return cvmusbExecuteToBytes(interp, cmd, pVmusb, list, maxBytes);
+  }
+%}
+
+%native(CVMUSB_executeListBytes) int CVMUSB_executeListBytes(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[]);
+%native(CVMUSB_vmeBlockReadBytes) int CVMUSB_vmeBlockReadBytes(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[]);
+%native(CVMUSB_vmeFifoReadBytes) int CVMUSB_vmeFifoReadBytes(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[]);
+%native(CVMUSB_vmeBlockWriteBytes) int CVMUSB_vmeBlockWriteBytes(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[]);
+%native(CVMUSB_executeScript) int CVMUSB_executeScript(ClientData, Tcl_Interp*, int, Tcl_Obj* CONST[]);
+
 %include "CVMUSB.h"
 %include "CVMUSBusb.h"
 %include "CMockVMUSB.h"
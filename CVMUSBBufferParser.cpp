@@ -0,0 +1,305 @@
+/*
+ * Implementation of the CVMUSBBufferParser class.
+ * Like the rest of this library this assumes a little endian host, the VM-USB
+ * byte order, so the buffer is walked in place without copying.
+ */
+
+#include "CVMUSBBufferParser.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*!
+   Construct a parser with no handlers; events of stacks without a
+   handler are counted and dropped.
+*/
+CVMUSBBufferParser::CVMUSBBufferParser() :
+  m_handledStacks(0),
+  m_markedStacks(0),
+  m_doubleHeader(false),
+  m_lastBufferSeen(false),
+  m_partialStack(0)
+{
+  for (unsigned i = 0; i < maxStacks; i++) {
+    m_handlers[i] = 0;
+    m_markers[i]  = 0;
+  }
+  clearStatistics();
+}
+
+/*!
+   Route the events of a stack to a handler.  Pass a null handler to
+   stop routing.  The parser does not own the handler.
+*/
+void
+CVMUSBBufferParser::setHandler(uint8_t stackId, Handler* pHandler)
+{
+  if (stackId < maxStacks) {
+    m_handlers[stackId] = pHandler;
+    if (pHandler) m_handledStacks |=  (1 << stackId);
+    else          m_handledStacks &= ~(1 << stackId);
+  }
+}
+
+/*!
+   Tell the parser that every event of a stack starts with a marker word
+   (CVMUSBReadoutList::addMarker as the first stack entry, as the vme
+   readout stacks do).  An event of that stack that doesn't is a framing
+   error, and the marker makes finding the next event after one fast and
+   reliable.
+*/
+void
+CVMUSBBufferParser::setMarker(uint8_t stackId, uint16_t marker)
+{
+  if (stackId < maxStacks) {
+    m_markers[stackId] = marker;
+    m_markedStacks    |= (1 << stackId);
+  }
+}
+
+void
+CVMUSBBufferParser::clearMarker(uint8_t stackId)
+{
+  if (stackId < maxStacks) m_markedStacks &= ~(1 << stackId);
+}
+
+/*!
+   Parse one buffer as returned by CVMUSB::usbRead.  Framing errors are
+   counted and skipped over, see the file header; the events on either
+   side of one are still dispatched.
+
+   \param pBuffer : const void*
+      The buffer.
+   \param nBytes  : size_t
+      Bytes in the buffer.
+
+   \return int
+   \retval >= 0 - Number of complete events dispatched.
+   \retval -1   - The buffer is too short for its header.
+*/
+int
+CVMUSBBufferParser::parse(const void* pBuffer, size_t nBytes)
+{
+  const uint16_t* p      = static_cast<const uint16_t*>(pBuffer);
+  size_t          n      = nBytes / sizeof(uint16_t);
+  size_t          i      = m_doubleHeader ? 2 : 1;
+  int             done   = 0;
+  bool            framed = true;       // Still counting events by the header.
+  bool            bad    = false;
+
+  if (n < i) {
+    m_stats.badBuffers++;
+    return -1;
+  }
+  uint16_t header = p[0];
+  m_stats.buffers++;
+  m_stats.bytes += nBytes;
+  if (header & scalerBuffer) m_stats.scalerBuffers++;
+  if (header & lastBuffer)   m_lastBufferSeen = true;
+
+  // If the event headers don't chain from here to the end of the data
+  // something in between is damaged, so check each event harder.
+
+  unsigned nEvents = header & eventCountMask;
+  bool     strict  = !chained(p, i, n, nEvents);
+  for (unsigned e = 0; !framed || (e < nEvents); e++) {
+    if (i >= n || p[i] == terminator) break;       // Padded or short buffer.
+    uint16_t eventHeader = p[i];
+    uint8_t  stackId     = (eventHeader & stackIdMask) >> stackIdShift;
+    size_t   length      = eventHeader & eventLengthMask;
+    bool     starting    = m_partial.empty() || (stackId != m_partialStack);
+    bool     consistent  = (i + 1 + length <= n);
+    if (consistent && starting) {
+      consistent = fits(p, i, n) && (!strict || expected(p, i, n));
+    }
+    if (!consistent) {
+      size_t next = resync(p, i + 1, n);
+      m_stats.framingErrors++;
+      m_stats.skippedBytes += (next - i)*sizeof(uint16_t);
+      if (next < n) m_stats.resyncs++;
+      m_partial.clear();
+      bad    = true;
+      framed = false;                              // The event count no longer helps.
+      i      = next;
+      continue;
+    }
+    i++;
+
+    if ((eventHeader & continuation) || !m_partial.empty()) {
+      if (!m_partial.empty() && (stackId != m_partialStack)) {
+	m_partial.clear();                           // Lost the rest of the old one.
+      }
+      m_partialStack = stackId;
+      m_partial.insert(m_partial.end(), p + i, p + i + length);
+      if (!(eventHeader & continuation)) {
+	dispatch(stackId, &m_partial[0], m_partial.size());
+	m_partial.clear();
+	done++;
+      }
+    }
+    else {
+      dispatch(stackId, p + i, length);
+      done++;
+    }
+    i += length;
+  }
+  if (bad) m_stats.badBuffers++;
+  return done;
+}
+
+/*!
+   Forget any partially assembled event and the last buffer flag, e.g.
+   before starting a new run.
+*/
+void
+CVMUSBBufferParser::reset()
+{
+  m_partial.clear();
+  m_lastBufferSeen = false;
+}
+
+void
+CVMUSBBufferParser::clearStatistics()
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Utilities:
+
+void
+CVMUSBBufferParser::dispatch(uint8_t stackId, const uint16_t* pBody, size_t nWords)
+{
+  m_stats.events++;
+  m_stats.stackEvents[stackId]++;
+  if (m_handlers[stackId]) {
+    m_handlers[stackId]->event(stackId, pBody, nWords);
+  }
+  else {
+    m_stats.unhandledEvents++;
+  }
+}
+
+/*
+ * Is p[i] an event header whose length fits in the data and which, if its
+ * stack has a marker, is followed by it?
+ */
+bool
+CVMUSBBufferParser::fits(const uint16_t* p, size_t i, size_t n) const
+{
+  uint16_t header  = p[i];
+  uint8_t  stackId = (header & stackIdMask) >> stackIdShift;
+  size_t   length  = header & eventLengthMask;
+
+  if ((header == terminator) || (i + 1 + length > n)) return false;
+  if (m_markedStacks & (1 << stackId)) {
+    return (length > 0) && (p[i + 1] == m_markers[stackId]);
+  }
+  return true;
+}
+
+/*
+ * Do exactly nEvents event headers starting at p[i] chain to the end of
+ * the data, leaving nothing but terminators?
+ */
+bool
+CVMUSBBufferParser::chained(const uint16_t* p, size_t i, size_t n, unsigned nEvents)
+{
+  for (unsigned e = 0; e < nEvents; e++) {
+    if ((i >= n) || (p[i] == terminator)) return false;
+    i += 1 + (p[i] & eventLengthMask);
+  }
+  if (i > n) return false;
+  for (; i < n; i++) {
+    if (p[i] != terminator) return false;
+  }
+  return true;
+}
+
+/*
+ * Is the stack of the event at p[i] one with a handler (any stack if none
+ * has one), and is what follows it the end of the data or the header of
+ * such a stack with a length that fits?  The header that follows is not
+ * held to its marker, a damaged marker there is that event's problem, but
+ * it may run past the end if its marker is there: the data was cut short
+ * in the next event, not in this one.
+ */
+bool
+CVMUSBBufferParser::expected(const uint16_t* p, size_t i, size_t n) const
+{
+  uint8_t stackId = (p[i] & stackIdMask) >> stackIdShift;
+  size_t  next    = i + 1 + (p[i] & eventLengthMask);
+
+  if (m_handledStacks && !(m_handledStacks & (1 << stackId))) return false;
+  if ((next == n) || (p[next] == terminator)) return true;
+
+  stackId = (p[next] & stackIdMask) >> stackIdShift;
+  if (m_handledStacks && !(m_handledStacks & (1 << stackId))) return false;
+  if (next + 1 + (p[next] & eventLengthMask) <= n) return true;
+  return (m_markedStacks & (1 << stackId)) &&     // Truncated in the next event.
+         (next + 1 < n) && (p[next + 1] == m_markers[stackId]);
+}
+
+/*
+ * Could an event start at p[i]?  Used when looking for one, so unlike in
+ * parse the header that follows must fit completely, marker included.
+ */
+bool
+CVMUSBBufferParser::plausible(const uint16_t* p, size_t i, size_t n) const
+{
+  size_t next = i + 1 + (p[i] & eventLengthMask);
+  return fits(p, i, n) && expected(p, i, n) &&
+         ((next == n) || (p[next] == terminator) || fits(p, next, n));
+}
+
+/*
+ * Find the first plausible event header at or after from, n if there is
+ * none.  When every handled stack has the same marker only the words in
+ * front of a marker can be headers, so the scan jumps from marker to
+ * marker with findWord; otherwise each word is tried.
+ */
+size_t
+CVMUSBBufferParser::resync(const uint16_t* p, size_t from, size_t n) const
+{
+  bool     markersOnly = m_handledStacks && ((m_handledStacks & ~m_markedStacks) == 0);
+  int      marker      = -1;
+  for (unsigned s = 0; markersOnly && (s < maxStacks); s++) {
+    if (!(m_handledStacks & (1 << s))) continue;
+    if ((marker >= 0) && (m_markers[s] != marker)) markersOnly = false;
+    marker = m_markers[s];
+  }
+
+  if (markersOnly) {
+    for (size_t k = findWord(p, from + 1, n, marker); k < n; k = findWord(p, k + 1, n, marker)) {
+      if (plausible(p, k - 1, n)) return k - 1;
+    }
+    return n;
+  }
+  for (size_t j = from; j < n; j++) {
+    if (plausible(p, j, n)) return j;
+  }
+  return n;
+}
+
+/*
+ * Index of the first value in p[from..n), n if there is none.  SSE2
+ * compares eight words at a time where it is available.
+ */
+size_t
+CVMUSBBufferParser::findWord(const uint16_t* p, size_t from, size_t n, uint16_t value)
+{
+  size_t i = from;
+#ifdef __SSE2__
+  __m128i wanted = _mm_set1_epi16(static_cast<short>(value));
+  for (; i + 8 <= n; i += 8) {
+    __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    int     hits  = _mm_movemask_epi8(_mm_cmpeq_epi16(words, wanted));
+    if (hits) return i + (__builtin_ctz(hits) >> 1);
+  }
+#endif
+  for (; i < n; i++) {
+    if (p[i] == value) return i;
+  }
+  return n;
+}
@@ -0,0 +1,112 @@
+/*
+ * This file defines the CVMUSBBufferParser class which splits the buffers the VM-USB sends in
+ * autonomous DAQ mode into stack events and hands each one to the handler registered for the
+ * stack that produced it. Data is little endian 16 bit words:
+ *
+ *   buffer header : l s c m nnnnnnnnnnnn   l = last buffer, s = scaler buffer, c = continuous mode,
+ *                                          m = multi buffer, n = number of events in the buffer
+ *   (second header: number of 16 bit words in the buffer, only with the doubleHeader global mode bit)
+ *   event header  : iii p llllllllllll     i = stack id, p = continued in the next segment,
+ *                                          l = 16 bit words that follow
+ *
+ * Events that span buffers (spanBuffers global mode bit) arrive as segments with the p bit set,
+ * the parser glues them together before calling the handler. The parser is a CVMUSB::BufferSink
+ * so the buffers drained by CVMUSB::stopAndDrain at the end of a run can go straight into it.
+ *
+ * A truncated or corrupted buffer does not end the parse. An event header whose length runs past
+ * the buffer, or, for a stack with a marker (setMarker), whose body does not start with the marker,
+ * is a framing error. So is, in a buffer whose event headers don't chain to its end, an event of a
+ * stack without a handler or one not followed by a header that fits. After a framing error
+ * the parser scans forward for the next plausible event header - expected stack id, length that
+ * fits, followed by the marker and by another plausible header or the end of the data - and resumes
+ * there. With markers on every handled stack the scan is a vectorized search for the marker word.
+ */
+
+#ifndef CVMUSBBufferParser_H
+#define CVMUSBBufferParser_H
+
+#include "CVMUSB.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class CVMUSBBufferParser : public CVMUSB::BufferSink
+{
+public:
+  static const uint16_t lastBuffer      = 0x8000;
+  static const uint16_t scalerBuffer    = 0x4000;
+  static const uint16_t continuousMode  = 0x2000;
+  static const uint16_t multiBuffer     = 0x1000;
+  static const uint16_t eventCountMask  = 0x0fff;
+
+  static const uint16_t stackIdMask     = 0xe000;
+  static const uint16_t stackIdShift    = 13;
+  static const uint16_t continuation    = 0x1000;
+  static const uint16_t eventLengthMask = 0x0fff;
+
+  static const uint16_t terminator      = 0xffff;   // Optional end of buffer words.
+  static const unsigned maxStacks       = 8;
+
+  /*!
+     Receives the events of one (or more) stacks.  pBody points past the
+     event header, nWords counts 16 bit words.  The data is only valid for
+     the duration of the call.
+  */
+  class Handler {
+  public:
+    virtual ~Handler() {}
+    virtual void event(uint8_t stackId, const uint16_t* pBody, size_t nWords) = 0;
+  };
+
+  struct Statistics {
+    size_t buffers;
+    size_t bytes;
+    size_t scalerBuffers;
+    size_t events;
+    size_t stackEvents[maxStacks];  // Events per stack id, e.g. per module with IRQ stacks.
+    size_t unhandledEvents;      // No handler registered for the stack.
+    size_t badBuffers;           // Buffers with framing errors.
+    size_t framingErrors;        // Inconsistent event headers met.
+    size_t resyncs;              // Times a plausible header was found after one.
+    size_t skippedBytes;         // Bytes passed over looking for it.
+  };
+
+private:
+  Handler*              m_handlers[maxStacks];
+  uint8_t               m_handledStacks;    // Bit per stack with a handler.
+  uint16_t              m_markers[maxStacks];
+  uint8_t               m_markedStacks;     // Bit per stack with a marker.
+  bool                  m_doubleHeader;
+  bool                  m_lastBufferSeen;
+  std::vector<uint16_t> m_partial;          // Segments of a spanning event so far.
+  uint8_t               m_partialStack;
+  Statistics            m_stats;
+
+public:
+  CVMUSBBufferParser();
+
+  void setHandler(uint8_t stackId, Handler* pHandler);
+  void setMarker(uint8_t stackId, uint16_t marker);
+  void clearMarker(uint8_t stackId);
+  void setDoubleHeader(bool enable) { m_doubleHeader = enable; }
+
+  int  parse(const void* pBuffer, size_t nBytes);
+  virtual void buffer(const void* pData, size_t nBytes) { parse(pData, nBytes); }
+  void reset();
+
+  bool              lastBufferSeen() const { return m_lastBufferSeen; }
+  const Statistics& statistics() const     { return m_stats; }
+  void              clearStatistics();
+
+  // Utilities:
+private:
+  void dispatch(uint8_t stackId, const uint16_t* pBody, size_t nWords);
+  static bool chained(const uint16_t* p, size_t i, size_t n, unsigned nEvents);
+  bool   fits(const uint16_t* p, size_t i, size_t n) const;
+  bool   expected(const uint16_t* p, size_t i, size_t n) const;
+  bool   plausible(const uint16_t* p, size_t i, size_t n) const;
+  size_t resync(const uint16_t* p, size_t from, size_t n) const;
+  static size_t findWord(const uint16_t* p, size_t from, size_t n, uint16_t value);
+};
+
+#endif
@@ -0,0 +1,379 @@
+/*
+ * Implementation of the CVMUSBEventPort class.
+ */
+
+#include "CVMUSBEventPort.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <stdexcept>
+#include <chrono>
+
+static const size_t maxBatch(32);      // Most lists per executeLists call.
+
+/*!
+   \param vmusb          : CVMUSB&
+      The controller.  Once the port exists all USB traffic should go
+      through it; the controller's own mutex keeps direct calls safe but
+      they stall behind whatever the I/O thread is doing.
+   \param maxOutstanding : size_t
+      Most lists submitted and not collected.
+   \param depth          : unsigned
+      Lists in flight at once, see CVMUSB::executeLists.
+   \param maxBuffers     : size_t
+      Most readout buffers waiting for nextBuffer.
+
+   \throw std::runtime_error if the eventfds can't be made.
+*/
+CVMUSBEventPort::CVMUSBEventPort(CVMUSB& vmusb, size_t maxOutstanding, unsigned depth,
+                                 size_t maxBuffers) :
+  m_vmusb(vmusb),
+  m_maxOutstanding(maxOutstanding),
+  m_depth(depth),
+  m_maxBuffers(maxBuffers),
+  m_listFd(-1),
+  m_dataFd(-1),
+  m_outstanding(0),
+  m_nextTicket(1),
+  m_readout(false),
+  m_bufferBytes(0),
+  m_readTimeout(0),
+  m_exit(false)
+{
+  m_stats = Statistics{0, 0, 0, 0, 0, 0};
+  m_listFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  m_dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((m_listFd < 0) || (m_dataFd < 0)) {
+    std::string msg("CVMUSBEventPort - can't make the eventfds: ");
+    msg += strerror(errno);
+    if (m_listFd >= 0) close(m_listFd);
+    if (m_dataFd >= 0) close(m_dataFd);
+    throw std::runtime_error(msg);
+  }
+  m_thread = std::thread(&CVMUSBEventPort::run, this);
+}
+
+/*!
+   Stops the I/O thread once its current transfer is done.  Lists not yet
+   executed and results not collected are dropped.
+*/
+CVMUSBEventPort::~CVMUSBEventPort()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_exit = true;
+  }
+  m_wake.notify_all();
+  m_thread.join();
+  close(m_listFd);
+  close(m_dataFd);
+}
+
+/*!
+   Queue an immediate list for execution.  Never blocks.
+
+   \param list     : const CVMUSBReadoutList&
+      The list, copied.
+   \param maxBytes : size_t
+      Largest reply wanted.
+
+   \return Ticket
+   \retval 0     - errno is EAGAIN if too many lists are outstanding
+                   (collect some results and try again) or EBUSY if
+                   readout is on.
+   \retval other - Ticket to find the list's Result by.
+*/
+CVMUSBEventPort::Ticket
+CVMUSBEventPort::submit(const CVMUSBReadoutList& list, size_t maxBytes)
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (m_readout) {
+    errno = EBUSY;
+    return 0;
+  }
+  if (m_outstanding >= m_maxOutstanding) {
+    errno = EAGAIN;
+    return 0;
+  }
+  Pending pending = {m_nextTicket++, list, maxBytes, false, 0};
+  m_pending.push_back(pending);
+  m_outstanding++;
+  m_stats.listsSubmitted++;
+  m_wake.notify_one();
+  return pending.ticket;
+}
+
+/*!
+   Queue an action register write, e.g. to start or stop data taking.
+   Allowed while readout is on.  Never blocks.
+
+   \param value : uint16_t
+      The action register value.
+
+   \return Ticket - as for submit, never fails with EBUSY.
+*/
+CVMUSBEventPort::Ticket
+CVMUSBEventPort::submitAction(uint16_t value)
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (m_outstanding >= m_maxOutstanding) {
+    errno = EAGAIN;
+    return 0;
+  }
+  Pending pending = {m_nextTicket++, CVMUSBReadoutList(), 0, true, value};
+  m_pending.push_back(pending);
+  m_outstanding++;
+  m_stats.listsSubmitted++;
+  m_wake.notify_one();
+  return pending.ticket;
+}
+
+/*!
+   Take the oldest result, if there is one.  Results come out in
+   submission order.  Never blocks.
+
+   \return bool - false if there was nothing to collect.
+*/
+bool
+CVMUSBEventPort::collect(Result& result)
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (m_results.empty()) return false;
+
+  result = std::move(m_results.front());
+  m_results.pop_front();
+  m_outstanding--;
+  if (m_results.empty()) clear(m_listFd);
+  return true;
+}
+
+/*!
+   Start reading data buffers.  This only starts the reads; turning data
+   taking on is up to the caller (submitAction).  From here to
+   stopReadout lists can't be submitted; lists submitted before are
+   still executed, ahead of the reads.
+
+   \param bufferBytes : size_t
+      Size of each read, at least the biggest buffer the VM-USB may send.
+   \param timeoutMs   : int
+      Timeout of each read.  This is also the longest a submitted list
+      waits behind a read that gets no data.
+*/
+void
+CVMUSBEventPort::startReadout(size_t bufferBytes, int timeoutMs)
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  m_bufferBytes = bufferBytes;
+  m_readTimeout = timeoutMs;
+  m_readout     = true;
+  m_wake.notify_one();
+}
+
+/*!
+   Stop reading data buffers.  Buffers already read can still be taken.
+   A read in progress completes (within its timeout) after this returns.
+   Stop data taking and take the last buffer first, or the next list's
+   reply may be a data buffer.
+*/
+void
+CVMUSBEventPort::stopReadout()
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  m_readout = false;
+}
+
+/*!
+   Take the oldest readout buffer, if there is one.  Never blocks.
+
+   \return bool - false if there was no buffer.
+*/
+bool
+CVMUSBEventPort::nextBuffer(std::vector<uint8_t>& buffer)
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (m_buffers.empty()) return false;
+
+  bool wasFull = m_buffers.size() >= m_maxBuffers;
+  buffer.swap(m_buffers.front());
+  m_buffers.pop_front();
+  if (m_buffers.empty()) clear(m_dataFd);
+  if (wasFull) m_wake.notify_one();
+  return true;
+}
+
+/*!
+   \return Statistics - a snapshot of the counters.
+*/
+CVMUSBEventPort::Statistics
+CVMUSBEventPort::statistics()
+{
+  std::lock_guard<std::mutex> guard(m_lock);
+  return m_stats;
+}
+
+/*
+ * The I/O thread.  Lists go before buffers so control stays responsive
+ * during a run.
+ */
+void
+CVMUSBEventPort::run()
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+  while (!m_exit) {
+    if (!m_pending.empty()) {
+      if (m_pending.front().action) {
+	executeAction(lock);
+      }
+      else {
+	executeBatch(lock);
+      }
+    }
+    else if (m_readout && (m_buffers.size() < m_maxBuffers)) {
+      readBuffer(lock);
+    }
+    else {
+      m_wake.wait(lock);
+    }
+  }
+}
+
+/*
+ * Execute up to maxBatch pending lists, up to the next action register
+ * write, in one pipelined executeLists.  Called and returns with the lock
+ * held, drops it during the USB traffic.
+ */
+void
+CVMUSBEventPort::executeBatch(std::unique_lock<std::mutex>& lock)
+{
+  std::vector<Pending> batch;
+  while (!m_pending.empty() && !m_pending.front().action && (batch.size() < maxBatch)) {
+    batch.push_back(m_pending.front());
+    m_pending.pop_front();
+  }
+  lock.unlock();
+
+  std::vector<CVMUSB::ListRequest> requests(batch.size());
+  std::vector<Result>              results(batch.size());
+  for (size_t i = 0; i < batch.size(); i++) {
+    results[i].ticket = batch[i].ticket;
+    results[i].data.resize(batch[i].maxBytes);
+    requests[i].pList          = &batch[i].list;
+    requests[i].pReadBuffer    = results[i].data.data();
+    requests[i].readBufferSize = batch[i].maxBytes;
+  }
+  size_t failed;
+  try {
+    failed = m_vmusb.executeLists(requests.data(), requests.size(), m_depth);
+  }
+  catch (...) {                             // Don't let it take the thread down.
+    for (size_t i = 0; i < requests.size(); i++) {
+      requests[i].bytesRead = 0;
+      requests[i].status    = -1;
+      requests[i].error     = EIO;
+    }
+    failed = requests.size();
+  }
+  for (size_t i = 0; i < batch.size(); i++) {
+    results[i].status = requests[i].status;
+    results[i].error  = requests[i].error;
+    results[i].data.resize(requests[i].bytesRead);
+  }
+
+  lock.lock();
+  m_stats.batches++;
+  complete(results, failed);
+}
+
+/*
+ * Write the action register for the first pending request.  Called and
+ * returns with the lock held, drops it during the USB traffic.
+ */
+void
+CVMUSBEventPort::executeAction(std::unique_lock<std::mutex>& lock)
+{
+  Pending pending = m_pending.front();
+  m_pending.pop_front();
+  lock.unlock();
+
+  std::vector<Result> results(1);
+  results[0].ticket = pending.ticket;
+  results[0].status = 0;
+  results[0].error  = 0;
+  try {
+    m_vmusb.writeActionRegister(pending.actionValue);
+  }
+  catch (...) {
+    results[0].status = -1;
+    results[0].error  = EIO;
+  }
+
+  lock.lock();
+  complete(results, results[0].status ? 1 : 0);
+}
+
+/*
+ * Hand results to collect().  Called with the lock held.
+ */
+void
+CVMUSBEventPort::complete(std::vector<Result>& results, size_t failed)
+{
+  bool wasEmpty = m_results.empty();
+  for (size_t i = 0; i < results.size(); i++) m_results.push_back(std::move(results[i]));
+  m_stats.listsFailed += failed;
+  if (wasEmpty && !m_results.empty()) signal(m_listFd);
+}
+
+/*
+ * Do one readout read.  Called and returns with the lock held, drops it
+ * during the read.
+ */
+void
+CVMUSBEventPort::readBuffer(std::unique_lock<std::mutex>& lock)
+{
+  std::vector<uint8_t> buffer(m_bufferBytes);
+  int                  timeout = m_readTimeout;
+  lock.unlock();
+
+  size_t nRead  = 0;
+  int    status;
+  int    error;
+  try {
+    status = m_vmusb.recoveringRead(buffer.data(), buffer.size(), &nRead, timeout);
+    error  = errno;
+  }
+  catch (...) {                             // Counted and waited out like any read error.
+    status = -1;
+    error  = EIO;
+  }
+
+  lock.lock();
+  if ((status == 0) && (nRead > 0)) {
+    buffer.resize(nRead);
+    m_buffers.push_back(std::move(buffer));
+    m_stats.buffers++;
+    m_stats.bytes += nRead;
+    if (m_buffers.size() == 1) signal(m_dataFd);
+  }
+  else if ((status < 0) && (error != ETIMEDOUT) && (error != EAGAIN)) {
+    m_stats.readErrors++;
+    m_wake.wait_for(lock, std::chrono::milliseconds(timeout));  // Don't spin on a dead device.
+  }
+}
+
+void
+CVMUSBEventPort::signal(int fd)
+{
+  uint64_t one = 1;
+  ssize_t  n   = write(fd, &one, sizeof(one));
+  (void)n;                                  // Only fails if the counter is huge.
+}
+
+void
+CVMUSBEventPort::clear(int fd)
+{
+  uint64_t count;
+  ssize_t  n = read(fd, &count, sizeof(count));
+  (void)n;                                  // EAGAIN if it was clear already.
+}
@@ -0,0 +1,127 @@
+/*
+ * This file defines the CVMUSBEventPort class which lets a single event loop (epoll, poll, select, Tcl's
+ * file handlers...) drive a VM-USB. libusb-0.1 only has blocking transfers and no pollable descriptors, so
+ * the port owns one I/O thread that does all the blocking USB calls and reports completions through two
+ * eventfds:
+ *
+ *   listFd()  - readable while there are list results to collect().
+ *   dataFd()  - readable while there are readout buffers to take with nextBuffer().
+ *
+ * Both are level triggered: they stay readable until the last result or buffer has been taken. Lists are
+ * submitted without blocking and executed by the I/O thread in pipelined batches (CVMUSB::executeLists).
+ * At most maxOutstanding lists may be submitted and not yet collected; submit() fails with EAGAIN beyond
+ * that, and listFd() becoming readable is the signal that room is coming. Readout buffers are read only
+ * while fewer than maxBuffers are waiting, so a slow consumer backs up into the VM-USB (which goes busy)
+ * rather than into host memory.
+ *
+ * The VM-USB sends list replies and data buffers through the same bulk-in endpoint, so a list executed
+ * while it is taking data could take a data buffer for its reply. submit() therefore fails with EBUSY
+ * between startReadout() and stopReadout(). The action register is written with its own packet, not
+ * with a list; submitAction() queues such a write, allowed at any time, and its Result comes back like
+ * a list's (status 0 or -1, no data). A run is then:
+ *
+ *   startReadout(), submitAction(start) ... submitAction(stop), take buffers until the last one,
+ *   stopReadout().
+ *
+ * Errors the controller throws on the I/O thread become failed results or read errors.
+ */
+
+#ifndef CVMUSBEventPort_H
+#define CVMUSBEventPort_H
+
+#include "CVMUSB.h"
+#include "CVMUSBReadoutList.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class CVMUSBEventPort
+{
+public:
+  typedef uint64_t Ticket;        // Identifies a submitted list, never 0.
+
+  /*!
+     The outcome of one list.  status and error are those of
+     CVMUSB::executeLists.
+  */
+  struct Result {
+    Ticket               ticket;
+    int                  status;
+    int                  error;
+    std::vector<uint8_t> data;
+  };
+
+  struct Statistics {
+    size_t listsSubmitted;
+    size_t listsFailed;
+    size_t batches;              // executeLists calls.
+    size_t buffers;
+    size_t bytes;
+    size_t readErrors;           // Reads recoveringRead could not save.
+  };
+
+private:
+  struct Pending {
+    Ticket            ticket;
+    CVMUSBReadoutList list;
+    size_t            maxBytes;
+    bool              action;    // An action register write of actionValue, not a list.
+    uint16_t          actionValue;
+  };
+
+  CVMUSB&                          m_vmusb;
+  size_t                           m_maxOutstanding;
+  unsigned                         m_depth;
+  size_t                           m_maxBuffers;
+  int                              m_listFd;
+  int                              m_dataFd;
+
+  std::mutex                       m_lock;     // Guards everything below.
+  std::condition_variable          m_wake;     // I/O thread has something to do.
+  std::deque<Pending>              m_pending;
+  std::deque<Result>               m_results;
+  std::deque<std::vector<uint8_t> > m_buffers;
+  size_t                           m_outstanding;
+  Ticket                           m_nextTicket;
+  bool                             m_readout;
+  size_t                           m_bufferBytes;
+  int                              m_readTimeout;
+  bool                             m_exit;
+  Statistics                       m_stats;
+  std::thread                      m_thread;
+
+public:
+  CVMUSBEventPort(CVMUSB& vmusb, size_t maxOutstanding = 64, unsigned depth = 4,
+                  size_t maxBuffers = 16);
+  ~CVMUSBEventPort();
+
+  int listFd() const { return m_listFd; }
+  int dataFd() const { return m_dataFd; }
+
+  Ticket submit(const CVMUSBReadoutList& list, size_t maxBytes = sizeof(uint32_t));
+  Ticket submitAction(uint16_t value);
+  bool   collect(Result& result);
+
+  void startReadout(size_t bufferBytes = 13*1024*sizeof(uint16_t) + 2*sizeof(uint32_t),
+                    int timeoutMs = 50);
+  void stopReadout();
+  bool nextBuffer(std::vector<uint8_t>& buffer);
+
+  Statistics statistics();
+
+  // Utilities:
+private:
+  void run();
+  void executeBatch(std::unique_lock<std::mutex>& lock);
+  void executeAction(std::unique_lock<std::mutex>& lock);
+  void complete(std::vector<Result>& results, size_t failed);
+  void readBuffer(std::unique_lock<std::mutex>& lock);
+  static void signal(int fd);
+  static void clear(int fd);
+};
+
+#endif
@@ -0,0 +1,183 @@
+/*
+    Implementation of the CVMUSBListDecoder class.
+*/
+
+#include "CVMUSBListDecoder.h"
+#include "CVMUSBReadoutList.h"
+#include "CVMUSBStackFormat.h"
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+using namespace CVMUSBStackFormat;
+
+/*!
+   Decode a readout list.
+   \throw std::runtime_error if the list ends in the middle of an operation.
+*/
+std::vector<CVMUSBListDecoder::Operation>
+CVMUSBListDecoder::decode(const CVMUSBReadoutList& list)
+{
+  return decode(list.get());
+}
+
+/*!
+   Decode raw stack lines into operations.  The rules mirror the way
+   CVMUSBReadoutList lays lines out:
+   - Delay lines are a single line.
+   - Markers are the mode line and the marker value.
+   - SLF lines are register reads (NW) or writes (+data).
+   - A nonzero BLT field is a block transfer: MB adds a block count line,
+     writes are followed by their data.
+   - Anything else is a single shot VME transfer, ND reads carry the
+     extraction mask between the mode and the address.
+
+   A block read that follows a number data read (with no block transfer
+   in between) is flagged numberData; its count comes from the VM-USB,
+   not from its BLT field.
+
+   \throw std::runtime_error if the lines end in the middle of an operation.
+*/
+std::vector<CVMUSBListDecoder::Operation>
+CVMUSBListDecoder::decode(const std::vector<uint32_t>& lines)
+{
+  std::vector<Operation> ops;
+  bool   countPending = false;
+  size_t i            = 0;
+
+  while (i < lines.size()) {
+    uint32_t  mode = lines[i];
+    Operation op   = {Delay, mode, static_cast<uint8_t>((mode & modeAMMask) >> modeAMShift),
+		      0, 0, 0, 0, 0, 1, false, false, i, 1};
+
+    if (mode & modeDelay) {
+      op.type = Delay;
+      op.data = mode & modeDelayMask;
+      op.amod = 0;
+    }
+    else if (mode & modeMarker) {
+      op.type   = Marker;
+      op.nLines = 2;
+      op.amod   = 0;
+    }
+    else if (mode & modeSLF) {
+      op.type   = (mode & modeNW) ? RegisterRead : RegisterWrite;
+      op.nLines = (mode & modeNW) ? 2 : 3;
+      op.width  = sizeof(uint32_t);
+      op.amod   = 0;
+      if (i + op.nLines <= lines.size()) {
+	op.address = lines[i + 1];
+	if (op.type == RegisterWrite) op.data = lines[i + 2];
+      }
+    }
+    else if (mode & modeBLTMask) {
+      bool   read  = (mode & modeNW) != 0;
+      size_t first = (mode & modeMB) ? 2 : 1;     // Index of the address line.
+      op.type      = read ? BlockRead : BlockWrite;
+      op.transfers = (mode & modeBLTMask) >> modeBLTShift;
+      op.fifo      = (mode & modeNA) != 0;
+      op.nLines    = first + 1;
+      if (i + first < lines.size()) {
+	op.address = lines[i + first];
+	if (mode & modeMB) op.blocks = lines[i + 1];
+      }
+      op.width = isMbltAmod(op.amod) ? sizeof(uint64_t) :
+	((op.address & addrNotLong) ? sizeof(uint16_t) : sizeof(uint32_t));
+      op.address &= ~addrNotLong;
+      if (!read) {
+	op.nLines += op.transfers * op.blocks;
+	if (i + first + 1 < lines.size()) op.data = lines[i + first + 1];
+      }
+      else {
+	op.numberData = countPending;
+	countPending  = false;
+      }
+    }
+    else {
+      bool read     = (mode & modeNW) != 0;
+      op.type       = read ? VMERead : VMEWrite;
+      op.numberData = (mode & modeND) != 0;
+      size_t addr   = op.numberData ? 2 : 1;
+      op.nLines     = addr + 1 + (read ? 0 : 1);
+      if (i + op.nLines <= lines.size()) {
+	op.address = lines[i + addr];
+	if (op.numberData) op.mask = lines[i + 1];
+	if (!read)         op.data = lines[i + addr + 1];
+      }
+      if (op.address & addrNotLong) {
+	op.width = (mode & modeDSMask) ? sizeof(uint8_t) : sizeof(uint16_t);
+      }
+      else {
+	op.width = sizeof(uint32_t);
+      }
+      op.address  &= ~addrNotLong;
+      op.transfers = 1;
+      if (op.numberData) countPending = true;
+    }
+
+    if (op.type == Marker && (i + 1 < lines.size())) {
+      op.data = lines[i + 1];
+    }
+    if (i + op.nLines > lines.size()) {
+      char msg[100];
+      sprintf(msg, "CVMUSBListDecoder::decode - truncated operation at line %lu",
+	      static_cast<unsigned long>(i));
+      throw std::runtime_error(msg);
+    }
+    ops.push_back(op);
+    i += op.nLines;
+  }
+  return ops;
+}
+
+/*!
+   True for the D32 block transfer address modifiers.
+*/
+bool
+CVMUSBListDecoder::isBlockAmod(uint8_t amod)
+{
+  return (amod == CVMUSBReadoutList::a32UserBlock) || (amod == CVMUSBReadoutList::a32PrivBlock) ||
+    (amod == CVMUSBReadoutList::a24UserBlock) || (amod == CVMUSBReadoutList::a24PrivBlock);
+}
+/*!
+   True for the MBLT (D64) address modifiers.
+*/
+bool
+CVMUSBListDecoder::isMbltAmod(uint8_t amod)
+{
+  return (amod == CVMUSBReadoutList::a32UserMBLT) || (amod == CVMUSBReadoutList::a32PrivMBLT) ||
+    (amod == CVMUSBReadoutList::a24UserMBLT) || (amod == CVMUSBReadoutList::a24PrivMBLT);
+}
+
+/*!
+   One line human readable description of an operation, for dumps.
+*/
+std::string
+CVMUSBListDecoder::describe(const Operation& op)
+{
+  static const char* names[] = {"regread", "regwrite", "read", "write",
+				"blockread", "blockwrite", "marker", "delay"};
+  char line[200];
+  switch (op.type) {
+  case Delay:
+    sprintf(line, "%-10s %u clocks", names[op.type], op.data);
+    break;
+  case Marker:
+    sprintf(line, "%-10s 0x%04x", names[op.type], op.data);
+    break;
+  case RegisterRead:
+  case RegisterWrite:
+    sprintf(line, "%-10s reg 0x%02x data 0x%08x", names[op.type], op.address, op.data);
+    break;
+  default:
+    sprintf(line, "%-10s 0x%08x am 0x%02x d%lu x%lu%s%s", names[op.type], op.address, op.amod,
+	    static_cast<unsigned long>(op.width*8),
+	    static_cast<unsigned long>(op.transfers*op.blocks),
+	    op.fifo ? " fifo" : "", op.numberData ? " nd" : "");
+    if (op.type == VMEWrite) {
+      sprintf(line + strlen(line), " data 0x%x", op.data);
+    }
+    break;
+  }
+  return std::string(line);
+}
@@ -0,0 +1,60 @@
+/*
+    Decodes the stack lines of a CVMUSBReadoutList back into the operations
+    that produced them.  This is what the list optimizer and the stack cost
+    model work from.  The encoding is described in CVMUSBStackFormat.h.
+*/
+
+#ifndef CVMUSBLISTDECODER_H
+#define CVMUSBLISTDECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+
+class CVMUSBReadoutList;
+
+class CVMUSBListDecoder
+{
+public:
+  typedef enum _OpType {
+    RegisterRead,
+    RegisterWrite,
+    VMERead,                    // Single shot, includes number data reads.
+    VMEWrite,
+    BlockRead,                  // BLT, MBLT and FIFO reads.
+    BlockWrite,
+    Marker,
+    Delay
+  } OpType;
+
+  /*!
+     One decoded stack operation.  firstLine/nLines locate the operation
+     in the list it was decoded from so it can be copied out unchanged.
+  */
+  struct Operation {
+    OpType   type;
+    uint32_t mode;
+    uint8_t  amod;
+    uint32_t address;           // Without the LWORD* bit.
+    uint32_t data;              // Write data, marker value or delay clocks.
+    uint32_t mask;              // Number extract mask for ND reads.
+    size_t   width;             // Transfer width in bytes.
+    size_t   transfers;         // Per block for block transfers.
+    size_t   blocks;            // >1 only for MB transfers.
+    bool     fifo;              // NA - address is not incremented.
+    bool     numberData;        // ND - count read or masked count transfer.
+    size_t   firstLine;
+    size_t   nLines;
+  };
+
+public:
+  static std::vector<Operation> decode(const CVMUSBReadoutList& list);
+  static std::vector<Operation> decode(const std::vector<uint32_t>& lines);
+
+  static bool        isBlockAmod(uint8_t amod);
+  static bool        isMbltAmod(uint8_t amod);
+  static std::string describe(const Operation& op);
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*
+    Implementation of the CVMUSBListOptimizer class.
+*/
+
+#include "CVMUSBListOptimizer.h"
+#include "CVMUSBReadoutList.h"
+#include "CVMUSBStackFormat.h"
+#include <algorithm>
+
+using namespace CVMUSBStackFormat;
+
+/*!
+   By default delays are folded and duplicate writes dropped; multicast
+   and block write folding need to be asked for.
+*/
+CVMUSBListOptimizer::CVMUSBListOptimizer() :
+  m_foldDelays(true),
+  m_dropDuplicates(true),
+  m_blockWrites(false),
+  m_mcstBase(0),
+  m_offsetMask(0x0000ffff)
+{}
+
+/*!
+   Describe a multicast group.
+   \param mcstBase   : uint32_t
+      Multicast base address (e.g. 0xbb000000 for the Mesytec modules).
+   \param members    : const std::vector<uint32_t>&
+      Base addresses of the modules that answer to mcstBase.
+   \param offsetMask : uint32_t
+      Bits of an address that select the register inside a module.
+*/
+void
+CVMUSBListOptimizer::setMulticast(uint32_t mcstBase, const std::vector<uint32_t>& members,
+				  uint32_t offsetMask)
+{
+  m_mcstBase    = mcstBase & ~offsetMask;
+  m_mcstMembers = members;
+  m_offsetMask  = offsetMask;
+}
+
+/*!
+   Produce the optimized version of a list.  The input is not modified.
+
+   \param list    : const CVMUSBReadoutList&
+      The list to optimize.
+   \param pReport : Report*
+      If not null, filled in with what was done.
+
+   \return CVMUSBReadoutList
+*/
+CVMUSBReadoutList
+CVMUSBListOptimizer::optimize(const CVMUSBReadoutList& list, Report* pReport) const
+{
+  Report                report = {list.size(), 0, estimateTime(list), 0.0, 0, 0, 0, 0};
+  std::vector<uint32_t> lines  = list.get();
+  OpList                ops    = CVMUSBListDecoder::decode(lines);
+  std::vector<uint32_t> out;
+  OpList                run;
+  bool                  delayPending = false;
+  unsigned              delayClocks  = 0;
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    const CVMUSBListDecoder::Operation& op = ops[i];
+
+    if (isWrite(op)) {
+      if (delayPending) emitDelay(delayClocks, out);
+      delayPending = false;
+      delayClocks  = 0;
+      run.push_back(op);
+      continue;
+    }
+    emitRun(lines, run, out, report);
+
+    if ((op.type == CVMUSBListDecoder::Delay) && m_foldDelays) {
+      if (delayPending) report.delaysFolded++;
+      delayPending = true;
+      delayClocks += op.data;
+      continue;
+    }
+    if (delayPending) emitDelay(delayClocks, out);
+    delayPending = false;
+    delayClocks  = 0;
+    emit(lines, op, out);
+  }
+  emitRun(lines, run, out, report);
+  if (delayPending) emitDelay(delayClocks, out);
+
+  CVMUSBReadoutList result(out);
+  report.linesAfter = result.size();
+  report.usAfter    = estimateTime(result);
+  if (pReport) *pReport = report;
+  return result;
+}
+
+/*!
+   Stack execution time in microseconds according to the cost model
+   (see setCostModel).  Masked count transfers are costed as empty since
+   their real length is only known at run time; the optimizer never
+   touches them so the before/after difference is unaffected.
+*/
+double
+CVMUSBListOptimizer::estimateTime(const CVMUSBReadoutList& list) const
+{
+  return m_cost.estimate(list).stackUs;
+}
+
+/*!
+   Print a one line summary of an optimization.
+*/
+void
+CVMUSBListOptimizer::Report::dump(std::ostream& str) const
+{
+  str << "Stack lines " << linesBefore << " -> " << linesAfter
+      << ", estimated " << usBefore << "us -> " << usAfter << "us"
+      << " (delays folded " << delaysFolded
+      << ", duplicates dropped " << duplicatesDropped
+      << ", multicast folds " << multicastFolded
+      << ", block writes " << blockWritesMade << ")\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Utilities:
+
+bool
+CVMUSBListOptimizer::isWrite(const CVMUSBListDecoder::Operation& op) const
+{
+  return (op.type == CVMUSBListDecoder::VMEWrite) || (op.type == CVMUSBListDecoder::RegisterWrite);
+}
+
+bool
+CVMUSBListOptimizer::sameWrite(const CVMUSBListDecoder::Operation& a,
+			       const CVMUSBListDecoder::Operation& b) const
+{
+  return (a.type == b.type) && (a.address == b.address) && (a.amod == b.amod) &&
+    (a.width == b.width) && (a.data == b.data) && (a.mode == b.mode);
+}
+
+/*
+   Could two writes change the same register?  Same type and overlapping
+   bytes, where a write to the multicast address reaches the same offset
+   in every member.
+*/
+bool
+CVMUSBListOptimizer::touches(const CVMUSBListDecoder::Operation& a,
+			     const CVMUSBListDecoder::Operation& b) const
+{
+  if (a.type != b.type) return false;
+  if (a.type != CVMUSBListDecoder::VMEWrite) return a.address == b.address;
+
+  uint32_t aAddress = a.address;
+  uint32_t bAddress = b.address;
+  if (m_mcstBase) {
+    bool aMcst = (aAddress & ~m_offsetMask) == m_mcstBase;
+    bool bMcst = (bAddress & ~m_offsetMask) == m_mcstBase;
+    if (aMcst && !bMcst && (memberIndex(bAddress) >= 0)) {
+      aAddress = (bAddress & ~m_offsetMask) | (aAddress & m_offsetMask);
+    }
+    if (bMcst && !aMcst && (memberIndex(aAddress) >= 0)) {
+      bAddress = (aAddress & ~m_offsetMask) | (bAddress & m_offsetMask);
+    }
+  }
+  return (aAddress < bAddress + b.width) && (bAddress < aAddress + a.width);
+}
+
+// Index of the multicast member an address belongs to, -1 if none.
+
+int
+CVMUSBListOptimizer::memberIndex(uint32_t address) const
+{
+  for (size_t m = 0; m < m_mcstMembers.size(); m++) {
+    if ((address & ~m_offsetMask) == (m_mcstMembers[m] & ~m_offsetMask)) return m;
+  }
+  return -1;
+}
+
+// Emit a run of writes after applying the write passes, then empty the run.
+
+void
+CVMUSBListOptimizer::emitRun(const std::vector<uint32_t>& lines, OpList& run,
+			     std::vector<uint32_t>& out, Report& report) const
+{
+  if (run.empty()) return;
+
+  std::vector<bool>     keep(run.size(), true);
+  std::vector<uint32_t> newAddress(run.size(), 0);  // Nonzero: retarget to this.
+
+  // Duplicate writes:
+
+  if (m_dropDuplicates) {
+    for (size_t j = 1; j < run.size(); j++) {
+      size_t k = j;                             // Last earlier write to the same place.
+      while ((k > 0) && !touches(run[k - 1], run[j])) k--;
+      if ((k > 0) && sameWrite(run[k - 1], run[j])) {
+	keep[j] = false;
+	report.duplicatesDropped++;
+      }
+    }
+  }
+
+  // Multicast: same offset/data to every member -> one write to the group,
+  // in place of the first member's write.
+
+  if (m_mcstBase && !m_mcstMembers.empty()) {
+    for (size_t j = 0; j < run.size(); j++) {
+      if (!keep[j] || (run[j].type != CVMUSBListDecoder::VMEWrite) || run[j].numberData) continue;
+      uint32_t offset = run[j].address & m_offsetMask;
+      if (memberIndex(run[j].address) < 0) continue;
+
+      // Each member's next write to the register after j must be the same
+      // write; the first of them is run[j] itself.
+
+      std::vector<size_t> members;
+      size_t              last = j;
+      for (size_t m = 0; m < m_mcstMembers.size(); m++) {
+	CVMUSBListDecoder::Operation target = run[j];
+	target.address = (m_mcstMembers[m] & ~m_offsetMask) | offset;
+	size_t k = j;
+	while ((k < run.size()) && !(keep[k] && touches(run[k], target))) k++;
+	if ((k == run.size()) || !sameWrite(run[k], target)) break;
+	members.push_back(k);
+	if (k > last) last = k;
+      }
+      if (members.size() != m_mcstMembers.size()) continue;
+
+      // Moving the members' writes up to j is only safe if nothing else
+      // between j and the last of them writes to a member's register.
+
+      bool clear = true;
+      for (size_t k = j + 1; clear && (k < last); k++) {
+	if (!keep[k] || (std::find(members.begin(), members.end(), k) != members.end())) continue;
+	for (size_t m = 0; clear && (m < members.size()); m++) {
+	  if (touches(run[k], run[members[m]])) clear = false;
+	}
+      }
+      if (!clear) continue;
+
+      newAddress[j] = m_mcstBase | offset;
+      for (size_t m = 0; m < members.size(); m++) {
+	if (members[m] != j) keep[members[m]] = false;
+      }
+      report.multicastFolded++;
+    }
+  }
+
+  // Block writes and output:
+
+  size_t j = 0;
+  while (j < run.size()) {
+    if (!keep[j]) { j++; continue; }
+    const CVMUSBListDecoder::Operation& op = run[j];
+
+    if (m_blockWrites && (op.type == CVMUSBListDecoder::VMEWrite) && (op.width == sizeof(uint32_t)) &&
+	!newAddress[j] && blockAmod(op.amod)) {
+      std::vector<uint32_t> data(1, op.data);
+      size_t k    = j + 1;
+      size_t last = j;
+      while (k < run.size()) {
+	if (!keep[k]) { k++; continue; }
+	const CVMUSBListDecoder::Operation& next = run[k];
+	uint32_t expected = run[last].address + sizeof(uint32_t);
+	if ((next.type != CVMUSBListDecoder::VMEWrite) || (next.width != sizeof(uint32_t)) ||
+	    (next.amod != op.amod) || newAddress[k] || (next.address != expected) ||
+	    ((expected & ~0xffu) != (op.address & ~0xffu)) || (data.size() == 254)) {
+	  break;
+	}
+	data.push_back(next.data);
+	last = k;
+	k++;
+      }
+      if (data.size() > 1) {
+	CVMUSBReadoutList block;
+	block.addBlockWrite32(op.address, blockAmod(op.amod), data.data(), data.size());
+	std::vector<uint32_t> blockLines = block.get();
+	out.insert(out.end(), blockLines.begin(), blockLines.end());
+	report.blockWritesMade++;
+	j = last + 1;
+	continue;
+      }
+    }
+
+    size_t start = out.size();
+    emit(lines, op, out);
+    if (newAddress[j]) {
+      out[start + 1] = newAddress[j] | (out[start + 1] & addrNotLong);
+    }
+    j++;
+  }
+  run.clear();
+}
+
+// Copy an operation's lines unchanged.
+
+void
+CVMUSBListOptimizer::emit(const std::vector<uint32_t>& lines, const CVMUSBListDecoder::Operation& op,
+			  std::vector<uint32_t>& out)
+{
+  out.insert(out.end(), lines.begin() + op.firstLine, lines.begin() + op.firstLine + op.nLines);
+}
+
+// A (possibly folded) delay; delay lines only hold 8 bits of clocks.
+
+void
+CVMUSBListOptimizer::emitDelay(unsigned clocks, std::vector<uint32_t>& out)
+{
+  do {
+    unsigned chunk = (clocks > modeDelayMask) ? modeDelayMask : clocks;
+    out.push_back(modeDelay | chunk);
+    clocks -= chunk;
+  } while (clocks);
+}
+
+// Block transfer address modifier that goes with a data access modifier.
+
+uint8_t
+CVMUSBListOptimizer::blockAmod(uint8_t amod)
+{
+  switch (amod) {
+  case 0x09: return CVMUSBReadoutList::a32UserBlock;
+  case 0x0d: return CVMUSBReadoutList::a32PrivBlock;
+  case 0x39: return CVMUSBReadoutList::a24UserBlock;
+  case 0x3d: return CVMUSBReadoutList::a24PrivBlock;
+  default:   return 0;
+  }
+}
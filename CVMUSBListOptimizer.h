@@ -0,0 +1,101 @@
+/*
+    Peephole optimizer for CVMUSBReadoutList stacks.
+
+    Stacks assembled from per-module fragments tend to repeat themselves:
+    the same write issued by several fragments, back to back delays, one
+    reset per module where a single multicast write would do.  Every line
+    costs stack execution time on each trigger, so the optimizer rewrites
+    a list into an equivalent shorter one.
+*/
+
+#ifndef CVMUSBLISTOPTIMIZER_H
+#define CVMUSBLISTOPTIMIZER_H
+
+#include "CVMUSBListDecoder.h"
+#include "CVMUSBStackCost.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <iostream>
+
+/*!
+   The passes, each of which can be turned off:
+
+   - foldDelays       : adjacent delays are merged (split again at 255 clocks).
+   - dropDuplicates   : a write that repeats the last write to the same
+                        register (same address, modifier, width and data)
+                        is dropped when only writes separate the two.
+                        Reads, block transfers, markers and delays end such
+                        a run, so writes that are repeated on purpose around
+                        a read survive.
+   - multicast        : within a run of writes, the same register/data
+                        written to every module of a multicast group is
+                        replaced by one write to the multicast address at
+                        the first module's write.  Not done if anything
+                        else writes one of those registers in between.
+                        Needs setMulticast().
+   - blockWrites      : runs of D32 writes to consecutive longwords with
+                        the same modifier become one block write.  Off by
+                        default; only enable it for slaves that accept block
+                        writes (Mesytec registers do not).
+
+   Nothing is ever reordered across a read, block transfer, marker or delay.
+*/
+class CVMUSBListOptimizer
+{
+public:
+  struct Report {
+    size_t   linesBefore;
+    size_t   linesAfter;
+    double   usBefore;                // Estimated stack execution time.
+    double   usAfter;
+    unsigned delaysFolded;
+    unsigned duplicatesDropped;
+    unsigned multicastFolded;
+    unsigned blockWritesMade;
+
+    void dump(std::ostream& str) const;
+  };
+
+private:
+  bool                  m_foldDelays;
+  bool                  m_dropDuplicates;
+  bool                  m_blockWrites;
+  uint32_t              m_mcstBase;
+  std::vector<uint32_t> m_mcstMembers;
+  uint32_t              m_offsetMask;
+  CVMUSBStackCost       m_cost;
+
+public:
+  CVMUSBListOptimizer();
+
+  void setFoldDelays(bool enable)     { m_foldDelays = enable; }
+  void setDropDuplicates(bool enable) { m_dropDuplicates = enable; }
+  void setBlockWrites(bool enable)    { m_blockWrites = enable; }
+  void setMulticast(uint32_t mcstBase, const std::vector<uint32_t>& members,
+		    uint32_t offsetMask = 0x0000ffff);
+  void setCostModel(const CVMUSBStackCost& cost) { m_cost = cost; }
+
+  CVMUSBReadoutList optimize(const CVMUSBReadoutList& list, Report* pReport = 0) const;
+
+  double estimateTime(const CVMUSBReadoutList& list) const;
+
+  // Utilities:
+private:
+  typedef std::vector<CVMUSBListDecoder::Operation> OpList;
+
+  bool   isWrite(const CVMUSBListDecoder::Operation& op) const;
+  bool   sameWrite(const CVMUSBListDecoder::Operation& a,
+		   const CVMUSBListDecoder::Operation& b) const;
+  bool   touches(const CVMUSBListDecoder::Operation& a,
+		 const CVMUSBListDecoder::Operation& b) const;
+  int    memberIndex(uint32_t address) const;
+  void   emitRun(const std::vector<uint32_t>& lines, OpList& run,
+		 std::vector<uint32_t>& out, Report& report) const;
+  static void emit(const std::vector<uint32_t>& lines, const CVMUSBListDecoder::Operation& op,
+		   std::vector<uint32_t>& out);
+  static void emitDelay(unsigned clocks, std::vector<uint32_t>& out);
+  static uint8_t blockAmod(uint8_t amod);
+};
+
+#endif
@@ -16,6 +16,7 @@
 
 #include "CVMUSBReadoutList.h"
 #include "CVMUSB.h"		//  I think this is ok.
+#include "CVMUSBStackFormat.h"
 #include <iostream>
 #include <stdexcept>
 using namespace std;
@@ -41,38 +42,17 @@ const uint8_t CVMUSBReadoutList::a24UserData = 0x39;
 const uint8_t CVMUSBReadoutList::a24UserProgram = 0x3a;
 const uint8_t CVMUSBReadoutList::a24UserBlock = 0x3b;
 
+const uint8_t CVMUSBReadoutList::a32UserMBLT = 0x08;
+const uint8_t CVMUSBReadoutList::a32PrivMBLT = 0x0c;
+const uint8_t CVMUSBReadoutList::a24UserMBLT = 0x38;
+const uint8_t CVMUSBReadoutList::a24PrivMBLT = 0x3c;
 
 
-// The following are bits in the mode word that leads off each stack line.
-//
-
-static const int modeAMMask(0x3f); // Address modifier bits.
-static const int modeAMShift(0);
-
-static const int modeDSMask(0xc0);
-static const int modeDSShift(6);
-
-static const int modeNW(0x100);
-static const int modeNA(0x400);
-static const int modeMB(0x800);
-static const int modeSLF(0x1000);
-static const int modeMarker(0x2000);
-static const int modeDelay(0x8000); 
-static const int modeBE(0x10000);
-static const int modeHD(0x20000);
-static const int modeND(0x40000);
-static const int modeHM(0x80000);
-static const int modeNTMask(0xc00000);
-static const int modeNTShift(22);
-static const int modeBLTMask(0xf0000000);
-static const int modeBLTShift(24);
 
+// The stack line bit definitions (modeXXX, addrNotLong) are in
+// CVMUSBStackFormat.h:
 
-
-// The following bit must be set in the address stack line for non long
-// word transfers:
-
-static const int addrNotLong(1);
+using namespace CVMUSBStackFormat;
 
 /////////////////////////////////////////////////////////////////
 //  Constructors and canonicals.
@@ -421,11 +401,16 @@ CVMUSBReadoutList::addBlockRead32(uint32_t baseAddress, uint8_t amod,
   - The base address must be longword aligned.
   - The address modifier must be one of the block transfer mode.
   - There must be at least 2 transfers specified. Using this to transfer 1 word will fail.
+
+  Up to 254 transfers are written as a single BLT.  Longer writes are split the
+  same way addBlockRead splits reads: a partial transfer up to the next 256 byte
+  block boundary, a multiblock (MB) transfer of full blocks and a trailing partial
+  block.  Each of those stack lines is followed by the data it writes.
+
   @param baseAddress - Base of the target block.
   @param amod        - address modifier.
   @param data        - Data to transfer.
   @param transfers   - Number of transfers to perform.
-  @throws std::runtime_error if the number of transfers is greater than 254
 */
 void
 CVMUSBReadoutList::addBlockWrite32(uint32_t baseAddress, uint8_t amod,
@@ -434,27 +419,20 @@ CVMUSBReadoutList::addBlockWrite32(uint32_t baseAddress, uint8_t amod,
 
   // If the number of transfers is 255 that causes the BLT bits of the
   // command header to 0xff. This triggers MBLT mode and the subsequent
-  // data word is expected to be a number of transfers. We are not handling
-  // multi BLT mode so I am just going to prevent people from doing
-  // more than 254 block transfers at a time. Sorry folks. This has been
-  // broken for a long time and no one has cared, so no one is likely
-  // to begin caring now.
-  if (transfers > 254) {
-    std::string errmsg("CVMUSBReadoutList::addBlockWrite32() ");
-    errmsg += "only supports _fewer_ than 255 transfers";
-    throw std::runtime_error(errmsg);
+  // data word is expected to be a number of transfers. Short writes stay
+  // a single BLT so their stack image does not change, anything that
+  // would hit 255 goes through the multiblock path.
+
+  uint32_t  mode = (static_cast<uint32_t>(amod) << modeAMShift) & modeAMMask;
+  uint32_t* src  = reinterpret_cast<uint32_t*>(data);
+
+  if (transfers <= 254) {
+    m_list.push_back(mode | (transfers << modeBLTShift));
+    m_list.push_back(baseAddress);
+    m_list.insert(m_list.end(), src, src+transfers);
+    return;
   }
-
-  uint32_t mode = (static_cast<uint32_t>(amod) << modeAMShift) & modeAMMask;
-  mode         |= (transfers<<24);
-
-  m_list.push_back(mode);
-  m_list.push_back(baseAddress);
-  
-  // Put the data in the list too:
-  uint32_t* src = reinterpret_cast<uint32_t*>(data);
-  m_list.insert(m_list.end(), src, src+transfers);
-  
+  addBlockWrite(baseAddress, src, transfers, mode);
 }
 
 /*!
@@ -478,6 +456,38 @@ CVMUSBReadoutList::addFifoRead16(uint32_t address, uint8_t amod, size_t transfer
 	                                ((amod << modeAMShift) & modeAMMask) |
 							  modeNW), sizeof(uint16_t));
 }
+/*!
+   Add a 64 bit (MBLT) block read to the list.  The restrictions are the same
+   as for addBlockRead32, except that the base address must be quadword aligned
+   and the address modifier must be one of the MBLT modifiers, e.g.
+   CVMUSBReadoutList::a32UserMBLT.  Each transfer moves 8 bytes so the data
+   comes back as 2*transfers longwords.  A 256 byte block holds 32 transfers.
+
+   \param baseAddress : uint32_t
+      Address of the first transfer.
+   \param amod : uint8_t
+      MBLT address modifier.
+   \param transfers : size_t
+      Number of \em quadwords to transfer.
+*/
+void
+CVMUSBReadoutList::addBlockRead64(uint32_t baseAddress, uint8_t amod, size_t transfers)
+{
+  addBlockRead(baseAddress & 0xfffffff8, transfers,
+	       static_cast<uint32_t>(((amod << modeAMShift) & modeAMMask) | modeNW),
+	       sizeof(uint64_t));
+}
+/*!
+   64 bit (MBLT) read from a FIFO.  Same as addBlockRead64 with the NA bit set
+   so that the address is not incremented.
+*/
+void
+CVMUSBReadoutList::addFifoRead64(uint32_t address, uint8_t amod, size_t transfers)
+{
+  addBlockRead(address & 0xfffffff8, transfers, static_cast<uint32_t>(modeNA |
+	                                ((amod << modeAMShift) & modeAMMask) |
+							  modeNW), sizeof(uint64_t));
+}
 ///////////////////////////////////////////////////////////////////////////////////
 //
 // Private utility functions:
@@ -509,7 +519,8 @@ CVMUSBReadoutList::addBlockRead(uint32_t base, size_t transfers,
 				size_t   width)
 {
 
-  bool notlong = width != sizeof(uint32_t); // need to set addrNotLong in addres
+  bool notlong = width < sizeof(uint32_t); // need to set addrNotLong in addres
+                                           // (MBLT transfers are not 'not long').
 
   // There are several nasty edge cases cases to deal with.
   // If the base address is not block aligned, a partial transfer
@@ -517,7 +528,7 @@ CVMUSBReadoutList::addBlockRead(uint32_t base, size_t transfers,
 
 
   if ((base & 0xff) != 0) {
-    size_t aligningTransfers = (base - (base & 0xff))/width;
+    size_t aligningTransfers = (0x100 - (base & 0xff))/width;
     if (transfers < aligningTransfers) aligningTransfers = transfers;
     uint32_t mode  = startingMode;
     mode          |= (aligningTransfers) << modeBLTShift;
@@ -565,6 +576,49 @@ CVMUSBReadoutList::addBlockRead(uint32_t base, size_t transfers,
 
 }
 
+// Multiblock block write.  Same splitting as addBlockRead, but every stack
+// line carries the data it writes right after its address (and after the
+// block count for the MB line).  Only 32 bit writes are supported.
+//
+void
+CVMUSBReadoutList::addBlockWrite(uint32_t base, uint32_t* src, size_t transfers,
+				 uint32_t startingMode)
+{
+  const size_t width       = sizeof(uint32_t);
+  const size_t blockXfers  = 256/width;
+
+  if ((base & 0xff) != 0) {
+    size_t aligningTransfers = (0x100 - (base & 0xff))/width;
+    if (transfers < aligningTransfers) aligningTransfers = transfers;
+    m_list.push_back(startingMode | (aligningTransfers << modeBLTShift));
+    m_list.push_back(base);
+    m_list.insert(m_list.end(), src, src+aligningTransfers);
+
+    base      += aligningTransfers * width;
+    src       += aligningTransfers;
+    transfers -= aligningTransfers;
+  }
+  if (transfers == 0) return;
+
+  size_t fullBlocks   = transfers/blockXfers;
+  size_t partialBlock = transfers % blockXfers;
+
+  if (fullBlocks) {
+    m_list.push_back(startingMode | modeMB | (blockXfers << modeBLTShift));
+    m_list.push_back(fullBlocks);
+    m_list.push_back(base);
+    m_list.insert(m_list.end(), src, src + fullBlocks*blockXfers);
+
+    base += fullBlocks * 256;
+    src  += fullBlocks * blockXfers;
+  }
+  if (partialBlock) {
+    m_list.push_back(startingMode | (partialBlock << modeBLTShift));
+    m_list.push_back(base);
+    m_list.insert(m_list.end(), src, src+partialBlock);
+  }
+}
+
 /*!
    Add a delay in stack execution
    \param clocks : uint8_t 
@@ -659,6 +713,18 @@ CVMUSBReadoutList::addMaskedCountBlockRead32(uint32_t address, uint8_t amod)
                                     // nonzero is required to ensure stack words actually
                                     // get generated
 }
+/*!
+   64 bit (MBLT) variable length block transfer from a FIFO.  The number data
+   read before this must count quadwords (e.g. a Mesytec module with
+   data_len_format set to 64 bit).
+   \param address(uint32_t) address of the fifo.
+   \param amod   (uint8_t)  MBLT address modifier.
+*/
+void
+CVMUSBReadoutList::addMaskedCountFifoRead64(uint32_t address, uint8_t amod)
+{
+  addFifoRead64(address, amod, (size_t)1);  // Actual count comes from ND and mask.
+}
 /*!
    Add a variable length block transfer from a FIFO. The list must contain a prior read of 
    the number data (e.g. addBlockCountReadxx) prior to this with no intervening block transfers
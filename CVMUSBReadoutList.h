@@ -153,6 +153,8 @@ public:
   virtual void addFifoRead16(uint32_t baseAddress, uint8_t amod, size_t transfers);
   virtual void addBlockWrite32(uint32_t baseAddresss, uint8_t amod, void* data, 
 		       size_t transfers);
+  virtual void addBlockRead64(uint32_t baseAddress, uint8_t amod, size_t transfers);
+  virtual void addFifoRead64(uint32_t  baseAddress, uint8_t amod, size_t transfers);
 //  void addBlockRead32(int base, int amod, int transfers) { // SWIG
 //    addBlockRead32((uint32_t)base, (uint8_t)amod, (size_t)transfers);
 //  }
@@ -161,6 +163,12 @@ public:
 //  }
 //  void addFifoRead16(int base, int amod, int transfers) { // SWIG
 //    addFifoRead16((uint32_t)base, (uint8_t)amod, (size_t)transfers);
+//  }
+//  void addBlockRead64(int base, int amod, int transfers) { // SWIG
+//    addBlockRead64((uint32_t)base, (uint8_t)amod, (size_t)transfers);
+//  }
+//  void addFifoRead64(int base, int amod, int transfers) { // SWIG
+//    addFifoRead64((uint32_t)base, (uint8_t)amod, (size_t)transfers);
 //  }
   // NOTE: addBlockWrite is not supported for SWIG at this time...
   //       need to figure out how I'd want to implement it.
@@ -180,6 +188,7 @@ public:
   virtual void addBlockCountRead32(uint32_t address, uint32_t mask, uint8_t amod);
   virtual void addMaskedCountBlockRead32(uint32_t address, uint8_t amod);
   virtual void addMaskedCountFifoRead32(uint32_t address, uint8_t amod);
+  virtual void addMaskedCountFifoRead64(uint32_t address, uint8_t amod);
 //  void addBlockCountRead8(int a, int m, int am) { // SWIG
 //    addBlockCountRead8((uint32_t)a, uint32_t(m), (uint8_t)am);
 //  }
@@ -246,6 +255,13 @@ public:
   static const uint8_t a24PrivProgram ;
   static const uint8_t a24PrivBlock ;
 
+  // 64 bit multiplexed block transfers (MBLT), VME64:
+
+  static const uint8_t a32UserMBLT;
+  static const uint8_t a32PrivMBLT;
+  static const uint8_t a24UserMBLT;
+  static const uint8_t a24PrivMBLT;
+
   // utility functions:
 
 private:
@@ -253,6 +269,8 @@ private:
   void     addBlockRead(uint32_t base, size_t transfers,
 			uint32_t startingMode,
 			size_t   width = sizeof(uint32_t));
+  void     addBlockWrite(uint32_t base, uint32_t* src, size_t transfers,
+			 uint32_t startingMode);
   void     lastTransferIsNumberData(uint32_t mask);
 
  public:
@@ -0,0 +1,348 @@
+/*
+    Compile time VM-USB stack builder.
+
+    CVMUSBReadoutList builds stacks at run time.  Stacks that are fixed when
+    the program is compiled (the production readout stack for example) can
+    instead be built by a constexpr function with CVMUSBStackBuilder, and the
+    compiler produces the stack words.  The encoding is the same as
+    CVMUSBReadoutList line for line; both use CVMUSBStackFormat.h.
+
+    Mistakes the run time list silently accepts are compile errors here when
+    the stack is built in a constant expression:
+    - block transfers with a non block address modifier (or the reverse),
+    - misaligned block transfer and single shot addresses,
+    - a masked count read without a preceding count read,
+    - overflowing the builder's capacity.
+
+    Example:
+    \verbatim
+      constexpr CVMUSBStackBuilder<32> readoutStack()
+      {
+        CVMUSBStackBuilder<32> stack;
+        stack.addMarker(0xbde7);
+        stack.addBlockCountRead16(0x06066030, 0x3fff, 0x0d);
+        stack.addMaskedCountFifoRead32(0x06060000, 0x0f);
+        stack.addWrite16(0xbb006034, 0x0e, 1);
+        return stack;
+      }
+      constexpr auto stack = readoutStack();
+      static_assert(stack.size() == 10, "unexpected stack length");
+
+      CVMUSBReadoutList list = stack.toList();
+    \endverbatim
+
+    Requires C++14 (constexpr functions with loops and assignments).
+*/
+
+#ifndef CVMUSBSTACKBUILDER_H
+#define CVMUSBSTACKBUILDER_H
+
+#include "CVMUSBStackFormat.h"
+#include "CVMUSBReadoutList.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+
+template<size_t Capacity>
+class CVMUSBStackBuilder
+{
+private:
+  uint32_t m_words[Capacity];
+  size_t   m_size;
+  bool     m_haveCount;          // A number data read precedes us.
+
+public:
+  constexpr CVMUSBStackBuilder() :
+    m_words{}, m_size(0), m_haveCount(false)
+  {}
+
+  // Selectors:
+
+  constexpr size_t   size() const             { return m_size; }
+  constexpr size_t   capacity() const         { return Capacity; }
+  constexpr uint32_t operator[](size_t i) const { return m_words[i]; }
+  constexpr const uint32_t* begin() const     { return m_words; }
+  constexpr const uint32_t* end() const       { return m_words + m_size; }
+
+  // Register operations:
+
+  constexpr CVMUSBStackBuilder& addRegisterRead(unsigned int address)
+  {
+    push(CVMUSBStackFormat::modeNW | CVMUSBStackFormat::modeSLF);
+    push(address);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addRegisterWrite(unsigned int address, uint32_t data)
+  {
+    push(CVMUSBStackFormat::modeSLF);
+    push(address);
+    push(data);
+    return *this;
+  }
+
+  // Single shot VME operations:
+
+  constexpr CVMUSBStackBuilder& addWrite32(uint32_t address, uint8_t amod, uint32_t datum)
+  {
+    requireSingleShot(amod);
+    requireAligned(address, sizeof(uint32_t));
+    push(amodBits(amod));
+    push(address & 0xfffffffc);
+    push(datum);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addWrite16(uint32_t address, uint8_t amod, uint16_t datum)
+  {
+    requireSingleShot(amod);
+    requireAligned(address, sizeof(uint16_t));
+    push(amodBits(amod));
+    push((address & 0xfffffffe) | CVMUSBStackFormat::addrNotLong);
+    push(datum);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addRead32(uint32_t address, uint8_t amod)
+  {
+    requireSingleShot(amod);
+    requireAligned(address, sizeof(uint32_t));
+    push(CVMUSBStackFormat::modeNW | amodBits(amod));
+    push(address & 0xfffffffc);
+    m_haveCount = false;
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addRead16(uint32_t address, uint8_t amod)
+  {
+    requireSingleShot(amod);
+    requireAligned(address, sizeof(uint16_t));
+    push(CVMUSBStackFormat::modeNW | amodBits(amod));
+    push((address & 0xfffffffe) | CVMUSBStackFormat::addrNotLong);
+    m_haveCount = false;
+    return *this;
+  }
+
+  // Block transfers:
+
+  constexpr CVMUSBStackBuilder& addBlockRead32(uint32_t base, uint8_t amod, size_t transfers)
+  {
+    requireBlt(amod);
+    requireAligned(base, sizeof(uint32_t));
+    addBlockRead(base, transfers, CVMUSBStackFormat::modeNW | amodBits(amod), sizeof(uint32_t));
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addFifoRead32(uint32_t address, uint8_t amod, size_t transfers)
+  {
+    requireBlt(amod);
+    requireAligned(address, sizeof(uint32_t));
+    addBlockRead(address, transfers,
+		 CVMUSBStackFormat::modeNA | CVMUSBStackFormat::modeNW | amodBits(amod),
+		 sizeof(uint32_t));
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addFifoRead16(uint32_t address, uint8_t amod, size_t transfers)
+  {
+    requireBlt(amod);
+    requireAligned(address, sizeof(uint16_t));
+    addBlockRead(address, transfers,
+		 CVMUSBStackFormat::modeNA | CVMUSBStackFormat::modeNW | amodBits(amod),
+		 sizeof(uint16_t));
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addBlockRead64(uint32_t base, uint8_t amod, size_t transfers)
+  {
+    requireMblt(amod);
+    requireAligned(base, sizeof(uint64_t));
+    addBlockRead(base, transfers, CVMUSBStackFormat::modeNW | amodBits(amod), sizeof(uint64_t));
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addFifoRead64(uint32_t address, uint8_t amod, size_t transfers)
+  {
+    requireMblt(amod);
+    requireAligned(address, sizeof(uint64_t));
+    addBlockRead(address, transfers,
+		 CVMUSBStackFormat::modeNA | CVMUSBStackFormat::modeNW | amodBits(amod),
+		 sizeof(uint64_t));
+    return *this;
+  }
+
+  // Variable length block transfers:
+
+  constexpr CVMUSBStackBuilder& addBlockCountRead16(uint32_t address, uint32_t mask, uint8_t amod)
+  {
+    addRead16(address, amod);
+    lastTransferIsNumberData(mask);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addBlockCountRead32(uint32_t address, uint32_t mask, uint8_t amod)
+  {
+    addRead32(address, amod);
+    lastTransferIsNumberData(mask);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addMaskedCountBlockRead32(uint32_t address, uint8_t amod)
+  {
+    requireCount();
+    return addBlockRead32(address, amod, 1);
+  }
+  constexpr CVMUSBStackBuilder& addMaskedCountFifoRead32(uint32_t address, uint8_t amod)
+  {
+    requireCount();
+    return addFifoRead32(address, amod, 1);
+  }
+  constexpr CVMUSBStackBuilder& addMaskedCountFifoRead64(uint32_t address, uint8_t amod)
+  {
+    requireCount();
+    return addFifoRead64(address, amod, 1);
+  }
+
+  // Miscellaneous:
+
+  constexpr CVMUSBStackBuilder& addDelay(uint8_t clocks)
+  {
+    push(CVMUSBStackFormat::modeDelay | clocks);
+    return *this;
+  }
+  constexpr CVMUSBStackBuilder& addMarker(uint16_t value)
+  {
+    push(CVMUSBStackFormat::modeMarker);
+    push(value);
+    return *this;
+  }
+
+  // Conversions:
+
+  /*!
+     The stack as a fixed size array.  N is normally size() of the
+     constexpr builder, e.g. stack.toArray<stack.size()>().
+  */
+  template<size_t N>
+  constexpr std::array<uint32_t, N> toArray() const
+  {
+    static_assert(N <= Capacity, "CVMUSBStackBuilder::toArray - N exceeds the capacity");
+    return toArray(std::make_index_sequence<N>());
+  }
+
+  /*!
+     A run time list with the same contents, for CVMUSB::loadList,
+     CVMUSB::executeList or CVMUSBStackMemory.
+  */
+  CVMUSBReadoutList toList() const
+  {
+    std::vector<uint32_t> words(m_words, m_words + m_size);
+    return CVMUSBReadoutList(words);
+  }
+
+  // Utilities:
+
+private:
+  template<size_t... I>
+  constexpr std::array<uint32_t, sizeof...(I)> toArray(std::index_sequence<I...>) const
+  {
+    return std::array<uint32_t, sizeof...(I)>{{ m_words[I]... }};
+  }
+
+  constexpr void push(uint32_t word)
+  {
+    if (m_size >= Capacity) {
+      throw std::length_error("CVMUSBStackBuilder - stack exceeds the builder capacity");
+    }
+    m_words[m_size++] = word;
+  }
+
+  static constexpr uint32_t amodBits(uint8_t amod)
+  {
+    return (static_cast<uint32_t>(amod) << CVMUSBStackFormat::modeAMShift) &
+      CVMUSBStackFormat::modeAMMask;
+  }
+  static constexpr bool isBlt(uint8_t amod)
+  {
+    return (amod == 0x0b) || (amod == 0x0f) || (amod == 0x3b) || (amod == 0x3f);
+  }
+  static constexpr bool isMblt(uint8_t amod)
+  {
+    return (amod == 0x08) || (amod == 0x0c) || (amod == 0x38) || (amod == 0x3c);
+  }
+
+  static constexpr void requireBlt(uint8_t amod)
+  {
+    if (!isBlt(amod)) {
+      throw std::invalid_argument("CVMUSBStackBuilder - block transfer needs a BLT address modifier");
+    }
+  }
+  static constexpr void requireMblt(uint8_t amod)
+  {
+    if (!isMblt(amod)) {
+      throw std::invalid_argument("CVMUSBStackBuilder - 64 bit block transfer needs an MBLT address modifier");
+    }
+  }
+  static constexpr void requireSingleShot(uint8_t amod)
+  {
+    if (isBlt(amod) || isMblt(amod)) {
+      throw std::invalid_argument("CVMUSBStackBuilder - single shot transfer with a block address modifier");
+    }
+  }
+  static constexpr void requireAligned(uint32_t address, size_t width)
+  {
+    if (address & (width - 1)) {
+      throw std::invalid_argument("CVMUSBStackBuilder - address is not aligned to the transfer width");
+    }
+  }
+  constexpr void requireCount() const
+  {
+    if (!m_haveCount) {
+      throw std::logic_error("CVMUSBStackBuilder - masked count read without a count read before it");
+    }
+  }
+
+  // Same as CVMUSBReadoutList::lastTransferIsNumberData.
+
+  constexpr void lastTransferIsNumberData(uint32_t mask)
+  {
+    size_t   modeIndex = m_size - 2;
+    uint32_t address   = m_words[modeIndex + 1];
+    m_words[modeIndex] |= CVMUSBStackFormat::modeND;
+    m_words[modeIndex + 1] = mask;
+    push(address);
+    m_haveCount = true;
+  }
+
+  // Same splitting as CVMUSBReadoutList::addBlockRead.
+
+  constexpr void addBlockRead(uint32_t base, size_t transfers, uint32_t startingMode, size_t width)
+  {
+    using namespace CVMUSBStackFormat;
+
+    uint32_t notlong    = (width < sizeof(uint32_t)) ? addrNotLong : 0;
+    size_t   blockXfers = blockBytes/width;
+
+    if ((base & 0xff) != 0) {
+      size_t aligningTransfers = (blockBytes - (base & 0xff))/width;
+      if (transfers < aligningTransfers) aligningTransfers = transfers;
+      push(startingMode | (aligningTransfers << modeBLTShift));
+      push(base | notlong);
+      base      += aligningTransfers * width;
+      transfers -= aligningTransfers;
+    }
+    if (transfers == 0) return;
+
+    size_t fullBlocks   = transfers/blockXfers;
+    size_t partialBlock = transfers % blockXfers;
+
+    if (fullBlocks) {
+      push(startingMode | modeMB | (blockXfers << modeBLTShift));
+      push(fullBlocks);
+      push(base | notlong);
+      if ((startingMode & modeNA) == 0) {
+	base += fullBlocks * blockBytes;
+      }
+    }
+    if (partialBlock) {
+      push(startingMode | (partialBlock << modeBLTShift));
+      push(base | notlong);
+    }
+  }
+};
+
+#endif
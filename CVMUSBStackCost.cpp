@@ -0,0 +1,255 @@
+/*
+    Implementation of the CVMUSBStackCost class.
+*/
+
+#include "CVMUSBStackCost.h"
+#include "CVMUSBListDecoder.h"
+#include "CVMUSBStackFormat.h"
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+static const size_t nFitted(7);         // Parameters calibrate() fits.
+
+/*!
+   Nominal timings.  These are the order of magnitude numbers from the
+   VM-USB and VME specifications, good enough to compare stacks with each
+   other.  Calibrate against the crate before trusting absolute rates.
+*/
+CVMUSBStackCost::Timing::Timing() :
+  perLine(0.05),
+  singleCycle(0.40),
+  registerAccess(0.20),
+  blockSetup(0.40),
+  perBltWord(0.16),
+  perMbltWord(0.10),
+  perDelayClock(0.20),
+  triggerDelay(0.0),
+  usbBytesPerUs(20.0)
+{}
+
+CVMUSBStackCost::CVMUSBStackCost()
+{}
+
+CVMUSBStackCost::CVMUSBStackCost(const Timing& timing) :
+  m_timing(timing)
+{}
+
+/*!
+   Analyze a stack.
+
+   \param list        : const CVMUSBReadoutList&
+      The stack.
+   \param maskedWords : size_t
+      Words each masked count transfer is expected to move.  Their real
+      length comes from the module at run time.
+
+   \return Estimate
+*/
+CVMUSBStackCost::Estimate
+CVMUSBStackCost::estimate(const CVMUSBReadoutList& list, size_t maskedWords) const
+{
+  Estimate result = count(list, maskedWords);
+  result.stackUs    = stackTime(result);
+  result.deadTimeUs = m_timing.triggerDelay + result.stackUs;
+  result.usbUs      = result.outputBytes / m_timing.usbBytesPerUs;
+
+  double limit = std::max(result.deadTimeUs, result.usbUs);
+  result.maxTriggerRate = (limit > 0.0) ? 1.0e6/limit : 0.0;
+  return result;
+}
+
+/*!
+   Fit the first seven timing parameters to measured stack execution
+   times by linear least squares (normal equations).  Each measurement
+   contributes the counts of its stack as a row; parameters the
+   measurements cannot constrain keep their current values.
+
+   \return bool
+   \retval true  - the timings were updated.
+   \retval false - nothing could be fitted (no usable measurements).
+*/
+bool
+CVMUSBStackCost::calibrate(const std::vector<Measurement>& measurements)
+{
+  double* params[nFitted] = {&m_timing.perLine, &m_timing.singleCycle, &m_timing.registerAccess,
+			     &m_timing.blockSetup, &m_timing.perBltWord, &m_timing.perMbltWord,
+			     &m_timing.perDelayClock};
+  double ata[nFitted][nFitted] = {};
+  double atb[nFitted]          = {};
+  bool   used[nFitted]         = {};
+
+  for (size_t m = 0; m < measurements.size(); m++) {
+    Estimate c = count(measurements[m].list, measurements[m].maskedWords);
+    double row[nFitted] = {double(c.lines), double(c.vmeCycles), double(c.registerOps),
+			   double(c.blocks), double(c.bltWords), double(c.mbltWords),
+			   double(c.delayClocks)};
+    for (size_t i = 0; i < nFitted; i++) {
+      if (row[i] != 0.0) used[i] = true;
+      atb[i] += row[i] * measurements[m].measuredUs;
+      for (size_t j = 0; j < nFitted; j++) ata[i][j] += row[i] * row[j];
+    }
+  }
+
+  // Parameters no measurement exercises are pinned to their current value.
+
+  for (size_t i = 0; i < nFitted; i++) {
+    if (!used[i]) {
+      for (size_t j = 0; j < nFitted; j++) ata[i][j] = ata[j][i] = 0.0;
+      ata[i][i] = 1.0;
+      atb[i]    = *params[i];
+    }
+  }
+
+  // Gauss-Jordan elimination with partial pivoting.
+
+  for (size_t col = 0; col < nFitted; col++) {
+    size_t pivot = col;
+    for (size_t r = col + 1; r < nFitted; r++) {
+      if (std::fabs(ata[r][col]) > std::fabs(ata[pivot][col])) pivot = r;
+    }
+    if (std::fabs(ata[pivot][col]) < 1.0e-12) return false;    // Degenerate.
+    if (pivot != col) {
+      for (size_t j = 0; j < nFitted; j++) std::swap(ata[col][j], ata[pivot][j]);
+      std::swap(atb[col], atb[pivot]);
+    }
+    for (size_t r = 0; r < nFitted; r++) {
+      if (r == col) continue;
+      double f = ata[r][col] / ata[col][col];
+      for (size_t j = 0; j < nFitted; j++) ata[r][j] -= f * ata[col][j];
+      atb[r] -= f * atb[col];
+    }
+  }
+  for (size_t i = 0; i < nFitted; i++) {
+    double value = atb[i] / ata[i][i];
+    *params[i]   = (value > 0.0) ? value : 0.0;       // Negative times are fit noise.
+  }
+  return true;
+}
+
+/*!
+   Write the timings as name value lines that readCalibration accepts.
+*/
+void
+CVMUSBStackCost::writeCalibration(std::ostream& str) const
+{
+  str << "perLine "        << m_timing.perLine        << "\n"
+      << "singleCycle "    << m_timing.singleCycle    << "\n"
+      << "registerAccess " << m_timing.registerAccess << "\n"
+      << "blockSetup "     << m_timing.blockSetup     << "\n"
+      << "perBltWord "     << m_timing.perBltWord     << "\n"
+      << "perMbltWord "    << m_timing.perMbltWord    << "\n"
+      << "perDelayClock "  << m_timing.perDelayClock  << "\n"
+      << "triggerDelay "   << m_timing.triggerDelay   << "\n"
+      << "usbBytesPerUs "  << m_timing.usbBytesPerUs  << "\n";
+}
+/*!
+   Read timings written by writeCalibration.  Unknown names are skipped,
+   missing ones keep their value.
+   \return bool - false if the stream had a malformed line.
+*/
+bool
+CVMUSBStackCost::readCalibration(std::istream& str)
+{
+  std::string name;
+  double      value;
+  while (str >> name) {
+    if (!(str >> value)) return false;
+    if      (name == "perLine")        m_timing.perLine        = value;
+    else if (name == "singleCycle")    m_timing.singleCycle    = value;
+    else if (name == "registerAccess") m_timing.registerAccess = value;
+    else if (name == "blockSetup")     m_timing.blockSetup     = value;
+    else if (name == "perBltWord")     m_timing.perBltWord     = value;
+    else if (name == "perMbltWord")    m_timing.perMbltWord    = value;
+    else if (name == "perDelayClock")  m_timing.perDelayClock  = value;
+    else if (name == "triggerDelay")   m_timing.triggerDelay   = value;
+    else if (name == "usbBytesPerUs")  m_timing.usbBytesPerUs  = value;
+  }
+  return true;
+}
+
+/*!
+   Print an estimate.
+*/
+void
+CVMUSBStackCost::Estimate::dump(std::ostream& str) const
+{
+  str << "Stack lines: "     << lines
+      << "  VME cycles: "    << vmeCycles
+      << "  register ops: "  << registerOps
+      << "  blocks: "        << blocks
+      << "  BLT words: "     << bltWords
+      << "  MBLT words: "    << mbltWords
+      << "  delay clocks: "  << delayClocks << "\n"
+      << "Stack time: "      << stackUs    << "us"
+      << "  dead time: "     << deadTimeUs << "us"
+      << "  USB: "           << outputBytes << " bytes (" << usbUs << "us)"
+      << "  max trigger rate: " << maxTriggerRate << "Hz\n";
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Utilities:
+
+// Count the cost drivers of a stack.  Output bytes are per execution and
+// include the 16 bit event header, rounded up to 32 bits (align32 mode).
+
+CVMUSBStackCost::Estimate
+CVMUSBStackCost::count(const CVMUSBReadoutList& list, size_t maskedWords) const
+{
+  Estimate e = {list.size(), 0, 0, 0, 0, 0, 0, sizeof(uint16_t), 0.0, 0.0, 0.0, 0.0};
+  std::vector<CVMUSBListDecoder::Operation> ops = CVMUSBListDecoder::decode(list);
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    const CVMUSBListDecoder::Operation& op = ops[i];
+    switch (op.type) {
+    case CVMUSBListDecoder::RegisterRead:
+      e.registerOps++;
+      e.outputBytes += sizeof(uint32_t);
+      break;
+    case CVMUSBListDecoder::RegisterWrite:
+      e.registerOps++;
+      break;
+    case CVMUSBListDecoder::VMERead:
+      e.vmeCycles++;
+      e.outputBytes += op.width;
+      break;
+    case CVMUSBListDecoder::VMEWrite:
+      e.vmeCycles++;
+      break;
+    case CVMUSBListDecoder::BlockRead:
+    case CVMUSBListDecoder::BlockWrite:
+      {
+	size_t words  = op.numberData ? maskedWords : op.transfers * op.blocks;
+	size_t perBlk = CVMUSBStackFormat::blockBytes / op.width;
+	e.blocks     += op.numberData ? (words + perBlk - 1)/perBlk : op.blocks;
+	if (op.width == sizeof(uint64_t)) {
+	  e.mbltWords += words;
+	} else {
+	  e.bltWords  += words;
+	}
+	if (op.type == CVMUSBListDecoder::BlockRead) e.outputBytes += words * op.width;
+      }
+      break;
+    case CVMUSBListDecoder::Marker:
+      e.outputBytes += sizeof(uint16_t);
+      break;
+    case CVMUSBListDecoder::Delay:
+      e.delayClocks += op.data;
+      break;
+    }
+  }
+  e.outputBytes = (e.outputBytes + 3) & ~static_cast<size_t>(3);
+  return e;
+}
+
+double
+CVMUSBStackCost::stackTime(const Estimate& c) const
+{
+  return c.lines       * m_timing.perLine +
+         c.vmeCycles   * m_timing.singleCycle +
+         c.registerOps * m_timing.registerAccess +
+         c.blocks      * m_timing.blockSetup +
+         c.bltWords    * m_timing.perBltWord +
+         c.mbltWords   * m_timing.perMbltWord +
+         c.delayClocks * m_timing.perDelayClock;
+}
@@ -0,0 +1,94 @@
+/*
+    Execution cost model for VM-USB stacks.
+
+    Decodes a CVMUSBReadoutList and estimates how long the VM-USB takes to
+    run it once, how many bytes it adds to the USB output stream, and from
+    that the dead time per trigger and the highest sustainable trigger
+    rate.  The timing parameters default to nominal values and can be
+    fitted to measurements taken on the real crate (see calibrate()).
+*/
+
+#ifndef CVMUSBSTACKCOST_H
+#define CVMUSBSTACKCOST_H
+
+#include "CVMUSBReadoutList.h"
+#include <stddef.h>
+#include <vector>
+#include <iostream>
+
+class CVMUSBStackCost
+{
+public:
+  /*!
+     Timing parameters, all in microseconds except usbBytesPerUs.
+     The first seven are the ones calibrate() fits.
+  */
+  struct Timing {
+    double perLine;             // Fetching/decoding one stack line.
+    double singleCycle;         // One single shot VME cycle.
+    double registerAccess;      // One VM-USB internal register access.
+    double blockSetup;          // Address phase of a block transfer (per block).
+    double perBltWord;          // One D32 (or D16) block transfer cycle.
+    double perMbltWord;         // One D64 block transfer cycle.
+    double perDelayClock;       // One addDelay clock.
+
+    double triggerDelay;        // Readout trigger delay (DAQ settings register).
+    double usbBytesPerUs;       // Sustained USB bulk throughput.
+
+    Timing();
+  };
+
+  /*!
+     Result of analyzing a stack.
+  */
+  struct Estimate {
+    size_t lines;
+    size_t vmeCycles;           // Single shot VME cycles.
+    size_t registerOps;
+    size_t blocks;              // Block transfer address phases.
+    size_t bltWords;
+    size_t mbltWords;
+    size_t delayClocks;
+    size_t outputBytes;         // Added to the event per execution.
+
+    double stackUs;             // Stack execution time.
+    double deadTimeUs;          // Trigger delay + stack execution.
+    double usbUs;               // Time to ship outputBytes over USB.
+    double maxTriggerRate;      // Hz; limited by dead time or USB bandwidth.
+
+    void dump(std::ostream& str) const;
+  };
+
+  /*!
+     A measured stack execution, for calibrate().  maskedWords is the
+     number of words the masked count transfers actually moved.
+  */
+  struct Measurement {
+    CVMUSBReadoutList list;
+    size_t            maskedWords;
+    double            measuredUs;
+  };
+
+private:
+  Timing m_timing;
+
+public:
+  CVMUSBStackCost();
+  CVMUSBStackCost(const Timing& timing);
+
+  const Timing& getTiming() const { return m_timing; }
+  void          setTiming(const Timing& timing) { m_timing = timing; }
+
+  Estimate estimate(const CVMUSBReadoutList& list, size_t maskedWords = 0) const;
+
+  bool calibrate(const std::vector<Measurement>& measurements);
+  void writeCalibration(std::ostream& str) const;
+  bool readCalibration(std::istream& str);
+
+  // Utilities:
+private:
+  Estimate count(const CVMUSBReadoutList& list, size_t maskedWords) const;
+  double   stackTime(const Estimate& counts) const;
+};
+
+#endif
@@ -0,0 +1,53 @@
+/*
+    Bit layout of the VM-USB stack lines.  These used to be private to
+    CVMUSBReadoutList.cpp; they live here so that everything that builds
+    or decodes stacks (CVMUSBReadoutList, CVMUSBStackBuilder and the stack
+    analysis code) agrees on a single definition.
+
+    See section 4 of the Wiener VM-USB manual for the meaning of the bits.
+*/
+
+#ifndef CVMUSBSTACKFORMAT_H
+#define CVMUSBSTACKFORMAT_H
+
+#include <stdint.h>
+
+namespace CVMUSBStackFormat {
+
+  // The following are bits in the mode word that leads off each stack line.
+  //
+
+  static const uint32_t modeAMMask(0x3f); // Address modifier bits.
+  static const uint32_t modeAMShift(0);
+
+  static const uint32_t modeDSMask(0xc0);
+  static const uint32_t modeDSShift(6);
+
+  static const uint32_t modeNW(0x100);
+  static const uint32_t modeNA(0x400);
+  static const uint32_t modeMB(0x800);
+  static const uint32_t modeSLF(0x1000);
+  static const uint32_t modeMarker(0x2000);
+  static const uint32_t modeDelay(0x8000);
+  static const uint32_t modeBE(0x10000);
+  static const uint32_t modeHD(0x20000);
+  static const uint32_t modeND(0x40000);
+  static const uint32_t modeHM(0x80000);
+  static const uint32_t modeNTMask(0xc00000);
+  static const uint32_t modeNTShift(22);
+  static const uint32_t modeBLTMask(0xff000000);
+  static const uint32_t modeBLTShift(24);
+
+  static const uint32_t modeDelayMask(0xff);   // Delay clocks in a delay line.
+
+  // The following bit must be set in the address stack line for non long
+  // word transfers:
+
+  static const uint32_t addrNotLong(1);
+
+  // Block transfers are broken into blocks of this many bytes:
+
+  static const uint32_t blockBytes(256);
+}
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * Implementation of the CVMUSBStackMemory class.
+ */
+
+#include "CVMUSBStackMemory.h"
+#include "CVMUSB.h"
+#include "CVMUSBReadoutList.h"
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+
+/*!
+   A new stack memory is empty.
+*/
+CVMUSBStackMemory::CVMUSBStackMemory() :
+  m_laidOut(false)
+{}
+
+/*!
+   Register a stack.  The list is referenced, not copied, so it must stay
+   alive until it has been loaded.
+
+   \param stackId : uint8_t
+      VM-USB stack number 0-7.
+   \param list    : CVMUSBReadoutList&
+      The stack to load.
+
+   \throw std::runtime_error if the id is invalid, already in use, or
+          the stacks no longer fit in stack memory.
+*/
+void
+CVMUSBStackMemory::add(uint8_t stackId, CVMUSBReadoutList& list)
+{
+  if (stackId >= maxStacks) {
+    throw std::runtime_error("CVMUSBStackMemory::add - stack id must be 0-7");
+  }
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    if (m_stacks[i].stackId == stackId) {
+      char msg[100];
+      sprintf(msg, "CVMUSBStackMemory::add - stack %d is already allocated", stackId);
+      throw std::runtime_error(msg);
+    }
+  }
+  if (list.size() == 0) {
+    throw std::runtime_error("CVMUSBStackMemory::add - refusing to load an empty stack");
+  }
+
+  size_t size = footprint(list);
+  if (used() + size > memorySize) {
+    char msg[150];
+    sprintf(msg, "CVMUSBStackMemory::add - stack %d needs %lu words, only %lu left",
+	    stackId, static_cast<unsigned long>(size), static_cast<unsigned long>(available()));
+    throw std::runtime_error(msg);
+  }
+
+  Allocation stack = {stackId, 0, size, &list};
+  m_stacks.push_back(stack);
+  m_laidOut = false;
+}
+/*!
+   Drop a stack from the layout.  Unknown ids are ignored.
+*/
+void
+CVMUSBStackMemory::remove(uint8_t stackId)
+{
+  for (std::vector<Allocation>::iterator p = m_stacks.begin(); p != m_stacks.end(); ++p) {
+    if (p->stackId == stackId) {
+      m_stacks.erase(p);
+      m_laidOut = false;
+      return;
+    }
+  }
+}
+/*!
+   Forget all stacks.
+*/
+void
+CVMUSBStackMemory::clear()
+{
+  m_stacks.clear();
+  m_laidOut = false;
+}
+
+/*!
+   Assign offsets.  Stacks are packed in stack id order starting at offset 0,
+   so the event stack (0) always sits at the bottom of stack memory.  The
+   sizes of the lists are re-evaluated in case they grew after add().
+
+   \throw std::runtime_error if the stacks do not fit.
+*/
+void
+CVMUSBStackMemory::layout()
+{
+  std::sort(m_stacks.begin(), m_stacks.end(),
+	    [](const Allocation& a, const Allocation& b) { return a.stackId < b.stackId; });
+
+  off_t offset = 0;
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    m_stacks[i].size   = footprint(*m_stacks[i].pList);
+    m_stacks[i].offset = offset;
+    offset            += m_stacks[i].size;
+  }
+  if (static_cast<size_t>(offset) > memorySize) {
+    char msg[100];
+    sprintf(msg, "CVMUSBStackMemory::layout - stacks need %ld words, stack memory is %lu",
+	    static_cast<long>(offset), static_cast<unsigned long>(memorySize));
+    throw std::runtime_error(msg);
+  }
+  m_laidOut = true;
+}
+
+/*!
+   Lay out and load every stack.  Each stack is one bulk write, the VM-USB
+   takes a single stack id and offset per load packet so that is as few
+   writes as the hardware allows.  With verify set the stacks are then read
+   back and compared.
+
+   \throw std::runtime_error if a load fails or the verification does not match.
+*/
+void
+CVMUSBStackMemory::load(CVMUSB& vmusb, bool verify)
+{
+  if (!m_laidOut) layout();
+
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    Allocation& stack = m_stacks[i];
+    int status = vmusb.loadList(stack.stackId, *stack.pList, stack.offset);
+    if (status < 0) {
+      char msg[100];
+      sprintf(msg, "CVMUSBStackMemory::load - loading stack %d failed", stack.stackId);
+      throw std::runtime_error(msg);
+    }
+  }
+
+  if (verify && !this->verify(vmusb)) {
+    throw std::runtime_error("CVMUSBStackMemory::load - stack readback does not match");
+  }
+}
+
+/*!
+   Read every stack back from the VM-USB and compare it with the list
+   that was loaded.
+
+   \return bool
+   \retval true  - all stacks match.
+   \retval false - a stack differs or could not be read.
+*/
+bool
+CVMUSBStackMemory::verify(CVMUSB& vmusb)
+{
+  if (!m_laidOut) layout();
+
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    Allocation&           stack = m_stacks[i];
+    std::vector<uint32_t> readBack;
+    int status = vmusb.readList(stack.stackId, stack.pList->size(), stack.offset, readBack);
+    if ((status < 0) || (readBack != stack.pList->get())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*!
+   The current allocations, laid out.
+*/
+const std::vector<CVMUSBStackMemory::Allocation>&
+CVMUSBStackMemory::allocations()
+{
+  if (!m_laidOut) layout();
+  return m_stacks;
+}
+/*!
+   Offset of a stack in stack memory.
+   \throw std::runtime_error if the stack has not been added.
+*/
+off_t
+CVMUSBStackMemory::offset(uint8_t stackId)
+{
+  if (!m_laidOut) layout();
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    if (m_stacks[i].stackId == stackId) return m_stacks[i].offset;
+  }
+  throw std::runtime_error("CVMUSBStackMemory::offset - no such stack");
+}
+/*!
+   Words of stack memory claimed by the registered stacks.
+*/
+size_t
+CVMUSBStackMemory::used() const
+{
+  size_t total = 0;
+  for (size_t i = 0; i < m_stacks.size(); i++) {
+    total += footprint(*m_stacks[i].pList);
+  }
+  return total;
+}
+
+/*!
+   Stack memory needed by a list in 16 bit words: two words per stack line,
+   the length word, rounded up to keep the next stack longword aligned.
+*/
+size_t
+CVMUSBStackMemory::footprint(const CVMUSBReadoutList& list)
+{
+  size_t words = list.size()*sizeof(uint32_t)/sizeof(uint16_t) + 1;
+  return (words + 1) & ~static_cast<size_t>(1);
+}
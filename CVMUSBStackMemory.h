@@ -0,0 +1,75 @@
+/*
+ * This file defines the CVMUSBStackMemory class which owns the VM-USB stack memory layout.
+ * Stacks are registered by stack id, packed back to back into stack memory and loaded (and
+ * optionally verified) together, so nobody has to track list offsets by hand any more.
+ */
+
+#ifndef CVMUSBStackMemory_H
+#define CVMUSBStackMemory_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <vector>
+
+class CVMUSB;
+class CVMUSBReadoutList;
+
+/*!
+   Manages the stack memory of a VM-USB.
+
+   Offsets and sizes are in 16 bit words, which is the unit of the size and
+   offset fields of a stack load packet (see CVMUSB::listToOutPacket).
+   Each stack occupies its lines plus the length word the VM-USB keeps in
+   front of it, rounded up so that the next stack starts longword aligned.
+
+   Stack ids follow the VM-USB conventions:
+   - 0 the NIM1 triggered event stack.
+   - 1 the scaler stack.
+   - 2-7 stacks that can be bound to interrupts via the ISV registers.
+
+   Typical use:
+   \verbatim
+     CVMUSBStackMemory stacks;
+     stacks.add(0, eventList);
+     stacks.add(1, scalerList);
+     stacks.load(vmusb);      // lays out, loads and verifies
+   \endverbatim
+*/
+class CVMUSBStackMemory
+{
+public:
+  static const size_t   memorySize = 2048;   // 16 bit words of stack memory.
+  static const unsigned maxStacks  = 8;
+
+  struct Allocation {
+    uint8_t            stackId;
+    off_t              offset;               // 16 bit words.
+    size_t             size;                 // 16 bit words incl. length word.
+    CVMUSBReadoutList* pList;
+  };
+
+private:
+  std::vector<Allocation> m_stacks;
+  bool                    m_laidOut;
+
+public:
+  CVMUSBStackMemory();
+
+  void   add(uint8_t stackId, CVMUSBReadoutList& list);
+  void   remove(uint8_t stackId);
+  void   clear();
+
+  void   layout();
+  void   load(CVMUSB& vmusb, bool verify = true);
+  bool   verify(CVMUSB& vmusb);
+
+  const std::vector<Allocation>& allocations();
+  off_t  offset(uint8_t stackId);
+  size_t used() const;
+  size_t available() const { return memorySize - used(); }
+
+  static size_t footprint(const CVMUSBReadoutList& list);
+};
+
+#endif
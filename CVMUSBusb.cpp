@@ -53,11 +53,17 @@ static const int ENDPOINT_IN(0x86);
 // Timeouts:
 
 static const int DEFAULT_TIMEOUT(2000);	// ms.
+static const int FLUSH_TIMEOUT(100);    // ms, per read while flushing at open.
 
 // Retries for flushing the fifo/stopping data taking:
 
 static const int DRAIN_RETRIES(5);    // Retries.
 
+// Limits of the in-run read recovery:
+
+static const int RECOVERY_RETRIES(3);  // Halt clears before reopening.
+static const int RESYNC_READS(16);     // Buffers skipped looking for a good one.
+
 
 
 
@@ -214,8 +220,10 @@ CVMUSBusb::CVMUSBusb(struct usb_device* device) :
 */
 CVMUSBusb::~CVMUSBusb()
 {
-    usb_release_interface(m_handle, 0);
-    usb_close(m_handle);
+    if (m_handle) {               // Null if a reopen failed.
+        usb_release_interface(m_handle, 0);
+        usb_close(m_handle);
+    }
     
     delete m_pMutex;
     
@@ -230,24 +238,28 @@ CVMUSBusb::~CVMUSBusb()
  * openVMUSBUsb which has code common to us and
  * the construtor.
  *   If we can read the firmware register in the VMUSB we assume we don't need
- *   to reconnect.
+ *   to reconnect.  Without a handle (a failed reopenInterface) the device is
+ *   just opened.
  *   
  *   @return bool - true if necessary.false if not
  */
 bool
 CVMUSBusb::reconnect()
 {
-  try {
-    int fwid = readFirmwareID();
-    return false;                      // Success so don't need to reconnect.
-  }
-  catch (...) {
-    usb_release_interface(m_handle, 0);
-    usb_close(m_handle);
-    Os::usleep(1000);			// Let this all happen
-    openVMUsb();
-    return true;
+  if (m_handle) {
+    try {
+      int fwid = readFirmwareID();
+      return false;                      // Success so don't need to reconnect.
+    }
+    catch (...) {
+      usb_release_interface(m_handle, 0);
+      usb_close(m_handle);
+      m_handle = 0;
+      Os::usleep(1000);			// Let this all happen
+    }
   }
+  openVMUsb();
+  return true;
 }
 
 /*!
@@ -261,8 +273,10 @@ CVMUSBusb::reconnect()
     of the Wiener VM-USB manual for more information
     \param value : uint16_t
        The register value to write.
+    \param timeout : int
+       Write timeout in milliseconds.
  */
-void CVMUSBusb::writeActionRegister(uint16_t data) 
+void CVMUSBusb::writeActionRegister(uint16_t data, int timeout) 
 {
     CriticalSection s(*m_pMutex);
     char outPacket[100];
@@ -280,7 +294,7 @@ void CVMUSBusb::writeActionRegister(uint16_t data)
 
   int outSize = pOut - outPacket;
   int status = usb_bulk_write(m_handle, ENDPOINT_OUT, 
-      outPacket, outSize, DEFAULT_TIMEOUT);
+      outPacket, outSize, timeout);
   if (status < 0) {
     string message = "Error in usb_bulk_write, writing action register ";
     message == strerror(-status);
@@ -351,6 +365,122 @@ CVMUSBusb::executeList(CVMUSBReadoutList&     list,
 
 
 
+/*!
+   Pipelined version of executeList for a batch of immediate lists.  Up to
+   depth lists are written back to back before the first reply is read, so
+   the VM-USB always has the next list queued when it finishes one and the
+   USB round trip is paid once per batch instead of once per list.  Replies
+   come back in the order the lists were written and are matched to their
+   requests by that order.  See CVMUSB::executeLists for the status codes.
+
+   Errors are isolated as far as the protocol allows:
+   - A list that can't be written fails alone (-1); the next list is written.
+   - A reply that can't be read (-2) leaves the rest of the replies in
+     flight at an unknown position in the stream, so those requests are
+     cancelled (-3, ECANCELED), whatever is still coming in is flushed and
+     the remaining lists are executed from an empty pipe.
+
+   Requests with a readBufferSize larger than one bulk transfer wait for
+   the pipe to empty and go through executeList, since their reply may
+   take several reads.
+
+   \note This relies on each reply of an immediate list arriving in its
+          own bulk transfer, which is what the VM-USB does for replies up to
+          a bulk transfer in size.  Don't mix this with autonomous data
+          taking; buffers read here would be taken for replies.
+*/
+size_t
+CVMUSBusb::executeLists(ListRequest* pRequests, size_t nRequests, unsigned depth)
+{
+  char   buf[8192];
+  size_t pipe[maxPipelineDepth];     // Ring of in flight request indices.
+  size_t head     = 0;
+  size_t inFlight = 0;
+  size_t next     = 0;
+  size_t failures = 0;
+
+  depth = std::max(1u, std::min(depth, maxPipelineDepth));
+  for (size_t i = 0; i < nRequests; i++) {
+    pRequests[i].bytesRead = 0;
+    pRequests[i].status    = 0;
+    pRequests[i].error     = 0;
+  }
+
+  CriticalSection s(*m_pMutex);
+  while ((next < nRequests) || inFlight) {
+
+    // Fill the pipe:
+
+    while ((next < nRequests) && (inFlight < depth)) {
+      ListRequest& request(pRequests[next]);
+      if (request.readBufferSize > sizeof(buf)) {
+        if (inFlight) break;        // Let the pipe empty first.
+        int status = executeList(*request.pList, request.pReadBuffer,
+                                 request.readBufferSize, &request.bytesRead);
+        if (status < 0) {
+          request.status = status;
+          request.error  = errno;
+          failures++;
+        }
+        next++;
+        continue;
+      }
+      size_t    outSize;
+      uint16_t* outPacket = listToOutPacket(TAVcsWrite | TAVcsIMMED,
+                                            *request.pList, &outSize);
+      int status = usb_bulk_write(m_handle, ENDPOINT_OUT,
+                                  reinterpret_cast<char*>(outPacket), outSize,
+                                  DEFAULT_TIMEOUT);
+      delete []outPacket;
+      if (status < 0) {
+        request.status = -1;
+        request.error  = -status;
+        failures++;
+      }
+      else {
+        pipe[(head + inFlight) % maxPipelineDepth] = next;
+        inFlight++;
+      }
+      next++;
+    }
+    if (!inFlight) continue;
+
+    // Collect the oldest reply:
+
+    ListRequest& request(pRequests[pipe[head]]);
+    head = (head + 1) % maxPipelineDepth;
+    inFlight--;
+
+    int status = usb_bulk_read(m_handle, ENDPOINT_IN, buf, sizeof(buf), m_timeout);
+    if (status >= 0) {
+      request.bytesRead = std::min(static_cast<size_t>(status), request.readBufferSize);
+      std::copy(buf, buf + request.bytesRead,
+                reinterpret_cast<char*>(request.pReadBuffer));
+      continue;
+    }
+    request.status = -2;
+    request.error  = -status;
+    failures++;
+
+    // The stream position is lost; cancel the rest and resynchronize:
+
+    while (inFlight) {
+      ListRequest& cancelled(pRequests[pipe[head]]);
+      head = (head + 1) % maxPipelineDepth;
+      inFlight--;
+      cancelled.status = -3;
+      cancelled.error  = ECANCELED;
+      failures++;
+    }
+    int retriesLeft = DRAIN_RETRIES * maxPipelineDepth;
+    while ((retriesLeft-- > 0) &&
+           (usb_bulk_read(m_handle, ENDPOINT_IN, buf, sizeof(buf), FLUSH_TIMEOUT) > 0))
+      ;
+  }
+  return failures;
+}
+
+
 /*!
    Load a list into the VM-USB for later execution.
    It is the callers responsibility to:
@@ -372,6 +502,9 @@ CVMUSBusb::executeList(CVMUSBReadoutList&     list,
       The offset in list memory at which the list is loaded.
       Question for the Wiener/Jtec guys... is this offset a byte or long
       offset... I'm betting it's a longword offset.
+
+   \note CVMUSBStackMemory does this bookkeeping for a set of stacks and is
+         the preferred way to load more than one list.
 */
 int
 CVMUSBusb::loadList(uint8_t  listNumber, CVMUSBReadoutList& list, off_t listOffset)
@@ -400,6 +533,61 @@ CVMUSBusb::loadList(uint8_t  listNumber, CVMUSBReadoutList& list, off_t listOffs
 
 
   
+}
+/*!
+   Read a list back out of the VM-USB stack memory.  This is the
+   same packet as a stack load without the write bit and without the
+   stack body.  The VM-USB answers with the length word it stored
+   followed by the stack lines.
+
+   \param listNumber : uint8_t
+      Number of the list to read (0-7).
+   \param longwords  : size_t
+      Number of stack lines to read back.
+   \param listOffset : off_t
+      Offset at which the list was loaded.
+   \param list       : std::vector<uint32_t>&
+      Receives the stack lines.
+
+   \return int
+   \retval  0  - Success.
+   \retval -1  - The usb_bulk_write failed.
+   \retval -2  - The usb_bulk_read failed.
+   \retval -3  - The reply was shorter than the requested list.
+*/
+int
+CVMUSBusb::readList(uint8_t listNumber, size_t longwords, off_t listOffset,
+                    std::vector<uint32_t>& list)
+{
+  uint16_t ta = TAVcsSel;
+  if (listNumber & 1)  ta |= TAVcsID0;
+  if (listNumber & 2)  ta |= TAVcsID1;
+  if (listNumber & 4)  ta |= TAVcsID2;
+
+  uint16_t  outPacket[3];
+  void*     p = outPacket;
+  size_t    listShorts = longwords*sizeof(uint32_t)/sizeof(uint16_t);
+  p = addToPacket16(p, ta);
+  p = addToPacket16(p, listShorts+1);
+  p = addToPacket16(p, listOffset);
+
+  std::vector<uint8_t> reply((listShorts+1)*sizeof(uint16_t));
+  list.clear();
+  int status = transaction(outPacket, sizeof(outPacket), reply.data(), reply.size());
+  if (status < 0) {
+    return status;
+  }
+  if (static_cast<size_t>(status) < reply.size()) {
+    return -3;
+  }
+
+  void* pReply = reply.data() + sizeof(uint16_t);    // skip the length word.
+  for (size_t i = 0; i < longwords; i++) {
+    uint32_t line;
+    pReply = getFromPacket32(pReply, &line);
+    list.push_back(line);
+  }
+  return 0;
 }
 /*!
   Execute a bulk read for the user.  The user will need to do this
@@ -423,6 +611,11 @@ int
 CVMUSBusb::usbRead(void* data, size_t bufferSize, size_t* transferCount, int timeout)
 {
   CriticalSection s(*m_pMutex);
+  if (!m_handle) {                      // A reopen failed, see recoveringRead.
+    *transferCount = 0;
+    errno = ENODEV;
+    return -1;
+  }
   int status = usb_bulk_read(m_handle, ENDPOINT_IN,
 			     static_cast<char*>(data), bufferSize,
 			     timeout);
@@ -438,6 +631,78 @@ CVMUSBusb::usbRead(void* data, size_t bufferSize, size_t* transferCount, int tim
   return status;
 }
 
+/*!
+   Read a data buffer like usbRead, but ride out USB errors in the middle
+   of a run instead of failing.  Recovery goes in tiers, each tried only if
+   the one before did not help:
+
+   1. Clear the halt on the IN endpoint and retry the read.
+   2. Resynchronize: once reads work again, throw away buffers until one
+      passes validBuffer, since the failed transfer may have left the tail
+      of a buffer in the pipe.
+   3. Close and reopen the interface, without the usb_reset and DAQ stop
+      of reconnect(), so the VM-USB keeps taking data, then resynchronize.
+
+   What each tier did and what it cost is counted in recoveryStatistics().
+   Buffers are only checked after an error, so a healthy stream costs the
+   same as usbRead.  If even reopening fails the interface stays closed:
+   later calls go straight to tier 3, and reconnect(), which ends the run,
+   opens it from scratch.
+
+   \return int - as usbRead: 0 with the buffer (or nothing if the read
+                 timed out), -1 if recovery failed, reason in errno.
+*/
+int
+CVMUSBusb::recoveringRead(void* data, size_t bufferSize, size_t* transferCount, int timeout)
+{
+  CriticalSection s(*m_pMutex);
+  int status = usbRead(data, bufferSize, transferCount, timeout);
+  if ((status == 0) || (errno == ETIMEDOUT) || (errno == EAGAIN)) {
+    return status;
+  }
+  m_recoveryStats.errors++;
+
+  if (m_handle) {
+
+    // Tier 1: clear the halt and retry.
+
+    for (int i = 0; (i < RECOVERY_RETRIES) && (status < 0) &&
+                    (errno != ETIMEDOUT) && (errno != EAGAIN); i++) {
+      usb_clear_halt(m_handle, ENDPOINT_IN);
+      m_recoveryStats.haltsCleared++;
+      status = usbRead(data, bufferSize, transferCount, timeout);
+    }
+
+    // Tier 2: pick the stream up at the next whole buffer.
+
+    status = resynchronize(data, bufferSize, transferCount, timeout, status);
+    if ((status == 0) || (errno == ETIMEDOUT) || (errno == EAGAIN)) {
+      return status;
+    }
+  }
+
+  // Tier 3: reopen the interface and resynchronize again.
+
+  try {
+    reopenInterface();
+    m_recoveryStats.reopens++;
+    status = usbRead(data, bufferSize, transferCount, timeout);
+    status = resynchronize(data, bufferSize, transferCount, timeout, status);
+    if ((status == 0) || (errno == ETIMEDOUT) || (errno == EAGAIN)) {
+      return status;
+    }
+  }
+  catch (...) {
+    errno = ENODEV;
+  }
+  int error = errno;
+  m_recoveryStats.unrecovered++;
+  *transferCount = 0;
+  errno = error;
+  return -1;
+}
+
+
 /*! 
    Set a new transaction timeout.  The transaction timeout is used for
    all usb transactions but usbRead where the user has full control.
@@ -713,7 +978,7 @@ CVMUSBusb::openVMUsb()
         std::cerr << "** Warning - not able to stop data taking VM-USB may need to be power cycled\n";
     }
     
-    while(usbRead(buffer, sizeof(buffer), &bytesRead) == 0) {
+    while(usbRead(buffer, sizeof(buffer), &bytesRead, FLUSH_TIMEOUT) == 0) {
         fprintf(stderr, "Flushing VMUSB Buffer\n");
     }
     
@@ -728,6 +993,71 @@ CVMUSBusb::openVMUsb()
 }
 
 
+/*
+ * Drop and reclaim the interface without resetting the VM-USB or touching
+ * its registers, so a run survives it.
+ *
+ * @throw std::string if the device can't be found or claimed again.
+ */
+void
+CVMUSBusb::reopenInterface()
+{
+    if (m_handle) {
+        usb_release_interface(m_handle, 0);
+        usb_close(m_handle);
+        m_handle = 0;                 // Stays so if what follows throws.
+        Os::usleep(1000);
+    }
+
+    enumerateAndIdentify();
+    m_handle = usb_open(m_device);
+    if (!m_handle) {
+        throw std::string("CVMUSBusb::reopenInterface - unable to open the device");
+    }
+    usb_set_configuration(m_handle, 1);
+    int status = usb_claim_interface(m_handle, 0);
+    if (status < 0) {
+        std::string msg("CVMUSBusb::reopenInterface - failed to claim the interface: ");
+        msg += strerror(-status);
+        throw msg;
+    }
+}
+
+/*
+ * Tier 2 of recoveringRead.  status and *transferCount are those of the
+ * read just done; reads go on until a buffer passes validBuffer, a read
+ * times out (nothing left that could be stale) or fails, or RESYNC_READS
+ * buffers have been skipped.
+ */
+int
+CVMUSBusb::resynchronize(void* data, size_t bufferSize, size_t* transferCount,
+                         int timeout, int status)
+{
+  bool doubleHeader = (getShadowRegisters().globalMode &
+                       GlobalModeRegister::doubleHeader) != 0;
+  int  skipped      = 0;
+
+  while (true) {
+    if ((status < 0) && (errno != ETIMEDOUT) && (errno != EAGAIN)) {
+      return status;                             // Still broken.
+    }
+    if ((status < 0) || (*transferCount == 0) ||
+        validBuffer(data, *transferCount, doubleHeader)) {
+      if (skipped) m_recoveryStats.resyncs++;
+      return status;
+    }
+    if (skipped == RESYNC_READS) {
+      *transferCount = 0;
+      errno = EPROTO;
+      return -1;
+    }
+    skipped++;
+    m_recoveryStats.buffersSkipped++;
+    m_recoveryStats.bytesSkipped += *transferCount;
+    status = usbRead(data, bufferSize, transferCount, timeout);
+  }
+}
+
 void CVMUSBusb::initializeShadowRegisters()
 {
     readGlobalMode();
@@ -98,7 +98,7 @@ public:
     // List operations.
 
 public:
-    void writeActionRegister(uint16_t value);
+    void writeActionRegister(uint16_t value, int timeout = 2000);
     void  writeRegister(unsigned int address, uint32_t data);
     uint32_t readRegister(unsigned int address);
 
@@ -106,9 +106,13 @@ public:
 		    void*               pReadBuffer,
 		    size_t              readBufferSize,
 		    size_t*             bytesRead);
+    size_t executeLists(ListRequest* pRequests, size_t nRequests,
+                        unsigned depth = 4);
     
     int loadList(uint8_t listNumber, CVMUSBReadoutList& list,
                  off_t listOffset = 0);
+    int readList(uint8_t listNumber, size_t longwords, off_t listOffset,
+                 std::vector<uint32_t>& list);
       
 
     // Once the interface is in DAQ auntonomous mode, the application
@@ -116,6 +120,8 @@ public:
 
     int usbRead(void* data, size_t bufferSize, size_t* transferCount,
 		            int timeout = 2000);
+    int recoveringRead(void* data, size_t bufferSize, size_t* transferCount,
+                       int timeout = 2000);
 
     // Other administrative functions:
 
@@ -123,6 +129,9 @@ public:
     int   getDefaultTimeout() const {return m_timeout;}
 private:
     void openVMUsb();
+    void reopenInterface();
+    int  resynchronize(void* data, size_t bufferSize, size_t* transferCount,
+                       int timeout, int status);
 
     int transaction(void* writePacket, size_t writeSize,
 		                void* readPacket,  size_t readSize);
@@ -0,0 +1,242 @@
+/*
+ * Implementation of the CZeroSuppressor class.
+ */
+
+#include "CZeroSuppressor.h"
+#include "CMesytecDecoder.h"
+#include "CMesytecCodec.h"
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*!
+   \param next : CVMUSBBufferParser::Handler&
+      Receives the events that survive.  Must outlive this object.
+
+   All thresholds start at zero, so out of the box only events without
+   any hits are dropped.
+*/
+CZeroSuppressor::CZeroSuppressor(CVMUSBBufferParser::Handler& next) :
+  m_next(next),
+  m_stacks(1 << 0),
+  m_dropEmpty(true)
+{
+  clearThresholds();
+  clearStatistics();
+  for (unsigned i = 0; i < 256; i++) m_channelMask[i] = 0x1f;
+}
+
+/*!
+   Set one channel's threshold.  Data words with a value below it are
+   removed.
+
+   \param moduleId  : uint8_t
+      The module id in the module's headers.
+   \param channel   : unsigned
+      0 to maxChannels-1, others are ignored.
+   \param threshold : uint16_t
+*/
+void
+CZeroSuppressor::setThreshold(uint8_t moduleId, unsigned channel, uint16_t threshold)
+{
+  if (channel < maxChannels) m_thresholds[moduleId][channel] = threshold;
+}
+
+/*!
+   Set all the thresholds of a module.
+
+   \param moduleId    : uint8_t
+   \param pThresholds : const uint16_t*
+      nChannels thresholds, channel 0 first.
+   \param nChannels   : unsigned
+      Channels past it keep their thresholds.
+*/
+void
+CZeroSuppressor::setThresholds(uint8_t moduleId, const uint16_t* pThresholds, unsigned nChannels)
+{
+  if (nChannels > maxChannels) nChannels = maxChannels;
+  memcpy(m_thresholds[moduleId], pThresholds, nChannels*sizeof(uint16_t));
+}
+
+/*!
+   Set the width of a module's channel field, CModuleDriver::channelBits
+   (5 by default, 6 for the MTDC).
+*/
+void
+CZeroSuppressor::setChannelBits(uint8_t moduleId, unsigned bits)
+{
+  if ((1u << bits) > maxChannels) bits = 6;
+  m_channelMask[moduleId] = (1u << bits) - 1;
+}
+
+void
+CZeroSuppressor::clearThresholds()
+{
+  memset(m_thresholds, 0, sizeof(m_thresholds));
+}
+
+/*!
+   Select whether a stack's events are suppressed or passed on unchanged.
+*/
+void
+CZeroSuppressor::suppress(uint8_t stackId, bool enable)
+{
+  if (stackId >= CVMUSBBufferParser::maxStacks) return;
+  if (enable) {
+    m_stacks |= (1 << stackId);
+  }
+  else {
+    m_stacks &= ~(1 << stackId);
+  }
+}
+
+/*!
+   Suppress one event and pass it on unless nothing is left of it.
+*/
+void
+CZeroSuppressor::event(uint8_t stackId, const uint16_t* pBody, size_t nWords)
+{
+  if ((stackId >= CVMUSBBufferParser::maxStacks) || !(m_stacks & (1 << stackId))) {
+    m_next.event(stackId, pBody, nWords);
+    return;
+  }
+  m_stats.eventsIn++;
+  m_stats.bytesIn += nWords*sizeof(uint16_t);
+
+  unsigned prefix = CMesytecCodec::prefixLength(pBody, nWords);
+  size_t   nLongs = (nWords - prefix)/2;
+  m_in.resize(nLongs);
+  m_out.resize(nLongs);
+  if (nLongs) memcpy(&m_in[0], pBody + prefix, nLongs*sizeof(uint32_t));
+
+  size_t nOut  = 0;
+  size_t nData = 0;
+  size_t nKept = 0;
+  size_t i     = 0;
+  while (i < nLongs) {
+    uint32_t word = m_in[i];
+    if (CMesytecDecoder::isHeader(word)) {
+      size_t length = std::min(CMesytecDecoder::eventLength(word), nLongs - i - 1);
+      size_t at     = nOut++;
+      uint8_t id    = CMesytecDecoder::moduleId(word);
+      size_t kept   = select(&m_in[i + 1], length, m_thresholds[id], m_channelMask[id],
+                             &m_out[nOut], nData, nKept);
+      m_out[at] = (word & ~CMesytecDecoder::headerLenMask) | kept;
+      nOut += kept;
+      i    += 1 + length;
+    }
+    else {
+      if ((word != CMesytecDecoder::fillWord) && (word != CMesytecDecoder::berrWord)) {
+        m_out[nOut++] = word;
+      }
+      i++;
+    }
+  }
+  m_stats.hitsIn  += nData;
+
+  if (m_dropEmpty && !nKept) {
+    m_stats.emptyEvents++;
+    return;
+  }
+
+  size_t tail = (nWords - prefix) % 2;
+  m_event.resize(prefix + 2*nOut + tail);
+  memcpy(&m_event[0], pBody, prefix*sizeof(uint16_t));
+  if (nOut) memcpy(&m_event[prefix], &m_out[0], nOut*sizeof(uint32_t));
+  if (tail) m_event.back() = pBody[nWords - 1];
+
+  m_stats.eventsOut++;
+  m_stats.hitsOut  += nKept;
+  m_stats.bytesOut += m_event.size()*sizeof(uint16_t);
+  m_next.event(stackId, m_event.data(), m_event.size());
+}
+
+void
+CZeroSuppressor::clearStatistics()
+{
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+/*!
+   \return double - events passed on per event in, 1.0 before any.
+*/
+double
+CZeroSuppressor::eventRatio() const
+{
+  return m_stats.eventsIn ? double(m_stats.eventsOut)/m_stats.eventsIn : 1.0;
+}
+
+/*!
+   \return double - bytes passed on per byte in, 1.0 before any.
+*/
+double
+CZeroSuppressor::byteRatio() const
+{
+  return m_stats.bytesIn ? double(m_stats.bytesOut)/m_stats.bytesIn : 1.0;
+}
+
+/*!
+   Copy the words of one module event, leaving out data words below their
+   channel's threshold.  Other words are copied as they are.
+
+   \param pWords      : const uint32_t*
+      The words after the module header.
+   \param nWords      : size_t
+   \param pThresholds : const uint16_t*
+      The module's maxChannels thresholds.
+   \param channelMask : uint32_t
+      Mask of the channel field after shifting it down, at most 0x3f.
+   \param pOut        : uint32_t*
+      Room for nWords words, not overlapping pWords.  Words past the
+      returned count may be overwritten.
+   \param nData       : size_t&
+      Incremented by the data words seen.
+   \param nKept       : size_t&
+      Incremented by the data words kept.
+
+   \return size_t - words written to pOut.
+*/
+size_t
+CZeroSuppressor::select(const uint32_t* pWords, size_t nWords, const uint16_t* pThresholds,
+                        uint32_t channelMask, uint32_t* pOut, size_t& nData, size_t& nKept)
+{
+  size_t i = 0;
+  size_t n = 0;
+#ifdef __SSE2__
+  const __m128i dataMask  = _mm_set1_epi32(0xff800000);
+  const __m128i data      = _mm_set1_epi32(CMesytecDecoder::dataEvent);
+  const __m128i valueMask = _mm_set1_epi32(CMesytecDecoder::dataValueMask);
+  for (; i + 4 <= nWords; i += 4) {
+    __m128i  w        = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pWords + i));
+    __m128i  thr      = _mm_set_epi32(pThresholds[(pWords[i + 3] >> CMesytecDecoder::dataChanShift) & channelMask],
+                                      pThresholds[(pWords[i + 2] >> CMesytecDecoder::dataChanShift) & channelMask],
+                                      pThresholds[(pWords[i + 1] >> CMesytecDecoder::dataChanShift) & channelMask],
+                                      pThresholds[(pWords[i] >> CMesytecDecoder::dataChanShift) & channelMask]);
+    __m128i  isD      = _mm_cmpeq_epi32(_mm_and_si128(w, dataMask), data);
+    __m128i  drop     = _mm_and_si128(isD, _mm_cmplt_epi32(_mm_and_si128(w, valueMask), thr));
+    unsigned dataBits = _mm_movemask_ps(_mm_castsi128_ps(isD));
+    unsigned dropBits = _mm_movemask_ps(_mm_castsi128_ps(drop));
+    unsigned keep     = ~dropBits;                    // Compress without branching on the lanes.
+    pOut[n] = pWords[i];     n += keep & 1;
+    pOut[n] = pWords[i + 1]; n += (keep >> 1) & 1;
+    pOut[n] = pWords[i + 2]; n += (keep >> 2) & 1;
+    pOut[n] = pWords[i + 3]; n += (keep >> 3) & 1;
+    nData += __builtin_popcount(dataBits);
+    nKept += __builtin_popcount(dataBits & ~dropBits);
+  }
+#endif
+  for (; i < nWords; i++) {
+    uint32_t word   = pWords[i];
+    unsigned isData = CMesytecDecoder::isData(word);
+    unsigned drop   = isData &
+      (CMesytecDecoder::value(word) < pThresholds[(word >> CMesytecDecoder::dataChanShift) & channelMask]);
+    pOut[n] = word;
+    n      += drop ^ 1;
+    nData  += isData;
+    nKept  += isData & (drop ^ 1);
+  }
+  return n;
+}
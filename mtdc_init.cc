@@ -20,7 +20,7 @@
 #include "vmeClass.h"
 //#include <arpa/inet.h>
 //#include <stdio.h>
-#define MTDC 0x06060000
+#define MTDC 0x06060000 // used if the crate scan does not find one
 #define MQDC 0x01060000
 #define ADDR_R 0x0D
 #define ADDR_W 0x0E
@@ -45,19 +45,24 @@ int main() {
       static const uint8_t listNumber=2;
       uint16_t data_buffer=0;
       uint32_t r_data=0;
+      uint32_t mtdc=MTDC, mqdc=MQDC;
+      
+      if (VME.crateScan (&cvm, &mtdc, &mqdc) < 0) { // find the modules, one USB round trip
+        std::cout << "Crate scan failed, using MTDC 0x" << std::hex << mtdc << " and MQDC 0x" << mqdc << std::dec << std::endl;
+      }
       
       
       if(VME.testStack (&cvm, &testList)) {
       //cvm.loadList (listNumber, testList, sizeof(testList));
       
-      VME.moduleReset (MTDC, &cvm); // soft power cycle the modules
-      VME.moduleReset (MQDC, &cvm);
+      VME.moduleReset (mtdc, &cvm); // soft power cycle the modules
+      VME.moduleReset (mqdc, &cvm);
       
-      VME.moduleInit (MTDC, &cvm); // initialize the Mesytec modules interface
-      VME.moduleInit (MQDC, &cvm);
+      VME.moduleInit (mtdc, &cvm); // initialize the Mesytec modules interface
+      VME.moduleInit (mqdc, &cvm);
       
-      VME.mvmeInit (MTDC, &cvm); // initialize the Mesytec modules for VM USB interface
-      VME.mvmeInit (MQDC, &cvm);
+      VME.mvmeInit (mtdc, &cvm); // initialize the Mesytec modules for VM USB interface
+      VME.mvmeInit (mqdc, &cvm);
       
       VME.vmUSBInit (&cvm); // start the VM USB
       
@@ -65,16 +70,16 @@ int main() {
       int data_count = 0, cycles=100;
       
       while (!data_search) {
-	  data_buffer = VME.pollBuffer (&cvm, MQDC);
+	  data_buffer = VME.pollBuffer (&cvm, mqdc);
 	  if (data_buffer > 0) {
 	    printf("Found Data...");
 	    while (data_buffer >0 ) {
-	    cvm.vmeRead32(MQDC, ADDR_R, &r_data); // read out data from base address
+	    cvm.vmeRead32(mqdc, ADDR_R, &r_data); // read out data from base address
 	    printf("\nData collected:\t\t0x%0x\n",r_data);
 	    printf("Module ID:\t0x%0x\n", ((r_data&0x00FF0000) / 0x10000));
 	    data_count ++;
 	    if (data_count == 64) data_search = true;
-	    data_buffer = VME.pollBuffer (&cvm, MQDC);
+	    data_buffer = VME.pollBuffer (&cvm, mqdc);
 	  }
 	  }
 	  usleep(100000);
@@ -88,8 +93,8 @@ int main() {
 	VME.daqStop (&cvm);
 	list.dump (std::cout);
 	VME.cycleClear (&list);
-	VME.moduleReset (MTDC, &cvm);
-	VME.moduleReset (MQDC, &cvm);
+	VME.moduleReset (mtdc, &cvm);
+	VME.moduleReset (mqdc, &cvm);
 	
       }
       else {
@@ -17,6 +17,17 @@
 #include <cstring>
 #include <unistd.h>
 #include "vmeClass.h"
+#include "CVMUSBStackMemory.h"
+#include "CCrateScan.h"
+#include "CModuleRegistry.h"
+#include "CMesytecDriver.h"
+#include "CModuleReadout.h"
+#include "CPedestalCalibrator.h"
+#include "CVMUSBBufferParser.h"
+#include <map>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
 
 /*
  * I am lazy a lot of stuff is redundant on the VME bus, so I am going to make a lot of
@@ -45,9 +56,11 @@
 #define IRQ_source 0x601C // 0 for event threshold and 1 for data threshold
 #define irq_event_threshold 0x601E // should always be 1
 #define multi_event 0x6036 // 0->single event, 0x3-> multi event, 0xb->transmits # events specified
+#define data_len_format 0x6032 // 0->8bit, 1->16bit, 2->32bit, 3->64bit units in data_reg
 #define Max_transfer_data 0x601A // one event is transmitted, should always be 1
 #define cblt_mcst_control 0x6020 // Setup Multicast, DO NOT TOUCH
 #define cblt_address 0x6024 // set 8 high bits of Multicast address, DO NOT TOUCH
+#define cblt_addr_reg 0x6022 // set 8 high bits of the CBLT address, see vme::cbltInit
 #define output_format 0x6044 // 0->standard, 1->timestamp
 #define bank_operation 0x6040 // 0->bank connected, 1->independent
 #define tdc_resolution 0x6042 // timing resolution, refer to user manuals
@@ -140,6 +153,10 @@
 #define USR_DEV_SETTINGS 0x00001110 // Setup the NIM outputs for the VME, O1-> Busy (stack processing), O2 -> Data sent to buffer
 #define DDG_SETTINGS 0x007F000F // Some easy delays and gates, feel free to change
 #define SCALAR_RESET 0x00880000 // reset the scalar readouts after execution of a stack
+#define SCALER_SOURCES 0x00570000 // A: accepted (readout) triggers, B: NIM I1 (raw triggers), both enabled
+#define SCALER_PERIOD 2 // scaler stack readout period in units of 0.5 s
+#define PEDESTAL_AMPLITUDE 0 // pulser amplitude of a pedestal run, the gate without a signal
+#define PEDESTAL_BUFFER_BYTES (13*1024*2+8) // largest VM-USB buffer
 #define EVENTSBUFF_SETTINGS 0x001 // Set VM-USB to handle one event at a time
 #define ISV_SETTINGS 0x218F218F // Set the IRQ to look for stack labled 2
 #define USB_SETTINGS 0x00000502 // Set timeout (5sec) and packet transmit from buffer (2)
@@ -162,6 +179,140 @@
 #define EVENT_MARKER 0xBDE7
 #define TIMEOUT 200
 
+/*
+ * Multi-event readout. In multi-event mode the modules buffer several events in their FIFO and
+ * the stack reads back exactly what is sitting in the FIFO. The word count is pulled from data_reg
+ * (buffer data length, counted in units of data_len_format) so that the block transfer is sized by
+ * the VM-USB itself instead of a fixed 128 transfer read.
+ */
+#define ME_MODE_UNLIMITED 0x3 // multi_event: transmit everything in the FIFO
+#define ME_MODE_LIMITED 0xb // multi_event: transmit Max_transfer_data events then EOE
+#define ME_DATA_LEN_32 2 // data_len_format: buffer data length counted in 32 bit words
+#define ME_MAX_TRANSFER 16 // events sent per read in limited mode
+#define ME_IRQ_THRESHOLD 16 // events in the FIFO before the module raises its IRQ
+#define ME_COUNT_MASK 0x3FFF // data FIFO holds at most 16k words, mask for the number extract
+
+/*
+ * Chained block transfer. Every module in the chain answers to the same CBLT address, the first module
+ * starts the transfer and hands the bus to the next one when its FIFO is empty. The last module ends the
+ * chain with a BERR which stops the VM-USB block read, so the read count is only an upper limit.
+ * The cblt_mcst_control bits come in enable/disable pairs, writing 0 to a pair leaves it unchanged.
+ */
+#define CBLT_ADDR 0xAA // 8 high bits of the CBLT address
+#define cblt_base 0xaa000000
+#define MCST_ENABLE 0x80 // cblt_mcst_control bits, see the Mesytec data sheets
+#define MCST_DISABLE 0x40
+#define CBLT_FIRST 0x20
+#define CBLT_NOT_FIRST 0x10
+#define CBLT_LAST 0x08
+#define CBLT_NOT_LAST 0x04
+#define CBLT_ENABLE 0x02
+#define CBLT_DISABLE 0x01
+#define CBLT_MAX_TRANSFERS 4096 // upper bound on 32 bit words for one chained read
+
+/*
+ * Per-module IRQ readout. Each module gets its own IRQ level and vector and its own stack, the ISV registers
+ * tie level+vector to the stack so a module is only read when it has data. Stacks 2-7 are the IRQ stacks
+ * so up to 6 modules can be read this way.
+ */
+#define IRQ_STACK_BASE 2 // stack of the first module, the next module gets the next stack
+#define IRQ_MAX_MODULES 6 // stacks 2..7
+#define IRQ_VECTOR_BASE 0x80 // vector of the first module, the next module gets the next vector
+
+
+/*
+ * Register tables for the module setup. vme::moduleInit and vme::mvmeInit write them in full,
+ * vme::moduleConfigure only writes the entries that differ from what the module holds.
+ */
+static uint16_t mqdc_reg[53]={ECL_term, ECL_gate1_osc, ECL_fc_res, Gate_select, NIM_gat1_osc, NIM_fc_reset, NIM_busy, pulser_status, pulser_dac, ts_sources, ts_divisor, chn0, chn1, chn2, chn3, chn4, chn5, chn6, chn7, chn8, chn9, chn10, chn11, chn12, chn13, chn14, chn15, chn16, chn17, chn18, chn19, chn20, chn21, chn22, chn23, chn24, chn25, chn26, chn27, chn28, chn29, chn30, chn31, ignore_thresholds, bank_operation, offset_bank0, offset_bank1, limit_bank0, limit_bank1, trig_delay0, trig_delay1, input_coupling, skip_oorange};
+static uint16_t mqdc_data[53]={0b11000, 0, 1, 0, 0, 0, 0, 5 /*5PULSER*/, 32, 0b00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 130, 130, 255, 255, 0, 0, 0b000, 0};
+
+static uint16_t mtdc_reg[22]={output_format, tdc_resolution, first_hit, bank0_win_start, bank1_win_start, bank0_win_width, bank1_win_width, bank0_trig_source, bank1_trig_source, Negative_edge, bank0_input_thr, bank1_input_thr, ECL_term, ECL_trig1_osc, Trig_select, NIM_trig1_osc, NIM_busy, pulser_status, ts_sources, ts_divisor, stop_ctr};
+static uint16_t mtdc_data[22]={0, 0, 3, 0b11, 16368, 16368, 32, 32, 0x001, 0x002, 0b00, 105, 105, 0b000, 0, 0, 0, 0, 3 /*3PULSER*/, 0b00, 1, 0b00};
+
+static uint16_t mvme_reg[9] = {irq_level, irq_vector, IRQ_source, irq_event_threshold, marking_type, multi_event, Max_transfer_data, cblt_mcst_control, cblt_address};
+static uint16_t mvme_data[9] = {1, 0, 0, 1, 0x1, 0x0, 0, 0x80, 0xBB};
+#define CONFIG_MAX_REGS 64 // module table + mvme table
+
+/*
+ * Module drivers. Each module type is a driver registered under its firmware revision, vme::moduleInit and
+ * vme::moduleConfigure find the register table through it and CModuleReadout builds the readout stack and
+ * decodes the data with it. Add drivers for other modules with vme::moduleDrivers().add(...).
+ */
+#define MQDC_FIRMWARE 0x204
+#define MTDC_FIRMWARE 0x206
+static CMesytecDriver mqdc_driver("MQDC-32", MQDC_FIRMWARE, mqdc_reg, mqdc_data, 53, 5);
+static CMesytecDriver mtdc_driver("MTDC-32", MTDC_FIRMWARE, mtdc_reg, mtdc_data, 22, 6); // channels 32, 33 are the trigger inputs
+
+/*
+ * Module readiness. After a soft reset the module does not answer for a while, instead of sleeping a
+ * fixed time the firmware register is polled with a growing interval until it reads back sensibly.
+ * The time each module took is kept so batched lists can wait in the stack (addDelay) instead.
+ */
+#define READY_FIRST_POLL_US 10 // first poll interval, doubled after every miss
+#define READY_MAX_POLL_US 1000 // longest poll interval
+#define READY_TIMEOUT_US 1000000 // give up after 1 s
+#define READY_DEFAULT_US 400 // in-stack wait for a module that was never timed (the old fixed sleep)
+#define DELAY_CLOCK_NS 200 // addDelay clock period
+static std::map<uint32_t, long> ready_us; // module address -> microseconds its last reset took
+
+
+/*
+ * driverRegistry
+ * The registry behind vme::moduleDrivers, filled with the built in drivers on first use.
+ */
+static CModuleRegistry&
+driverRegistry () {
+  static CModuleRegistry registry;
+  static bool loaded = false;
+  if (!loaded) {
+    registry.add(&mqdc_driver);
+    registry.add(&mtdc_driver);
+    loaded = true;
+  }
+  return registry;
+}
+
+
+/*
+ * configTable
+ * Builds the configuration a module should end up with after vme::moduleInit and vme::mvmeInit: the driver's
+ * table followed by the mvme table, where a register that shows up twice keeps the value written last.
+ * Address 0 is the data FIFO, not a register (mtdc_reg has one entry less than mtdc_data), so it is left out.
+ * Returns the number of registers, 0 for a firmware without a driver or whose driver has no table.
+ */
+static int
+configTable (uint16_t firmware, uint16_t* reg, uint16_t* data) {
+  const uint16_t* table_reg = 0;
+  const uint16_t* table_data = 0;
+  CModuleDriver* driver = driverRegistry().find(firmware);
+  int table_size = driver ? driver->settings(table_reg, table_data) : 0;
+  if (table_size == 0 || table_size+9 > CONFIG_MAX_REGS) return 0;
+
+  int n = 0;
+  for (int i=0;i<table_size+9;++i) {
+    uint16_t r = (i < table_size) ? table_reg[i] : mvme_reg[i-table_size];
+    uint16_t d = (i < table_size) ? table_data[i] : mvme_data[i-table_size];
+    if (r == 0) continue;
+    int j = 0;
+    while (j < n && reg[j] != r) ++j; // written before? then the later value wins
+    reg[j] = r;
+    data[j] = d;
+    if (j == n) ++n;
+  }
+  return n;
+}
+
+
+/*
+ * vme::moduleDrivers
+ * The module driver registry, holding the MQDC-32 and MTDC-32 drivers to begin with. Shared by all vme objects.
+ */
+CModuleRegistry&
+vme::moduleDrivers () {
+  return driverRegistry();
+}
+
 
 /*
  * vme::moduleReset
@@ -174,7 +325,9 @@ vme::moduleReset (uint32_t module_addr, CVMUSBusb* cvm) {
     static uint16_t r_data=0;
     cvm->vmeWrite16(module_addr|soft_reset, ADDR_W, w_data);
     printf("\n--------------------\nSoft Reset Starting\n--------------------\n");
-    usleep(400); // sleep for a short while to be sure the write was successful, this is only noted for powercycling
+    long took = vme::waitReady(module_addr, cvm); // poll until the module answers again
+    if (took < 0) printf("Module did not come back after %d us\n", READY_TIMEOUT_US);
+    else printf("Ready after:\t\t%ld us\n", took);
     cvm->vmeRead16(module_addr|soft_reset, ADDR_R, &r_data);
     printf("Module ID:\t\t0x%0x\n", r_data);
     cvm->vmeRead16(module_addr|firmware_revision, ADDR_R, &r_data);
@@ -184,6 +337,99 @@ vme::moduleReset (uint32_t module_addr, CVMUSBusb* cvm) {
 }
 
 
+/*
+ * vme::waitReady
+ * This function polls the firmware register of a module until it reads back as something other than 0 or
+ * all ones, waiting READY_FIRST_POLL_US after the first miss and twice as long after each further miss
+ * (at most READY_MAX_POLL_US). Returns the microseconds it took and records them for vme::readyTime and
+ * vme::addReadyDelay, or -1 if the module did not answer within READY_TIMEOUT_US.
+ */
+long
+vme::waitReady (uint32_t module_addr, CVMUSBusb* cvm) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  long poll = READY_FIRST_POLL_US;
+  while (true) {
+    uint16_t r_data=0;
+    int status = cvm->vmeRead16(module_addr|firmware_revision, ADDR_R, &r_data);
+    long took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    if (status == 0 && r_data != 0 && r_data != 0xFFFF) {
+      ready_us[module_addr] = took;
+      return took;
+    }
+    if (took >= READY_TIMEOUT_US) return -1;
+    usleep(poll);
+    poll = (poll*2 > READY_MAX_POLL_US) ? READY_MAX_POLL_US : poll*2;
+  }
+}
+
+
+/*
+ * vme::readyTime
+ * How long the last soft reset of this module took to come back in microseconds, -1 if it was never timed.
+ */
+long
+vme::readyTime (uint32_t module_addr) {
+  std::map<uint32_t, long>::iterator it = ready_us.find(module_addr);
+  return (it == ready_us.end()) ? -1 : it->second;
+}
+
+
+/*
+ * vme::addReadyDelay
+ * This function adds an in-stack wait for a module to come back from a soft reset, for lists that reset
+ * and then talk to the module without a round trip to the host. The wait is the time vme::waitReady
+ * measured for that module (READY_DEFAULT_US if it never ran), in 200 ns addDelay clocks, 255 per line.
+ * Returns the number of clocks added.
+ */
+long
+vme::addReadyDelay (uint32_t module_addr, CVMUSBReadoutList* list) {
+  long us = vme::readyTime(module_addr);
+  if (us < 0) us = READY_DEFAULT_US;
+  long clocks = (us*1000 + DELAY_CLOCK_NS - 1) / DELAY_CLOCK_NS;
+  for (long left = clocks; left > 0; left -= 255) {
+    list->addDelay(left > 255 ? 255 : left);
+  }
+  return clocks;
+}
+
+
+/*
+ * vme::moduleResetAll
+ * Batched vme::moduleReset for several modules: one list soft resets them all, waits in the stack for the
+ * slowest one (vme::addReadyDelay) and reads back every firmware revision. Run vme::moduleReset (or
+ * vme::waitReady) once per module beforehand so the wait is the measured one. Returns the number of
+ * modules that answered.
+ */
+int
+vme::moduleResetAll (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm) {
+  printf("\n--------------------\nBatched Soft Reset Starting\n--------------------\n");
+  static uint16_t w_data=1;
+  CVMUSBReadoutList list;
+  int slowest = 0;
+  for (int i=0;i<n_modules;++i) {
+    list.addWrite16(module_addr[i]|soft_reset, ADDR_W, w_data);
+    if (vme::readyTime(module_addr[i]) > vme::readyTime(module_addr[slowest])) slowest = i;
+  }
+  long clocks = vme::addReadyDelay(module_addr[slowest], &list);
+  for (int i=0;i<n_modules;++i) {
+    list.addRead16(module_addr[i]|firmware_revision, ADDR_R);
+  }
+  std::vector<uint16_t> r_data(2*n_modules, 0);
+  size_t n_read=0;
+  cvm->executeList(list, &r_data[0], r_data.size()*sizeof(uint16_t), &n_read);
+  int stride = (n_read >= n_modules*sizeof(uint32_t)) ? 2 : 1; // 16 bit reads may come back as longwords
+  int answered = 0;
+  for (int i=0;i<n_modules;++i) {
+    uint16_t firmware = r_data[i*stride];
+    printf("Module 0x%08x Firmware Revision:\t0x%0x\n", module_addr[i], firmware);
+    if (firmware != 0 && firmware != 0xFFFF) ++answered;
+  }
+  printf("In-stack wait:\t\t%ld us\n", clocks*DELAY_CLOCK_NS/1000);
+  printf("\n--------------------\nBatched Soft Reset Finished\n--------------------\n");
+  return answered;
+}
+
+
 /*
  * vme::vmUSBInit
  * This function initializes the VM USB for DAQ mode. This process is copied from the method used
@@ -216,54 +462,209 @@ vme::vmUSBInit (CVMUSBusb* cvm) {
  */
 int
 vme::mvmeInit (uint32_t module_addr, CVMUSBusb* cvm) {
-    static uint16_t reg[9] = {irq_level, irq_vector, IRQ_source, irq_event_threshold, marking_type, multi_event, Max_transfer_data, cblt_mcst_control, cblt_address};
-    static uint16_t reg_data[9] = {1, 0, 0, 1, 0x1, 0x0, 0, 0x80, 0xBB};
     printf("\n--------------------\nStarting VME Interfacing\n--------------------\n");
     for (int i=0;i<9;++i) {
-      cvm->vmeWrite16(module_addr|reg[i], ADDR_W, reg_data[i]); 
+      cvm->vmeWrite16(module_addr|mvme_reg[i], ADDR_W, mvme_data[i]); 
       printf(".\t");
-      usleep(200);
     }
     printf("\n--------------------\nVME Interfacing Finished\n--------------------\n");
     return 0;
 }
 
 
+/*
+ * vme::mvmeMultiEventInit
+ * This function switches a Mesytec module into multi-event mode. Call it after vme::mvmeInit, it only
+ * overwrites the registers that differ from single event readout. mode is ME_MODE_UNLIMITED or ME_MODE_LIMITED,
+ * max_transfer is only used by the module in limited mode. irq_threshold is the number of buffered
+ * events before the IRQ fires, so one trigger of the stack drains that many events at once.
+ */
+int
+vme::mvmeMultiEventInit (uint32_t module_addr, CVMUSBusb* cvm, uint16_t mode, uint16_t max_transfer, uint16_t irq_threshold) {
+    uint16_t reg[6] = {data_len_format, multi_event, Max_transfer_data, IRQ_source, irq_event_threshold, FIFO_reset};
+    uint16_t reg_data[6] = {ME_DATA_LEN_32, mode, max_transfer, 0, irq_threshold, 1};
+    printf("\n--------------------\nStarting Multi-Event Setup\n--------------------\n");
+    for (int i=0;i<6;++i) {
+      cvm->vmeWrite16(module_addr|reg[i], ADDR_W, reg_data[i]);
+      printf(".\t");
+    }
+    printf("\n--------------------\nMulti-Event Setup Finished\n--------------------\n");
+    return 0;
+}
+
+
+/*
+ * vme::cbltInit
+ * This function sets up the chained block transfer. module_addr lists the modules in chain order, which
+ * has to match the order they sit in the crate (left to right), the first entry is flagged as the first
+ * module and the last entry as the last module, the ones between get both flags cleared. CBLT and multicast
+ * are enabled explicitly, multicast so base_addr resets still work.
+ */
+int
+vme::cbltInit (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm) {
+  printf("\n--------------------\nStarting CBLT Setup\n--------------------\n");
+  for (int i=0;i<n_modules;++i) {
+    uint16_t control = CBLT_ENABLE|MCST_ENABLE; // FIRST/LAST pairs below, one bit of each pair
+    control |= (i == 0) ? CBLT_FIRST : CBLT_NOT_FIRST;
+    control |= (i == n_modules-1) ? CBLT_LAST : CBLT_NOT_LAST;
+    cvm->vmeWrite16(module_addr[i]|cblt_addr_reg, ADDR_W, CBLT_ADDR);
+    cvm->vmeWrite16(module_addr[i]|cblt_mcst_control, ADDR_W, control);
+    printf(".\t");
+  }
+  printf("\n--------------------\nCBLT Setup Finished\n--------------------\n");
+  return 0;
+}
+
+
+/*
+ * vme::moduleConfigure
+ * Differential version of vme::moduleReset + vme::moduleInit + vme::mvmeInit for restarting runs. All of the
+ * module's configuration registers are read back with one list, only the ones that differ from the tables
+ * are written, again with one list, and there is no soft reset. The write list always ends with a FIFO and
+ * readout reset so no events of the previous run are left in the module. When the read back or the write
+ * list fails (module not answering) it falls back to the full reset and init. Returns the number of
+ * registers written, -1 for a module with an unknown firmware or a failed init.
+ */
+int
+vme::moduleConfigure (uint32_t module_addr, CVMUSBusb* cvm) {
+  uint16_t reg[CONFIG_MAX_REGS];
+  uint16_t want[CONFIG_MAX_REGS];
+  uint16_t have[2*CONFIG_MAX_REGS];
+  uint16_t firmware=0;
+  size_t n_read=0;
+  printf("\n--------------------\nStarting Differential Configuration\n--------------------\n");
+
+  if (cvm->vmeRead16(module_addr|firmware_revision, ADDR_R, &firmware) < 0) firmware = 0;
+  int n_regs = configTable(firmware, reg, want);
+  if (n_regs == 0) {
+    printf("Unknown firmware:\t0x%0x\n", firmware);
+    return -1;
+  }
+
+  CVMUSBReadoutList read_list;
+  for (int i=0;i<n_regs;++i) {
+    read_list.addRead16(module_addr|reg[i], ADDR_R);
+  }
+  int status = cvm->executeList(read_list, have, sizeof(have), &n_read);
+  if (status < 0 || n_read < n_regs*sizeof(uint16_t)) {
+    printf("Read back failed, doing a full initialization\n");
+    vme::moduleReset(module_addr, cvm);
+    if (vme::moduleInit(module_addr, cvm) < 0) return -1;
+    vme::mvmeInit(module_addr, cvm);
+    return n_regs;
+  }
+  int stride = (n_read >= n_regs*sizeof(uint32_t)) ? 2 : 1; // 16 bit reads may come back as longwords
+
+  CVMUSBReadoutList write_list;
+  int n_diff = 0;
+  for (int i=0;i<n_regs;++i) {
+    if (have[i*stride] != want[i]) {
+      write_list.addWrite16(module_addr|reg[i], ADDR_W, want[i]);
+      ++n_diff;
+    }
+  }
+  static uint16_t w_data=1;
+  write_list.addWrite16(module_addr|FIFO_reset, ADDR_W, w_data); // drop events left from the last run
+  write_list.addWrite16(module_addr|readout_reset, ADDR_W, w_data);
+  uint16_t reply=0;
+  if (cvm->executeList(write_list, &reply, sizeof(reply), &n_read) < 0) {
+    printf("Register writes failed, doing a full initialization\n");
+    vme::moduleReset(module_addr, cvm);
+    if (vme::moduleInit(module_addr, cvm) < 0) return -1;
+    vme::mvmeInit(module_addr, cvm);
+    return n_regs;
+  }
+  printf("Registers written:\t%d of %d\n", n_diff, n_regs);
+  printf("\n--------------------\nDifferential Configuration Finished\n--------------------\n");
+  return n_diff;
+}
+
+
+/*
+ * vme::moduleIrqInit
+ * This function gives a module its own IRQ level and vector, call it after vme::mvmeInit which sets every
+ * module to level 1 vector 0. The IRQ fires as soon as one event sits in the FIFO.
+ */
+int
+vme::moduleIrqInit (uint32_t module_addr, CVMUSBusb* cvm, uint16_t level, uint16_t vector) {
+    uint16_t reg[4] = {irq_level, irq_vector, IRQ_source, irq_event_threshold};
+    uint16_t reg_data[4] = {level, vector, 0, 1};
+    printf("\n--------------------\nStarting IRQ Setup (level %d vector 0x%02x)\n--------------------\n", level, vector);
+    for (int i=0;i<4;++i) {
+      cvm->vmeWrite16(module_addr|reg[i], ADDR_W, reg_data[i]);
+      printf(".\t");
+    }
+    printf("\n--------------------\nIRQ Setup Finished\n--------------------\n");
+    return 0;
+}
+
+
+/*
+ * vme::irqStackInit
+ * This function sets up per-module IRQ readout. Module i gets IRQ level i+1, vector IRQ_VECTOR_BASE+i and
+ * stack IRQ_STACK_BASE+i (built into lists[i] with vme::buildModuleStack), the ISV registers map each
+ * level/vector to its stack and all the stacks in stacks are loaded and verified. Add the scaler stack to
+ * stacks first if you want it. Route the events with CVMUSBBufferParser::setHandler(IRQ_STACK_BASE+i, ...).
+ * Call it after vme::vmUSBInit, which writes the single stack ISV_SETTINGS. lists must outlive stacks.
+ * Returns -1 if there are more modules than IRQ stacks.
+ */
+int
+vme::irqStackInit (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm, CVMUSBStackMemory* stacks, CVMUSBReadoutList* lists) {
+  if (n_modules > IRQ_MAX_MODULES) {
+    printf("\n--------------------\nToo many modules for IRQ readout: %d\n--------------------\n", n_modules);
+    return -1;
+  }
+  uint32_t isv[4] = {0, 0, 0, 0}; // unused halves stay level 0, which never fires
+  for (int i=0;i<n_modules;++i) {
+    uint32_t level = i+1;
+    uint32_t vector = IRQ_VECTOR_BASE+i;
+    uint32_t stack = IRQ_STACK_BASE+i;
+    vme::moduleIrqInit(module_addr[i], cvm, level, vector);
+    vme::buildModuleStack(module_addr[i], cvm, &lists[i]);
+    stacks->add(stack, lists[i]);
+    uint32_t half = (stack << CVMUSB::ISVRegister::AStackIDShift)|(level << CVMUSB::ISVRegister::AIPLShift)|vector;
+    isv[i/2] |= (i % 2) ? (half << CVMUSB::ISVRegister::BVectorShift) : half; // two modules per ISV register
+  }
+  for (int i=0;i<4;++i) {
+    cvm->writeVector(i+1, isv[i]); // ISV12 .. ISV78
+  }
+  stacks->load(*cvm);
+  printf("\n--------------------\nIRQ Stacks Loaded: %d\n--------------------\n", n_modules);
+  return 0;
+}
+
+
 /*
  * vme::moduleInit
  * This function initializes the Mesytec VME devices internally. See MVME and technical notes for more clarity.
  * These parameters are all standard an have not been changed, IRQ is the only thing changed which is why it is in a separate function.
+ * The driver registered for the module's firmware supplies the writes, they all go out in one list.
+ * Returns -1 if there is no driver for the module or the list fails.
  */
 int
 vme::moduleInit (uint32_t module_addr, CVMUSBusb* cvm) {
-  static uint16_t mqdc_reg[53]={ECL_term, ECL_gate1_osc, ECL_fc_res, Gate_select, NIM_gat1_osc, NIM_fc_reset, NIM_busy, pulser_status, pulser_dac, ts_sources, ts_divisor, chn0, chn1, chn2, chn3, chn4, chn5, chn6, chn7, chn8, chn9, chn10, chn11, chn12, chn13, chn14, chn15, chn16, chn17, chn18, chn19, chn20, chn21, chn22, chn23, chn24, chn25, chn26, chn27, chn28, chn29, chn30, chn31, ignore_thresholds, bank_operation, offset_bank0, offset_bank1, limit_bank0, limit_bank1, trig_delay0, trig_delay1, input_coupling, skip_oorange};
-  static uint16_t mqdc_data[53]={0b11000, 0, 1, 0, 0, 0, 0, 5 /*5PULSER*/, 32, 0b00, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 130, 130, 255, 255, 0, 0, 0b000, 0};
-
-  static uint16_t mtdc_reg[22]={output_format, tdc_resolution, first_hit, bank0_win_start, bank1_win_start, bank0_win_width, bank1_win_width, bank0_trig_source, bank1_trig_source, Negative_edge, bank0_input_thr, bank1_input_thr, ECL_term, ECL_trig1_osc, Trig_select, NIM_trig1_osc, NIM_busy, pulser_status, ts_sources, ts_divisor, stop_ctr};
-  static uint16_t mtdc_data[22]={0, 0, 3, 0b11, 16368, 16368, 32, 32, 0x001, 0x002, 0b00, 105, 105, 0b000, 0, 0, 0, 0, 3 /*3PULSER*/, 0b00, 1, 0b00};
-
   static uint16_t r_data=0;
   cvm->vmeRead16(module_addr|firmware_revision, ADDR_R, &r_data);
 
   printf("\n--------------------\nStarting initialization process\n--------------------\n");
   
-  if (r_data == 0x204) {
-    for (int i=0;i<53;++i) {
-      cvm->vmeWrite16(module_addr|mqdc_reg[i], ADDR_W, mqdc_data[i]);
-      usleep(200);
-      printf(".\t");
-    }
+  CModuleDriver* driver = vme::moduleDrivers().find(r_data);
+  if (!driver) {
+    printf("No driver for firmware:\t0x%0x\n", r_data);
+    return -1;
   }
-  
-  if (r_data == 0x206) {
-    for (int i=0;i<22;++i) {
-      cvm->vmeWrite16(module_addr|mtdc_reg[i], ADDR_W, mtdc_data[i]);
-      usleep(200);
-      printf(".\t");
-    }
+  CVMUSBReadoutList list;
+  driver->addInit(module_addr, list);
+  uint16_t reply=0;
+  size_t n_read=0;
+  if (cvm->executeList(list, &reply, sizeof(reply), &n_read) < 0) {
+    printf("Initialization list failed\n");
+    return -1;
   }
+  printf("Driver:\t\t\t%s\n", driver->name());
   
   printf("\n--------------------\nFinished initialization process\n--------------------\n");
+  return 0;
 }
 
 
@@ -311,6 +712,24 @@ vme::daqStop (CVMUSBusb* cvm) {
 }
 
 
+/*
+ * vme::daqDrainStop
+ * Run control version of vme::daqStop. Clears the DAQ bit (the IRQ bits stay as daqStart left them) and keeps
+ * reading until the VM-USB sends its last buffer, handing every buffer to sink (a CVMUSBBufferParser for
+ * example) so the tail of the run is not lost. Never takes longer than max_latency ms.
+ * Returns what CVMUSB::stopAndDrain returns, 0 when the VM-USB was drained completely.
+ */
+int
+vme::daqDrainStop (CVMUSBusb* cvm, CVMUSB::BufferSink* sink, int max_latency) {
+  printf("\n--------------------\nStopping Data Acquisition (drain)\n--------------------\n");
+  CVMUSB::DrainStatistics stats;
+  int status = cvm->stopAndDrain(sink, &stats, max_latency, AR_IRQ|AR_DAQ_STOP);
+  printf("Buffers flushed:\t%lu (%lu bytes)\n", static_cast<unsigned long>(stats.buffers), static_cast<unsigned long>(stats.bytes));
+  printf("Stop latency:\t\t%u ms, %s\n", stats.elapsedMs, stats.endSeen ? "last buffer seen" : "last buffer NOT seen");
+  return status;
+}
+
+
 /*
  * vme::cycleStart
  * This function adds the reading FIFO to the stack to be executed later.
@@ -413,6 +832,37 @@ vme::pollBuffer (CVMUSBusb* cvm, uint32_t module_addr) {
 }
 
 
+/*
+ * vme::crateScan
+ * This function finds the modules in the crate with one list (see CCrateScan) and prints what it found.
+ * The base addresses of the first MTDC and MQDC go to mtdc_addr / mqdc_addr (left alone if there is
+ * none, so they can be preset to the usual MTDC / MQDC). Returns the number of modules found, -1 if the
+ * scan list could not be executed.
+ */
+int
+vme::crateScan (CVMUSBusb* cvm, uint32_t* mtdc_addr, uint32_t* mqdc_addr) {
+  printf("\n--------------------\nScanning Crate\n--------------------\n");
+  std::vector<CCrateScan::Module> crate;
+  try {
+    crate = CCrateScan::scan(*cvm);
+  }
+  catch (std::exception& e) {
+    printf("Crate scan failed:\t%s\n", e.what());
+    return -1;
+  }
+  for (size_t i=0;i<crate.size();++i) {
+    printf("Base: 0x%08x\tID: 0x%02x\tFirmware: 0x%04x\t%s\n", crate[i].base, crate[i].moduleId,
+           crate[i].firmware, CCrateScan::typeName(crate[i].type));
+  }
+  const CCrateScan::Module* mtdc = CCrateScan::find(crate, CCrateScan::MTDC32);
+  const CCrateScan::Module* mqdc = CCrateScan::find(crate, CCrateScan::MQDC32);
+  if (mtdc && mtdc_addr) *mtdc_addr = mtdc->base;
+  if (mqdc && mqdc_addr) *mqdc_addr = mqdc->base;
+  printf("\n--------------------\nModules Found: %lu\n--------------------\n", static_cast<unsigned long>(crate.size()));
+  return crate.size();
+}
+
+
 /*
  * vme::registerDump
  * This routine dumps the core registers of the VME to the console, for debugging purposes
@@ -447,10 +897,143 @@ vme::buildStack (CVMUSBusb* cvm, CVMUSBReadoutList* list) {
   cvm->setDefaultTimeout(TIMEOUT); // add default timeout to transaction (200ms)
   list->addFifoRead16(MTDC, MBLT_ADDR_R, sizeof(buffer)); // read from MTDC
   list->addFifoRead16(MQDC, MBLT_ADDR_R, sizeof(buffer)); // read from MQDC
-  list->addRegisterRead(scalar_A); // read from out scalar A
-  list->addRegisterRead(scalar_B); // read from out scalar B
   list->addWrite16(base_addr|readout_reset, ADDR_W, data); // reset Mesytec modules
-  list->addRegisterWrite(usrDevReg, USR_DEV_SETTINGS|SCALAR_RESET); // reset scalars
+  printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
+  return true;
+}
+
+
+/*
+ * vme::buildDriverStack
+ * This function builds the readout stack from the module drivers: every module in readout's inventory is read
+ * with its driver's readout fragment and then let go with its reset fragment, see CModuleReadout. If the
+ * inventory is empty the crate is scanned first; false if that fails or finds nothing. Install readout as the
+ * parser handler of the stack to get the events decoded into readout->batch().
+ */
+bool
+vme::buildDriverStack (CVMUSBusb* cvm, CModuleReadout* readout, CVMUSBReadoutList* list) {
+  printf("\n--------------------\nBuilding Driver Stack\n--------------------\n");
+  if (readout->modules().empty()) {
+    try {
+      readout->setInventory(CCrateScan::scan(*cvm));
+    }
+    catch (std::exception& e) {
+      printf("Crate scan failed:\t%s\n", e.what());
+      return false;
+    }
+  }
+  for (size_t i=0;i<readout->modules().size();++i) {
+    printf("Base: 0x%08x\tID: 0x%02x\t%s\n", readout->modules()[i].base, readout->modules()[i].dataId,
+           readout->modules()[i].pDriver->name());
+  }
+  cvm->setDefaultTimeout(TIMEOUT); // add default timeout to transaction (200ms)
+  readout->setMarker(EVENT_MARKER); // add event marker
+  readout->addReadout(*list);
+  printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
+  return !readout->modules().empty();
+}
+
+
+/*
+ * vme::buildModuleStack
+ * This function builds the stack for one module in per-module IRQ readout (vme::irqStackInit). Only that
+ * module is read and only that module gets its readout reset, the stack id tells the modules apart.
+ */
+bool
+vme::buildModuleStack (uint32_t module_addr, CVMUSBusb* cvm, CVMUSBReadoutList* list) {
+  printf("\n--------------------\nBuilding Module Stack (0x%08x)\n--------------------\n", module_addr);
+  static uint16_t data=1;
+  list->addMarker(EVENT_MARKER); // add event marker
+  cvm->setDefaultTimeout(TIMEOUT); // add default timeout to transaction (200ms)
+  list->addFifoRead16(module_addr, MBLT_ADDR_R, 128); // read this module only
+  list->addWrite16(module_addr|readout_reset, ADDR_W, data); // reset this module only
+  printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
+  return true;
+}
+
+
+/*
+ * vme::scalerInit
+ * This function sets up trigger accounting. Scaler A counts the triggers the VM-USB accepted, scaler B every
+ * pulse on NIM I1 whether the DAQ was busy or not. They are cleared once here and then run free, the VM-USB
+ * runs the scaler stack (stack 1) every period * 0.5 s on its own. Call it after vme::vmUSBInit, which
+ * overwrites both registers. A period of 0 uses SCALER_PERIOD (1 s). Feed the scaler events to a
+ * CDeadTimeMonitor for rates and live time.
+ */
+int
+vme::scalerInit (CVMUSBusb* cvm, uint8_t period) {
+  printf("\n--------------------\nStarting Scaler Setup\n--------------------\n");
+  if (period == 0) period = SCALER_PERIOD;
+  cvm->writeRegister(usrDevReg, USR_DEV_SETTINGS|SCALER_SOURCES|SCALAR_RESET); // clear both scalers
+  cvm->writeRegister(usrDevReg, USR_DEV_SETTINGS|SCALER_SOURCES); // release the reset, start counting
+  cvm->writeRegister(daqReg, DAQ_SETTINGS|(static_cast<uint32_t>(period) << 8)); // scaler readout period
+  printf("\n--------------------\nScaler Setup Finished\n--------------------\n");
+  return 0;
+}
+
+
+/*
+ * vme::buildScalerStack
+ * This function builds the scaler stack, load it as stack 1. It only reads the two scalers, they are not
+ * reset so nothing counted between the read and a reset gets lost, CDeadTimeMonitor takes the differences.
+ */
+bool
+vme::buildScalerStack (CVMUSBusb* /* cvm */, CVMUSBReadoutList* list) {
+  printf("\n--------------------\nBuilding Scaler Stack\n--------------------\n");
+  list->addRegisterRead(scalar_A); // accepted triggers
+  list->addRegisterRead(scalar_B); // raw triggers
+  printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
+  return true;
+}
+
+
+/*
+ * vme::addMultiEventRead
+ * This function adds a multi-event readout of one module to the stack. The buffer data length is read first
+ * and used as the number data for the following FIFO read, so the VM-USB transfers exactly the 32 bit words
+ * the module has buffered. There must be no other block transfer between the two.
+ */
+int
+vme::addMultiEventRead (uint32_t module_addr, CVMUSBReadoutList* list) {
+  list->addBlockCountRead16(module_addr|data_reg, ME_COUNT_MASK, ADDR_R); // words waiting in the FIFO
+  list->addMaskedCountFifoRead32(module_addr, MBLT_ADDR_R); // drain exactly that many
+  return 0;
+}
+
+
+/*
+ * vme::buildMultiEventStack
+ * Same layout as vme::buildStack but for modules set up with vme::mvmeMultiEventInit. Each module is read
+ * with a masked count read so one trigger drains every event the module has buffered.
+ */
+bool
+vme::buildMultiEventStack (CVMUSBusb* cvm, CVMUSBReadoutList* list) {
+  printf("\n--------------------\nBuilding Multi-Event Stack\n--------------------\n");
+  static uint16_t data=1;
+  list->addMarker(EVENT_MARKER); // add event marker
+  cvm->setDefaultTimeout(TIMEOUT); // add default timeout to transaction (200ms)
+  vme::addMultiEventRead(MTDC, list); // read all buffered MTDC events
+  vme::addMultiEventRead(MQDC, list); // read all buffered MQDC events
+  list->addWrite16(base_addr|readout_reset, ADDR_W, data); // reset Mesytec modules
+  printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
+  return true;
+}
+
+
+/*
+ * vme::buildCbltStack
+ * Same layout as vme::buildStack, but all the modules are read with one chained block transfer at the CBLT
+ * address instead of one FIFO read per module. The data comes back as the module events back to back, use
+ * CMesytecDecoder::split to separate them by their module headers. Run vme::cbltInit first.
+ */
+bool
+vme::buildCbltStack (CVMUSBusb* cvm, CVMUSBReadoutList* list) {
+  printf("\n--------------------\nBuilding CBLT Stack\n--------------------\n");
+  static uint16_t data=1;
+  list->addMarker(EVENT_MARKER); // add event marker
+  cvm->setDefaultTimeout(TIMEOUT); // add default timeout to transaction (200ms)
+  list->addFifoRead32(cblt_base, MBLT_ADDR_R, CBLT_MAX_TRANSFERS); // one read for the whole chain, ends on BERR
+  list->addWrite16(base_addr|readout_reset, ADDR_W, data); // reset Mesytec modules
   printf("\n--------------------\nStack Size: %d\n--------------------\n", list->size());
   return true;
 }
@@ -501,3 +1084,104 @@ vme::testMask (uint32_t module_addr, CVMUSBusb* cvm, CVMUSBReadoutList& list) {
   printf("\n--------------------\n");
   return 0;
 }
+
+
+/*
+ * executeAll
+ * Runs one list per module pipelined through CVMUSB::executeLists. Returns the number of lists that failed.
+ */
+static size_t
+executeAll (CVMUSBusb* cvm, std::vector<CVMUSBReadoutList>& lists) {
+  std::vector<uint32_t> replies(lists.size());
+  std::vector<CVMUSB::ListRequest> requests(lists.size());
+  for (size_t i=0;i<lists.size();++i) {
+    requests[i].pList = &lists[i];
+    requests[i].pReadBuffer = &replies[i];
+    requests[i].readBufferSize = sizeof(uint32_t);
+  }
+  return lists.empty() ? 0 : cvm->executeLists(requests.data(), requests.size());
+}
+
+
+/*
+ * vme::pedestalRun
+ * Calibration mode. Zeroes the channel thresholds and turns the test pulser on at amplitude 0 in every module
+ * of readout's inventory, takes data for duration_ms with the readout stack (which must be loaded and the
+ * modules initialized, as for vme::daqStart) and histograms every hit in calibrator. The pulser is then put
+ * back the way the register table has it, the pedestals and thresholds are computed and all 32 thresholds of
+ * each module are written with one list per module (CPedestalCalibrator::load). Run it again whenever the
+ * setup changes; vme::moduleInit and vme::moduleConfigure put the thresholds back to 0.
+ * Returns the number of modules whose thresholds were loaded, -1 if readout has no modules or the thresholds
+ * could not be zeroed and the pulser turned on (nothing is taken or loaded then). A failed pulser restore is
+ * reported but the thresholds are still loaded.
+ */
+int
+vme::pedestalRun (CVMUSBusb* cvm, CModuleReadout* readout, CPedestalCalibrator* calibrator, int duration_ms) {
+  printf("\n--------------------\nPedestal Run (%d ms)\n--------------------\n", duration_ms);
+  const std::vector<CModuleReadout::Entry>& modules = readout->modules();
+  if (modules.empty()) return -1;
+
+  uint16_t zeros[CPedestalCalibrator::maxChannels] = {0};
+  std::vector<CVMUSBReadoutList> lists(modules.size());
+  for (size_t i=0;i<modules.size();++i) {
+    modules[i].pDriver->addThresholds(modules[i].base, zeros, lists[i]);
+    modules[i].pDriver->addPulser(modules[i].base, true, PEDESTAL_AMPLITUDE, lists[i]);
+  }
+  size_t failed = executeAll(cvm, lists);
+  if (failed > 0) {
+    printf("Calibration setup failed for %lu modules\n", static_cast<unsigned long>(failed));
+    return -1;
+  }
+
+  CVMUSBBufferParser parser;
+  parser.setHandler(0, readout);
+  parser.setMarker(0, EVENT_MARKER);
+  calibrator->clear();
+  readout->batch().clear();
+
+  std::vector<uint8_t> buffer(PEDESTAL_BUFFER_BYTES);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  vme::daqStart(cvm);
+  while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(duration_ms)) {
+    size_t n_read=0;
+    if (cvm->recoveringRead(buffer.data(), buffer.size(), &n_read, TIMEOUT) == 0 && n_read > 0) {
+      parser.parse(buffer.data(), n_read);
+      calibrator->add(readout->batch(), modules);
+      readout->batch().clear();
+    }
+  }
+  vme::daqDrainStop(cvm, &parser, TIMEOUT);
+  calibrator->add(readout->batch(), modules);
+  readout->batch().clear();
+
+  for (size_t i=0;i<modules.size();++i) { // pulser back to the register table
+    const uint16_t* reg = 0;
+    const uint16_t* data = 0;
+    size_t n = modules[i].pDriver->settings(reg, data);
+    lists[i] = CVMUSBReadoutList();
+    modules[i].pDriver->addPulser(modules[i].base, false, 0, lists[i]);
+    for (size_t j=0;j<n;++j) {
+      if (reg[j] == pulser_status || reg[j] == pulser_dac) lists[i].addWrite16(modules[i].base|reg[j], ADDR_W, data[j]);
+    }
+  }
+  failed = executeAll(cvm, lists);
+  if (failed > 0) {
+    printf("Pulser restore failed for %lu modules, check their pulser settings\n", static_cast<unsigned long>(failed));
+  }
+
+  size_t valid = calibrator->compute();
+  int loaded = calibrator->load(*cvm, modules);
+  printf("Hits:\t\t\t%lu (%lu past the histograms)\n", static_cast<unsigned long>(calibrator->hits()),
+         static_cast<unsigned long>(calibrator->overflows()));
+  for (size_t i=0;i<modules.size();++i) {
+    const CPedestalCalibrator::Channel* channels = calibrator->channels(modules[i].dataId);
+    if (!channels) continue;
+    printf("\nID: 0x%02x\t%s\nChannel\tEntries\tPedestal\tNoise\tThreshold\n", modules[i].dataId, modules[i].pDriver->name());
+    for (unsigned c=0;c<CPedestalCalibrator::maxChannels;++c) {
+      if (!channels[c].valid) continue;
+      printf("%u\t%u\t%.1f\t\t%.2f\t%u\n", c, channels[c].entries, channels[c].pedestal, channels[c].noise, channels[c].threshold);
+    }
+  }
+  printf("\n--------------------\nValid channels: %lu, modules loaded: %d\n--------------------\n", static_cast<unsigned long>(valid), loaded);
+  return loaded;
+}
@@ -21,6 +21,10 @@
 #include <cstring>
 #include <unistd.h>
 
+class CVMUSBStackMemory;
+class CModuleRegistry;
+class CModuleReadout;
+class CPedestalCalibrator;
 
 class vme // class for streamlining interfacing with VME modules
 {
@@ -30,16 +34,38 @@ public:
   
   virtual int moduleReset (uint32_t module_addr, CVMUSBusb* cvm);
   
+  virtual int moduleResetAll (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm);
+  
+  virtual long waitReady (uint32_t module_addr, CVMUSBusb* cvm);
+  
+  virtual long readyTime (uint32_t module_addr);
+  
+  virtual long addReadyDelay (uint32_t module_addr, CVMUSBReadoutList* list);
+  
   virtual int mvmeInit (uint32_t module_addr, CVMUSBusb* cvm);
   
   virtual int moduleInit (uint32_t module_addr, CVMUSBusb* cvm);
   
+  virtual int cbltInit (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm);
+  
+  virtual int moduleConfigure (uint32_t module_addr, CVMUSBusb* cvm);
+  
+  virtual CModuleRegistry& moduleDrivers ();
+  
+  virtual int moduleIrqInit (uint32_t module_addr, CVMUSBusb* cvm, uint16_t level, uint16_t vector);
+  
+  virtual int irqStackInit (uint32_t* module_addr, int n_modules, CVMUSBusb* cvm, CVMUSBStackMemory* stacks, CVMUSBReadoutList* lists);
+  
+  virtual int mvmeMultiEventInit (uint32_t module_addr, CVMUSBusb* cvm, uint16_t mode, uint16_t max_transfer, uint16_t irq_threshold);
+  
   virtual int daqStart (CVMUSBusb* cvm);
   
   virtual int daqInit (CVMUSBusb* cvm);
   
   virtual int daqStop (CVMUSBusb* cvm);
   
+  virtual int daqDrainStop (CVMUSBusb* cvm, CVMUSB::BufferSink* sink, int max_latency);
+  
   virtual int cycleStart (uint32_t module_addr, CVMUSBReadoutList* list);
   
   virtual int cycleReadout (CVMUSBReadoutList* list);
@@ -54,12 +80,30 @@ public:
   
   virtual int registerDump (CVMUSBusb* cvm);
   
+  virtual int crateScan (CVMUSBusb* cvm, uint32_t* mtdc_addr, uint32_t* mqdc_addr);
+  
   virtual bool buildStack (CVMUSBusb* cvm, CVMUSBReadoutList* list);  
   
   virtual bool testStack (CVMUSBusb* cvm, CVMUSBReadoutList* list);
   
+  virtual int addMultiEventRead (uint32_t module_addr, CVMUSBReadoutList* list);
+  
+  virtual bool buildMultiEventStack (CVMUSBusb* cvm, CVMUSBReadoutList* list);
+  
+  virtual bool buildCbltStack (CVMUSBusb* cvm, CVMUSBReadoutList* list);
+  
+  virtual bool buildDriverStack (CVMUSBusb* cvm, CModuleReadout* readout, CVMUSBReadoutList* list);
+  
+  virtual bool buildModuleStack (uint32_t module_addr, CVMUSBusb* cvm, CVMUSBReadoutList* list);
+  
+  virtual int scalerInit (CVMUSBusb* cvm, uint8_t period);
+  
+  virtual bool buildScalerStack (CVMUSBusb* cvm, CVMUSBReadoutList* list);
+  
   virtual int testMask (uint32_t module_addr, CVMUSBusb* cvm, CVMUSBReadoutList& list);
   
+  virtual int pedestalRun (CVMUSBusb* cvm, CModuleReadout* readout, CPedestalCalibrator* calibrator, int duration_ms);
+  
   
 };
 
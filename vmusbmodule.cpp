@@ -0,0 +1,1023 @@
+/*
+ * CPython extension module "vmusb": the VM-USB from Python without going through the Tcl wrappers.
+ *
+ *   vmusb.Controller([serial])   an opened VM-USB: register and single shot VME access, executeList,
+ *                                loadList, usbRead, crate scan.
+ *   vmusb.ReadoutList()          builds lists (the CVMUSBReadoutList add* methods).
+ *   vmusb.Stream(controller)     the acquisition stream: reads buffers in autonomous DAQ mode, parses
+ *                                them (CVMUSBBufferParser) and decodes the readout stack events with the
+ *                                module drivers (CModuleReadout).
+ *   vmusb.Buffer                 raw bytes returned by the controller.
+ *   vmusb.Batch                  decoded hits and module events as parallel arrays.
+ *   vmusb.Array                  one field of a Batch.
+ *
+ * Buffer and Array export their storage through the buffer protocol, so numpy.frombuffer(buffer,
+ * dtype='<u2') or numpy.asarray(batch.value) look at the data where it is without a copy. Buffers and
+ * batches never change once made, the views stay valid as long as the object (which they keep alive).
+ * The GIL is released around USB transfers; a Controller or Stream takes one such call at a time, a
+ * call from another thread meanwhile raises RuntimeError.
+ *
+ * Build with "make python".
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include "CVMUSB.h"
+#include "CVMUSBusb.h"
+#include "CVMUSBReadoutList.h"
+#include "CVMUSBBufferParser.h"
+#include "CModuleReadout.h"
+#include "CModuleRegistry.h"
+#include "CCrateScan.h"
+#include "Exception.h"
+#include "vmeClass.h"
+#include <errno.h>
+#include <string.h>
+#include <string>
+#include <memory>
+#include <new>
+#include <stdexcept>
+
+/*
+   Run f with the GIL released.  C++ exceptions the library throws are
+   caught before the GIL is taken back and become a RuntimeError.
+   Returns false if f threw (the Python error is then set).
+*/
+template<class F>
+static bool
+withoutGil(F f)
+{
+  std::string error;
+  bool        failed = true;
+  Py_BEGIN_ALLOW_THREADS
+  try {
+    f();
+    failed = false;
+  }
+  catch (CException& e)     { error = e.ReasonText(); }
+  catch (std::exception& e) { error = e.what(); }
+  catch (std::string& s)    { error = s; }
+  catch (const char* s)     { error = s; }
+  catch (...)               { error = "VM-USB error"; }
+  Py_END_ALLOW_THREADS
+  if (failed) PyErr_SetString(PyExc_RuntimeError, error.c_str());
+  return !failed;
+}
+
+/*
+   The same for a call on a Controller's VM-USB or a Stream's buffers.
+   The objects are marked busy meanwhile; finding one busy (another
+   thread is in the middle of a call on it) raises RuntimeError rather
+   than share the device or the buffers.  The flags are only looked at
+   and changed with the GIL held.
+*/
+template<class F>
+static bool
+withoutGil(bool& busy, bool& busy2, F f)
+{
+  if (busy || busy2) {
+    PyErr_SetString(PyExc_RuntimeError, "VM-USB call in progress in another thread");
+    return false;
+  }
+  busy  = true;
+  busy2 = true;
+  bool ok = withoutGil(f);
+  busy  = false;
+  busy2 = false;
+  return ok;
+}
+
+template<class F>
+static bool
+withoutGil(bool& busy, F f)
+{
+  return withoutGil(busy, busy, f);
+}
+
+static char emptyStorage[8];          // What zero length views point at.
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.Buffer: bytes owned by the object.
+
+typedef struct {
+  PyObject_HEAD
+  uint8_t*   data;
+  Py_ssize_t size;
+} BufferObject;
+
+static PyTypeObject BufferType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+/*
+   A buffer of capacity bytes whose contents are not initialized; the
+   caller fills it and sets size.
+*/
+static BufferObject*
+newBuffer(Py_ssize_t capacity)
+{
+  BufferObject* self = PyObject_New(BufferObject, &BufferType);
+  if (!self) return 0;
+  self->data = static_cast<uint8_t*>(PyMem_Malloc(capacity > 0 ? capacity : 1));
+  self->size = 0;
+  if (!self->data) {
+    Py_DECREF(self);
+    PyErr_NoMemory();
+    return 0;
+  }
+  return self;
+}
+
+static void
+Buffer_dealloc(BufferObject* self)
+{
+  PyMem_Free(self->data);
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static int
+Buffer_getbuffer(BufferObject* self, Py_buffer* view, int flags)
+{
+  return PyBuffer_FillInfo(view, reinterpret_cast<PyObject*>(self), self->data, self->size, 1, flags);
+}
+
+static Py_ssize_t
+Buffer_length(BufferObject* self)
+{
+  return self->size;
+}
+
+static PyBufferProcs     Buffer_as_buffer   = {(getbufferproc)Buffer_getbuffer, 0};
+static PySequenceMethods Buffer_as_sequence = {(lenfunc)Buffer_length};
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.Array: a typed view of storage owned by another object.
+
+typedef struct {
+  PyObject_HEAD
+  PyObject*   owner;
+  void*       data;
+  Py_ssize_t  n;
+  Py_ssize_t  itemsize;
+  const char* format;
+} ArrayObject;
+
+static PyTypeObject ArrayType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+template<class T>
+static PyObject*
+newArray(PyObject* owner, std::vector<T>& v, const char* format)
+{
+  ArrayObject* self = PyObject_New(ArrayObject, &ArrayType);
+  if (!self) return 0;
+  Py_INCREF(owner);
+  self->owner    = owner;
+  self->data     = v.empty() ? static_cast<void*>(emptyStorage) : static_cast<void*>(v.data());
+  self->n        = v.size();
+  self->itemsize = sizeof(T);
+  self->format   = format;
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static void
+Array_dealloc(ArrayObject* self)
+{
+  Py_XDECREF(self->owner);
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static int
+Array_getbuffer(ArrayObject* self, Py_buffer* view, int flags)
+{
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "vmusb.Array is read only");
+    return -1;
+  }
+  view->obj        = reinterpret_cast<PyObject*>(self);
+  Py_INCREF(self);
+  view->buf        = self->data;
+  view->len        = self->n * self->itemsize;
+  view->readonly   = 1;
+  view->itemsize   = self->itemsize;
+  view->format     = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->format) : 0;
+  view->ndim       = 1;
+  view->shape      = (flags & PyBUF_ND) ? &self->n : 0;
+  view->strides    = (flags & PyBUF_STRIDES) ? &self->itemsize : 0;
+  view->suboffsets = 0;
+  view->internal   = 0;
+  return 0;
+}
+
+static Py_ssize_t
+Array_length(ArrayObject* self)
+{
+  return self->n;
+}
+
+static PyBufferProcs     Array_as_buffer   = {(getbufferproc)Array_getbuffer, 0};
+static PySequenceMethods Array_as_sequence = {(lenfunc)Array_length};
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.Batch: decoded data, CModuleDriver::Batch.
+
+typedef struct {
+  PyObject_HEAD
+  CModuleDriver::Batch* batch;
+} BatchObject;
+
+static PyTypeObject BatchType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+/*
+   A Batch that takes over the contents of batch, leaving it empty (but
+   with the capacity the new batch does not need).
+*/
+static PyObject*
+newBatch(CModuleDriver::Batch& batch)
+{
+  BatchObject* self = PyObject_New(BatchObject, &BatchType);
+  if (!self) return 0;
+  self->batch = new CModuleDriver::Batch;
+  std::swap(*self->batch, batch);
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static void
+Batch_dealloc(BatchObject* self)
+{
+  delete self->batch;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject* Batch_module(BatchObject* self, void*)      { return newArray((PyObject*)self, self->batch->module, "B"); }
+static PyObject* Batch_channel(BatchObject* self, void*)     { return newArray((PyObject*)self, self->batch->channel, "B"); }
+static PyObject* Batch_value(BatchObject* self, void*)       { return newArray((PyObject*)self, self->batch->value, "H"); }
+static PyObject* Batch_event(BatchObject* self, void*)       { return newArray((PyObject*)self, self->batch->event, "I"); }
+static PyObject* Batch_eventModule(BatchObject* self, void*) { return newArray((PyObject*)self, self->batch->eventModule, "B"); }
+static PyObject* Batch_eventStamp(BatchObject* self, void*)  { return newArray((PyObject*)self, self->batch->eventStamp, "Q"); }
+static PyObject* Batch_firstHit(BatchObject* self, void*)    { return newArray((PyObject*)self, self->batch->firstHit, "I"); }
+static PyObject* Batch_hits(BatchObject* self, void*)        { return PyLong_FromSize_t(self->batch->hits()); }
+static PyObject* Batch_events(BatchObject* self, void*)      { return PyLong_FromSize_t(self->batch->events()); }
+
+static PyGetSetDef Batch_getset[] = {
+  {"module",       (getter)Batch_module,      0, "Module id of each hit (uint8)."},
+  {"channel",      (getter)Batch_channel,     0, "Channel of each hit (uint8)."},
+  {"value",        (getter)Batch_value,       0, "Value of each hit (uint16)."},
+  {"event",        (getter)Batch_event,       0, "Module event of each hit (uint32)."},
+  {"event_module", (getter)Batch_eventModule, 0, "Module id of each module event (uint8)."},
+  {"event_stamp",  (getter)Batch_eventStamp,  0, "Timestamp of each module event (uint64)."},
+  {"first_hit",    (getter)Batch_firstHit,    0, "First hit of each module event (uint32)."},
+  {"hits",         (getter)Batch_hits,        0, "Number of hits."},
+  {"events",       (getter)Batch_events,      0, "Number of module events."},
+  {0}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.ReadoutList
+
+typedef struct {
+  PyObject_HEAD
+  CVMUSBReadoutList* list;
+} ListObject;
+
+static PyTypeObject ListType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+static PyObject*
+List_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+  // The list exists from here on so no method (nor buildStack) finds it missing, even when
+  // ReadoutList.__new__ is called without __init__.
+  ListObject* self = reinterpret_cast<ListObject*>(PyType_GenericNew(type, args, kwds));
+  if (!self) return 0;
+  self->list = new (std::nothrow) CVMUSBReadoutList;
+  if (!self->list) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  return reinterpret_cast<PyObject*>(self);
+}
+
+static int
+List_init(ListObject* self, PyObject* args, PyObject*)
+{
+  if (!PyArg_ParseTuple(args, ":ReadoutList")) return -1;
+  self->list->clear();
+  return 0;
+}
+
+static void
+List_dealloc(ListObject* self)
+{
+  delete self->list;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static PyObject*
+List_clear(ListObject* self, PyObject*)
+{
+  self->list->clear();
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+List_length(ListObject* self)
+{
+  return self->list->size();
+}
+
+static PyObject*
+List_addWrite32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod, datum;
+  if (!PyArg_ParseTuple(args, "III:addWrite32", &address, &amod, &datum)) return 0;
+  self->list->addWrite32(address, amod, datum);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addWrite16(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod, datum;
+  if (!PyArg_ParseTuple(args, "III:addWrite16", &address, &amod, &datum)) return 0;
+  self->list->addWrite16(address, amod, datum);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addRead32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  if (!PyArg_ParseTuple(args, "II:addRead32", &address, &amod)) return 0;
+  self->list->addRead32(address, amod);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addRead16(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  if (!PyArg_ParseTuple(args, "II:addRead16", &address, &amod)) return 0;
+  self->list->addRead16(address, amod);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addBlockRead32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod, transfers;
+  if (!PyArg_ParseTuple(args, "III:addBlockRead32", &address, &amod, &transfers)) return 0;
+  self->list->addBlockRead32(address, amod, transfers);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addFifoRead32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod, transfers;
+  if (!PyArg_ParseTuple(args, "III:addFifoRead32", &address, &amod, &transfers)) return 0;
+  self->list->addFifoRead32(address, amod, transfers);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addBlockWrite32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  Py_buffer    data;
+  if (!PyArg_ParseTuple(args, "IIy*:addBlockWrite32", &address, &amod, &data)) return 0;
+  if (data.len % sizeof(uint32_t)) {
+    PyBuffer_Release(&data);
+    PyErr_SetString(PyExc_ValueError, "addBlockWrite32 needs a whole number of longwords");
+    return 0;
+  }
+  self->list->addBlockWrite32(address, amod, data.buf, data.len / sizeof(uint32_t));
+  PyBuffer_Release(&data);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addBlockCountRead16(ListObject* self, PyObject* args)
+{
+  unsigned int address, mask, amod;
+  if (!PyArg_ParseTuple(args, "III:addBlockCountRead16", &address, &mask, &amod)) return 0;
+  self->list->addBlockCountRead16(address, mask, amod);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addMaskedCountFifoRead32(ListObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  if (!PyArg_ParseTuple(args, "II:addMaskedCountFifoRead32", &address, &amod)) return 0;
+  self->list->addMaskedCountFifoRead32(address, amod);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addRegisterRead(ListObject* self, PyObject* args)
+{
+  unsigned int address;
+  if (!PyArg_ParseTuple(args, "I:addRegisterRead", &address)) return 0;
+  self->list->addRegisterRead(address);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addRegisterWrite(ListObject* self, PyObject* args)
+{
+  unsigned int address, datum;
+  if (!PyArg_ParseTuple(args, "II:addRegisterWrite", &address, &datum)) return 0;
+  self->list->addRegisterWrite(address, datum);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addDelay(ListObject* self, PyObject* args)
+{
+  unsigned char clocks;
+  if (!PyArg_ParseTuple(args, "b:addDelay", &clocks)) return 0;
+  self->list->addDelay(clocks);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+List_addMarker(ListObject* self, PyObject* args)
+{
+  unsigned short value;
+  if (!PyArg_ParseTuple(args, "H:addMarker", &value)) return 0;
+  self->list->addMarker(value);
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef List_methods[] = {
+  {"clear",                    (PyCFunction)List_clear,                    METH_NOARGS,  "Remove all the entries."},
+  {"addWrite32",               (PyCFunction)List_addWrite32,               METH_VARARGS, "addWrite32(address, amod, datum)"},
+  {"addWrite16",               (PyCFunction)List_addWrite16,               METH_VARARGS, "addWrite16(address, amod, datum)"},
+  {"addRead32",                (PyCFunction)List_addRead32,                METH_VARARGS, "addRead32(address, amod)"},
+  {"addRead16",                (PyCFunction)List_addRead16,                METH_VARARGS, "addRead16(address, amod)"},
+  {"addBlockRead32",           (PyCFunction)List_addBlockRead32,           METH_VARARGS, "addBlockRead32(address, amod, transfers)"},
+  {"addFifoRead32",            (PyCFunction)List_addFifoRead32,            METH_VARARGS, "addFifoRead32(address, amod, transfers)"},
+  {"addBlockWrite32",          (PyCFunction)List_addBlockWrite32,          METH_VARARGS, "addBlockWrite32(address, amod, bytes)"},
+  {"addBlockCountRead16",      (PyCFunction)List_addBlockCountRead16,      METH_VARARGS, "addBlockCountRead16(address, mask, amod)"},
+  {"addMaskedCountFifoRead32", (PyCFunction)List_addMaskedCountFifoRead32, METH_VARARGS, "addMaskedCountFifoRead32(address, amod)"},
+  {"addRegisterRead",          (PyCFunction)List_addRegisterRead,          METH_VARARGS, "addRegisterRead(register)"},
+  {"addRegisterWrite",         (PyCFunction)List_addRegisterWrite,         METH_VARARGS, "addRegisterWrite(register, datum)"},
+  {"addDelay",                 (PyCFunction)List_addDelay,                 METH_VARARGS, "addDelay(clocks)"},
+  {"addMarker",                (PyCFunction)List_addMarker,                METH_VARARGS, "addMarker(value)"},
+  {0}
+};
+
+static PySequenceMethods List_as_sequence = {(lenfunc)List_length};
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.Controller
+
+typedef struct {
+  PyObject_HEAD
+  CVMUSBusb*  vmusb;
+  std::string* serial;
+  bool         busy;            // A call is using vmusb without the GIL.
+} ControllerObject;
+
+static PyTypeObject ControllerType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+/*
+   Controller(serial=None): open the VM-USB with that serial number, or
+   the first one found.
+*/
+static int
+Controller_init(ControllerObject* self, PyObject* args, PyObject* kwds)
+{
+  static const char* keywords[] = {"serial", 0};
+  const char* serial = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:Controller", const_cast<char**>(keywords), &serial)) {
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Controller is in use by another thread");
+    return -1;
+  }
+  try {
+    std::vector<struct usb_device*> devices = CVMUSB::enumerate();
+    for (size_t i = 0; i < devices.size(); i++) {
+      std::string s = CVMUSB::serialNo(devices[i]);
+      if (serial && (s != serial)) continue;
+      delete self->vmusb;
+      delete self->serial;
+      self->vmusb  = new CVMUSBusb(devices[i]);
+      self->serial = new std::string(s);
+      return 0;
+    }
+  }
+  catch (CException& e)     { PyErr_SetString(PyExc_RuntimeError, e.ReasonText()); return -1; }
+  catch (std::exception& e) { PyErr_SetString(PyExc_RuntimeError, e.what());       return -1; }
+  catch (std::string& s)    { PyErr_SetString(PyExc_RuntimeError, s.c_str());      return -1; }
+  catch (const char* s)     { PyErr_SetString(PyExc_RuntimeError, s);              return -1; }
+
+  PyErr_SetString(PyExc_OSError, serial ? "No VM-USB with that serial number" : "No VM-USB found");
+  return -1;
+}
+
+static void
+Controller_dealloc(ControllerObject* self)
+{
+  delete self->vmusb;
+  delete self->serial;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static CVMUSBusb*
+controller(ControllerObject* self)
+{
+  if (!self->vmusb) PyErr_SetString(PyExc_ValueError, "Controller is not open");
+  return self->vmusb;
+}
+
+static PyObject*
+Controller_serial(ControllerObject* self, PyObject*)
+{
+  if (!controller(self)) return 0;
+  return PyUnicode_FromString(self->serial->c_str());
+}
+
+static PyObject*
+Controller_readRegister(ControllerObject* self, PyObject* args)
+{
+  unsigned int address;
+  if (!controller(self) || !PyArg_ParseTuple(args, "I:readRegister", &address)) return 0;
+  uint32_t value = 0;
+  if (!withoutGil(self->busy, [&] { value = self->vmusb->readRegister(address); })) return 0;
+  return PyLong_FromUnsignedLong(value);
+}
+
+static PyObject*
+Controller_writeRegister(ControllerObject* self, PyObject* args)
+{
+  unsigned int address, value;
+  if (!controller(self) || !PyArg_ParseTuple(args, "II:writeRegister", &address, &value)) return 0;
+  if (!withoutGil(self->busy, [&] { self->vmusb->writeRegister(address, value); })) return 0;
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+Controller_writeActionRegister(ControllerObject* self, PyObject* args)
+{
+  unsigned short value;
+  if (!controller(self) || !PyArg_ParseTuple(args, "H:writeActionRegister", &value)) return 0;
+  if (!withoutGil(self->busy, [&] { self->vmusb->writeActionRegister(value); })) return 0;
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+Controller_vmeRead32(ControllerObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  if (!controller(self) || !PyArg_ParseTuple(args, "II:vmeRead32", &address, &amod)) return 0;
+  uint32_t value  = 0;
+  int      status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->vmeRead32(address, amod, &value); })) return 0;
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  return PyLong_FromUnsignedLong(value);
+}
+
+static PyObject*
+Controller_vmeRead16(ControllerObject* self, PyObject* args)
+{
+  unsigned int address, amod;
+  if (!controller(self) || !PyArg_ParseTuple(args, "II:vmeRead16", &address, &amod)) return 0;
+  uint16_t value  = 0;
+  int      status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->vmeRead16(address, amod, &value); })) return 0;
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  return PyLong_FromUnsignedLong(value);
+}
+
+static PyObject*
+Controller_vmeWrite32(ControllerObject* self, PyObject* args)
+{
+  unsigned int address, amod, value;
+  if (!controller(self) || !PyArg_ParseTuple(args, "III:vmeWrite32", &address, &amod, &value)) return 0;
+  int status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->vmeWrite32(address, amod, value); })) return 0;
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+Controller_vmeWrite16(ControllerObject* self, PyObject* args)
+{
+  unsigned int address, amod, value;
+  if (!controller(self) || !PyArg_ParseTuple(args, "III:vmeWrite16", &address, &amod, &value)) return 0;
+  int status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->vmeWrite16(address, amod, value); })) return 0;
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+/*
+   executeList(list, maxBytes) -> Buffer holding what the list read.
+*/
+static PyObject*
+Controller_executeList(ControllerObject* self, PyObject* args)
+{
+  ListObject* list;
+  Py_ssize_t  maxBytes;
+  if (!controller(self) || !PyArg_ParseTuple(args, "O!n:executeList", &ListType, &list, &maxBytes)) return 0;
+  if (maxBytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "maxBytes must not be negative");
+    return 0;
+  }
+  BufferObject* result = newBuffer(maxBytes);
+  if (!result) return 0;
+  size_t nRead  = 0;
+  int    status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->executeList(*list->list, result->data, maxBytes, &nRead); }) ||
+      (status < 0)) {
+    Py_DECREF(result);
+    return PyErr_Occurred() ? 0 : PyErr_SetFromErrno(PyExc_OSError);
+  }
+  result->size = nRead;
+  return reinterpret_cast<PyObject*>(result);
+}
+
+static PyObject*
+Controller_loadList(ControllerObject* self, PyObject* args)
+{
+  unsigned char listNumber;
+  ListObject*   list;
+  long          offset = 0;
+  if (!controller(self) ||
+      !PyArg_ParseTuple(args, "bO!|l:loadList", &listNumber, &ListType, &list, &offset)) return 0;
+  int status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->loadList(listNumber, *list->list, offset); })) return 0;
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+/*
+   usbRead(maxBytes, timeoutMs) -> Buffer, or None if nothing came in time.
+*/
+static PyObject*
+Controller_usbRead(ControllerObject* self, PyObject* args)
+{
+  Py_ssize_t maxBytes;
+  int        timeout = 1000;
+  if (!controller(self) || !PyArg_ParseTuple(args, "n|i:usbRead", &maxBytes, &timeout)) return 0;
+  if (maxBytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "maxBytes must not be negative");
+    return 0;
+  }
+  BufferObject* result = newBuffer(maxBytes);
+  if (!result) return 0;
+  size_t nRead  = 0;
+  int    status = 0;
+  if (!withoutGil(self->busy, [&] { status = self->vmusb->usbRead(result->data, maxBytes, &nRead, timeout); })) {
+    Py_DECREF(result);
+    return 0;
+  }
+  if (status < 0) {
+    Py_DECREF(result);
+    if (errno == ETIMEDOUT) Py_RETURN_NONE;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  result->size = nRead;
+  return reinterpret_cast<PyObject*>(result);
+}
+
+/*
+   scan() -> [(base, moduleId, firmware, typeName), ...] (CCrateScan).
+*/
+static PyObject*
+Controller_scan(ControllerObject* self, PyObject*)
+{
+  if (!controller(self)) return 0;
+  std::vector<CCrateScan::Module> crate;
+  if (!withoutGil(self->busy, [&] { crate = CCrateScan::scan(*self->vmusb); })) return 0;
+  PyObject* result = PyList_New(crate.size());
+  if (!result) return 0;
+  for (size_t i = 0; i < crate.size(); i++) {
+    PyList_SET_ITEM(result, i, Py_BuildValue("(kHHs)", static_cast<unsigned long>(crate[i].base),
+					     crate[i].moduleId, crate[i].firmware,
+					     CCrateScan::typeName(crate[i].type)));
+  }
+  return result;
+}
+
+static PyMethodDef Controller_methods[] = {
+  {"serial",              (PyCFunction)Controller_serial,              METH_NOARGS,  "Serial number of the VM-USB."},
+  {"readRegister",        (PyCFunction)Controller_readRegister,        METH_VARARGS, "readRegister(register) -> value"},
+  {"writeRegister",       (PyCFunction)Controller_writeRegister,       METH_VARARGS, "writeRegister(register, value)"},
+  {"writeActionRegister", (PyCFunction)Controller_writeActionRegister, METH_VARARGS, "writeActionRegister(value)"},
+  {"vmeRead32",           (PyCFunction)Controller_vmeRead32,           METH_VARARGS, "vmeRead32(address, amod) -> value"},
+  {"vmeRead16",           (PyCFunction)Controller_vmeRead16,           METH_VARARGS, "vmeRead16(address, amod) -> value"},
+  {"vmeWrite32",          (PyCFunction)Controller_vmeWrite32,          METH_VARARGS, "vmeWrite32(address, amod, value)"},
+  {"vmeWrite16",          (PyCFunction)Controller_vmeWrite16,          METH_VARARGS, "vmeWrite16(address, amod, value)"},
+  {"executeList",         (PyCFunction)Controller_executeList,         METH_VARARGS, "executeList(list, maxBytes) -> Buffer"},
+  {"loadList",            (PyCFunction)Controller_loadList,            METH_VARARGS, "loadList(stack, list, offset=0)"},
+  {"usbRead",             (PyCFunction)Controller_usbRead,             METH_VARARGS, "usbRead(maxBytes, timeoutMs=1000) -> Buffer or None"},
+  {"scan",                (PyCFunction)Controller_scan,                METH_NOARGS,  "scan() -> [(base, moduleId, firmware, type), ...]"},
+  {0}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// vmusb.Stream
+
+typedef struct {
+  PyObject_HEAD
+  ControllerObject*   controller;
+  CVMUSBBufferParser* parser;
+  CModuleReadout*     readout;
+  uint8_t*            buffer;
+  Py_ssize_t          bufferBytes;
+  bool                busy;     // A call is using buffer/parser without the GIL.
+} StreamObject;
+
+static PyTypeObject StreamType = {PyVarObject_HEAD_INIT(NULL, 0)};
+
+/*
+   Stream(controller=None, stack=0, marker=0xbde7, bufferBytes=65536):
+   decode the events of the readout stack with the module drivers
+   registered in vme::moduleDrivers.  Give it the crate with scan() or
+   setInventory().  Without a controller only parse() works, e.g. for
+   buffers read back from a file.  A negative marker means the stack has
+   none.
+*/
+static int
+Stream_init(StreamObject* self, PyObject* args, PyObject* kwds)
+{
+  static const char* keywords[] = {"controller", "stack", "marker", "bufferBytes", 0};
+  PyObject*     ctl         = Py_None;
+  unsigned char stack       = 0;
+  int           marker      = 0xbde7;
+  Py_ssize_t    bufferBytes = 65536;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Obin:Stream", const_cast<char**>(keywords),
+				   &ctl, &stack, &marker, &bufferBytes)) return -1;
+  if ((ctl != Py_None) && !PyObject_TypeCheck(ctl, &ControllerType)) {
+    PyErr_SetString(PyExc_TypeError, "controller must be a vmusb.Controller or None");
+    return -1;
+  }
+  if ((stack >= CVMUSBBufferParser::maxStacks) || (bufferBytes <= 0)) {
+    PyErr_SetString(PyExc_ValueError, "bad stack number or buffer size");
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Stream is in use by another thread");
+    return -1;
+  }
+  uint8_t* buffer = static_cast<uint8_t*>(PyMem_Malloc(bufferBytes));
+  if (!buffer) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  Py_XDECREF(self->controller);
+  self->controller = 0;
+  if (ctl != Py_None) {
+    Py_INCREF(ctl);
+    self->controller = reinterpret_cast<ControllerObject*>(ctl);
+  }
+  delete self->parser;
+  delete self->readout;
+  PyMem_Free(self->buffer);
+  self->parser      = new CVMUSBBufferParser;
+  self->readout     = new CModuleReadout(vme().moduleDrivers());
+  self->buffer      = buffer;
+  self->bufferBytes = bufferBytes;
+  if (marker >= 0) {
+    self->readout->setMarker(marker);
+    self->parser->setMarker(stack, marker);
+  }
+  self->parser->setHandler(stack, self->readout);
+  return 0;
+}
+
+static void
+Stream_dealloc(StreamObject* self)
+{
+  delete self->parser;
+  delete self->readout;
+  PyMem_Free(self->buffer);
+  Py_XDECREF(self->controller);
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static bool
+streamReady(StreamObject* self)
+{
+  if (!self->parser) {
+    PyErr_SetString(PyExc_ValueError, "Stream is not initialized");
+    return false;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "Stream is in use by another thread");
+    return false;
+  }
+  return true;
+}
+
+static bool
+streamOnline(StreamObject* self)
+{
+  if (!streamReady(self)) return false;
+  if (!self->controller) {
+    PyErr_SetString(PyExc_ValueError, "Stream has no controller");
+    return false;
+  }
+  return controller(self->controller) != 0;
+}
+
+static PyObject*
+Stream_scan(StreamObject* self, PyObject*)
+{
+  if (!streamOnline(self)) return 0;
+  std::vector<CCrateScan::Module> crate;
+  if (!withoutGil(self->busy, self->controller->busy,
+		  [&] { crate = CCrateScan::scan(*self->controller->vmusb); })) return 0;
+  return PyLong_FromSize_t(self->readout->setInventory(crate));
+}
+
+/*
+   setInventory([(base, moduleId, firmware), ...]) -> modules with a driver.
+*/
+static PyObject*
+Stream_setInventory(StreamObject* self, PyObject* args)
+{
+  PyObject* seq;
+  if (!streamReady(self) || !PyArg_ParseTuple(args, "O:setInventory", &seq)) return 0;
+  PyObject* fast = PySequence_Fast(seq, "setInventory needs a sequence of (base, moduleId, firmware)");
+  if (!fast) return 0;
+
+  std::vector<CCrateScan::Module> crate;
+  for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+    unsigned long  base;
+    unsigned short id, firmware;
+    const char*    name = 0;
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(fast, i), "kHH|s", &base, &id, &firmware, &name)) {
+      Py_DECREF(fast);
+      return 0;
+    }
+    CCrateScan::Module m = {static_cast<uint32_t>(base), id, firmware, CCrateScan::typeOf(firmware)};
+    crate.push_back(m);
+  }
+  Py_DECREF(fast);
+  if (!streamReady(self)) return 0;             // The items' code may have let another thread in.
+  return PyLong_FromSize_t(self->readout->setInventory(crate));
+}
+
+/*
+   buildStack(list): append the composed readout stack to a ReadoutList.
+*/
+static PyObject*
+Stream_buildStack(StreamObject* self, PyObject* args)
+{
+  ListObject* list;
+  if (!streamReady(self) || !PyArg_ParseTuple(args, "O!:buildStack", &ListType, &list)) return 0;
+  self->readout->addReadout(*list->list);
+  Py_RETURN_NONE;
+}
+
+/*
+   parse(buffer) -> Batch: decode a buffer read elsewhere (e.g. a file),
+   anything with the buffer protocol.
+*/
+static PyObject*
+Stream_parse(StreamObject* self, PyObject* args)
+{
+  Py_buffer data;
+  if (!streamReady(self) || !PyArg_ParseTuple(args, "y*:parse", &data)) return 0;
+  int status = self->parser->parse(data.buf, data.len);
+  PyBuffer_Release(&data);
+  if (status < 0) {
+    PyErr_SetString(PyExc_ValueError, "malformed VM-USB buffer");
+    return 0;
+  }
+  return newBatch(self->readout->batch());
+}
+
+/*
+   read(timeoutMs=1000) -> Batch, or None if no buffer came in time.
+*/
+static PyObject*
+Stream_read(StreamObject* self, PyObject* args)
+{
+  int timeout = 1000;
+  if (!streamOnline(self) || !PyArg_ParseTuple(args, "|i:read", &timeout)) return 0;
+  size_t     nRead  = 0;
+  int        status = 0;
+  CVMUSBusb* vmusb  = self->controller->vmusb;
+  if (!withoutGil(self->busy, self->controller->busy,
+		  [&] { status = vmusb->recoveringRead(self->buffer, self->bufferBytes, &nRead, timeout); })) {
+    return 0;
+  }
+  if (status < 0) {
+    if (errno == ETIMEDOUT) Py_RETURN_NONE;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  self->parser->parse(self->buffer, nRead);
+  return newBatch(self->readout->batch());
+}
+
+/*
+   stop(maxLatencyMs=1000, action=0) -> Batch: end data taking and decode
+   what the VM-USB still held (CVMUSB::stopAndDrain).
+*/
+static PyObject*
+Stream_stop(StreamObject* self, PyObject* args)
+{
+  int            maxLatency = 1000;
+  unsigned short action     = 0;
+  if (!streamOnline(self) || !PyArg_ParseTuple(args, "|iH:stop", &maxLatency, &action)) return 0;
+  int status = 0;
+  if (!withoutGil(self->busy, self->controller->busy,
+		  [&] { status = self->controller->vmusb->stopAndDrain(self->parser, 0, maxLatency, action); })) {
+    return 0;
+  }
+  if (status < 0) return PyErr_SetFromErrno(PyExc_OSError);
+  return newBatch(self->readout->batch());
+}
+
+static PyObject*
+Stream_statistics(StreamObject* self, PyObject*)
+{
+  if (!streamReady(self)) return 0;
+  const CVMUSBBufferParser::Statistics& p = self->parser->statistics();
+  const CModuleReadout::Statistics&     r = self->readout->statistics();
+  return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:O}",
+		       "buffers", (Py_ssize_t)p.buffers, "bytes", (Py_ssize_t)p.bytes,
+		       "scalerBuffers", (Py_ssize_t)p.scalerBuffers, "events", (Py_ssize_t)p.events,
+		       "badBuffers", (Py_ssize_t)p.badBuffers, "framingErrors", (Py_ssize_t)p.framingErrors,
+		       "resyncs", (Py_ssize_t)p.resyncs, "skippedBytes", (Py_ssize_t)p.skippedBytes,
+		       "stackEvents", (Py_ssize_t)r.stackEvents, "moduleEvents", (Py_ssize_t)r.moduleEvents,
+		       "unknownEvents", (Py_ssize_t)r.unknownEvents,
+		       "lastBufferSeen", self->parser->lastBufferSeen() ? Py_True : Py_False);
+}
+
+static PyMethodDef Stream_methods[] = {
+  {"scan",         (PyCFunction)Stream_scan,         METH_NOARGS,  "Take the crate inventory from a crate scan."},
+  {"setInventory", (PyCFunction)Stream_setInventory, METH_VARARGS, "setInventory([(base, moduleId, firmware), ...])"},
+  {"buildStack",   (PyCFunction)Stream_buildStack,   METH_VARARGS, "buildStack(list): add the readout stack to list."},
+  {"parse",        (PyCFunction)Stream_parse,        METH_VARARGS, "parse(buffer) -> Batch"},
+  {"read",         (PyCFunction)Stream_read,         METH_VARARGS, "read(timeoutMs=1000) -> Batch or None"},
+  {"stop",         (PyCFunction)Stream_stop,         METH_VARARGS, "stop(maxLatencyMs=1000, action=0) -> Batch"},
+  {"statistics",   (PyCFunction)Stream_statistics,   METH_NOARGS,  "Parser and decoder counters."},
+  {0}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The module.
+
+static struct PyModuleDef vmusbModule = {
+  PyModuleDef_HEAD_INIT, "vmusb", "Wiener VM-USB access and Mesytec data decoding.", -1, 0
+};
+
+static int
+addType(PyObject* module, PyTypeObject* type, const char* name, const char* doc, Py_ssize_t size,
+	destructor dealloc)
+{
+  type->tp_name      = name;
+  type->tp_doc       = doc;
+  type->tp_basicsize = size;
+  type->tp_dealloc   = dealloc;
+  type->tp_flags     = Py_TPFLAGS_DEFAULT;
+  if (PyType_Ready(type) < 0) return -1;
+  Py_INCREF(type);
+  return PyModule_AddObject(module, strrchr(name, '.') + 1, reinterpret_cast<PyObject*>(type));
+}
+
+PyMODINIT_FUNC
+PyInit_vmusb(void)
+{
+  BufferType.tp_as_buffer       = &Buffer_as_buffer;
+  BufferType.tp_as_sequence     = &Buffer_as_sequence;
+  ArrayType.tp_as_buffer        = &Array_as_buffer;
+  ArrayType.tp_as_sequence      = &Array_as_sequence;
+  BatchType.tp_getset           = Batch_getset;
+  ListType.tp_methods           = List_methods;
+  ListType.tp_as_sequence       = &List_as_sequence;
+  ListType.tp_init              = (initproc)List_init;
+  ListType.tp_new               = List_new;
+  ControllerType.tp_methods     = Controller_methods;
+  ControllerType.tp_init        = (initproc)Controller_init;
+  ControllerType.tp_new         = PyType_GenericNew;
+  StreamType.tp_methods         = Stream_methods;
+  StreamType.tp_init            = (initproc)Stream_init;
+  StreamType.tp_new             = PyType_GenericNew;
+
+  PyObject* module = PyModule_Create(&vmusbModule);
+  if (!module) return 0;
+  if ((addType(module, &BufferType, "vmusb.Buffer", "Raw bytes read from the VM-USB.",
+	       sizeof(BufferObject), (destructor)Buffer_dealloc) < 0)                              ||
+      (addType(module, &ArrayType, "vmusb.Array", "One field of a Batch.",
+	       sizeof(ArrayObject), (destructor)Array_dealloc) < 0)                                ||
+      (addType(module, &BatchType, "vmusb.Batch", "Decoded hits and module events.",
+	       sizeof(BatchObject), (destructor)Batch_dealloc) < 0)                                ||
+      (addType(module, &ListType, "vmusb.ReadoutList", "A VM-USB stack / immediate list.",
+	       sizeof(ListObject), (destructor)List_dealloc) < 0)                                  ||
+      (addType(module, &ControllerType, "vmusb.Controller", "Controller(serial=None): a VM-USB.",
+	       sizeof(ControllerObject), (destructor)Controller_dealloc) < 0)                      ||
+      (addType(module, &StreamType, "vmusb.Stream", "Stream(controller=None, stack=0, marker=0xbde7, bufferBytes=65536)",
+	       sizeof(StreamObject), (destructor)Stream_dealloc) < 0)) {
+    Py_DECREF(module);
+    return 0;
+  }
+  return module;
+}